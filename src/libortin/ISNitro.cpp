@@ -19,10 +19,22 @@
 
 // C++ includes.
 #include <algorithm>
+#include <atomic>
 #include <memory>
+#include <string>
+#include <vector>
+using std::string;
 using std::unique_ptr;
+using std::vector;
 
 #include "byteswap.h"
+#include "NitroTrace.hpp"
+#include "NitroLog.hpp"
+#include "NitroAsync.hpp"
+#include "NitroEventThread.hpp"
+#include "NitroMetrics.hpp"
+#include "NitroCommands.hpp"
+#include "NitroNECBatch.hpp"
 
 // Debug ROM
 #include "bins/debugger_code.h"
@@ -37,25 +49,43 @@ using std::unique_ptr;
  */
 ISNitro::ISNitro(libusb_context *ctx)
 	: m_ctx(ctx)
+	, m_device(nullptr)
+	, m_trace(nullptr)
+	, m_recorder(nullptr)
+	, m_replay(nullptr)
+	, m_latency(nullptr)
+	, m_metrics(nullptr)
+	, m_emuMemSize(0)
+	, m_necShadowValid(0)
+	, m_monitorShadowValid(0)
+	, m_curCPU(CPU_UNKNOWN)
+	, m_capture(nullptr)
+{
+	openDevice();
+}
+
+/**
+ * Open the IS-NITRO device.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::openDevice(void)
 {
 	// Open an IS-NITRO device.
 	// TODO: This ID is for the IS-NITRO USG model.
 	// Add more IDs for IS-NITRO NTR and IS-TWL?
 	// TODO: Support for multiple IS-NITRO units.
-	m_device = libusb_open_device_with_vid_pid(ctx, 0x0F6E, 0x0404);
+	m_device = libusb_open_device_with_vid_pid(m_ctx, 0x0F6E, 0x0404);
 	if (!m_device) {
-		return;
+		return LIBUSB_ERROR_NO_DEVICE;
 	}
 
-	// TODO: Error checking.
-
 	// Set the active configuration.
 	int ret = libusb_set_configuration(m_device, 1);
 	if (ret < 0) {
 		// Unable to set the device configuration.
 		libusb_close(m_device);
 		m_device = nullptr;
-		return;
+		return ret;
 	}
 
 	// Reset may be needed to avoid timeout errors.
@@ -64,7 +94,7 @@ ISNitro::ISNitro(libusb_context *ctx)
 		// Unable to reset the device.
 		libusb_close(m_device);
 		m_device = nullptr;
-		return;
+		return ret;
 	}
 
 	// Claim the interface.
@@ -73,10 +103,57 @@ ISNitro::ISNitro(libusb_context *ctx)
 		// Unable to claim the interface.
 		libusb_close(m_device);
 		m_device = nullptr;
-		return;
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Close and re-open the IS-NITRO device.
+ * This can recover from USB errors caused by flaky hubs.
+ * EMULATOR memory is not cleared, but the NDS reset state
+ * should be set again afterwards.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::reopen(void)
+{
+	if (m_replay) {
+		// Can't re-open a replay.
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	if (m_device) {
+		libusb_release_interface(m_device, 0);
+		libusb_close(m_device);
+		m_device = nullptr;
 	}
+
+	// The unit may have been power-cycled.
+	invalidateRegisterCache();
+	return openDevice();
 }
 
+/**
+ * Create a virtual IS-NITRO unit that replays a command stream log.
+ * No USB device is opened; all transfers are handled by the replayer.
+ * @param replay NitroReplay. (must remain valid for the lifetime of this object)
+ */
+ISNitro::ISNitro(NitroReplay *replay)
+	: m_ctx(nullptr)
+	, m_device(nullptr)
+	, m_trace(nullptr)
+	, m_recorder(nullptr)
+	, m_replay(replay)
+	, m_latency(nullptr)
+	, m_metrics(nullptr)
+	, m_emuMemSize(0)
+	, m_necShadowValid(0)
+	, m_monitorShadowValid(0)
+	, m_curCPU(CPU_UNKNOWN)
+	, m_capture(nullptr)
+{ }
+
 ISNitro::~ISNitro()
 {
 	if (m_device) {
@@ -85,6 +162,181 @@ ISNitro::~ISNitro()
 	}
 }
 
+/**
+ * Get the USB location of this unit, e.g. "3-1.4".
+ * This is stable across re-plugs into the same port,
+ * so it can be used to identify units in a rack.
+ * @return USB location, or "replay" for a replay.
+ */
+string ISNitro::location(void) const
+{
+	if (m_replay) {
+		return "replay";
+	} else if (!m_device) {
+		return string();
+	}
+
+	libusb_device *const dev = libusb_get_device(m_device);
+	char buf[64];
+	int pos = snprintf(buf, sizeof(buf), "%u", libusb_get_bus_number(dev));
+
+	uint8_t ports[7];
+	const int count = libusb_get_port_numbers(dev, ports, (int)sizeof(ports));
+	for (int i = 0; i < count; i++) {
+		pos += snprintf(&buf[pos], sizeof(buf) - pos, "%c%u", (i == 0 ? '-' : '.'), ports[i]);
+	}
+	return string(buf);
+}
+
+/**
+ * Perform a bulk transfer.
+ * All USB traffic goes through this function so it can be
+ * recorded or replayed.
+ * @param endpoint	[in] Endpoint.
+ * @param data		[in/out] Data.
+ * @param len		[in] Length of data.
+ * @param transferred	[out] Actual transferred length.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::bulkTransfer(uint8_t endpoint, uint8_t *data, int len, int *transferred)
+{
+	if (m_capture) {
+		// Capturing commands for NitroTask.
+		// Only OUT transfers can be captured.
+		*transferred = 0;
+		if (endpoint & 0x80)
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		m_capture->transfers.push_back(std::vector<uint8_t>(data, data + len));
+		*transferred = len;
+		return 0;
+	}
+
+	if (m_replay) {
+		return m_replay->transfer(endpoint, data, len, transferred);
+	}
+
+	if (!m_recorder && !m_metrics) {
+		return libusb_bulk_transfer(m_device, endpoint, data, len, transferred, 1000);
+	}
+
+	const uint64_t ts = NitroTrace::now();
+	int ret = libusb_bulk_transfer(m_device, endpoint, data, len, transferred, 1000);
+	const uint64_t te = NitroTrace::now();
+	if (m_recorder) {
+		m_recorder->record(endpoint, data, len, *transferred, ret, ts, te);
+	}
+	if (m_metrics) {
+		m_metrics->recordTransfer(endpoint, *transferred, ret, te - ts);
+	}
+	return ret;
+}
+
+/**
+ * Asynchronous bulk transfer state.
+ */
+struct AsyncBulkTransfer {
+	NitroRecorder *recorder;
+	NitroLatencyStats *latency;
+	NitroMetrics *metrics;
+	ISNitro::BulkCallback callback;
+	void *userdata;
+	uint64_t ts;
+};
+
+/**
+ * Convert a libusb transfer status to a libusb error code.
+ * This matches the conversion done by libusb_bulk_transfer().
+ * @param status Transfer status.
+ * @return 0 on success; libusb error code on error.
+ */
+static int transferStatusToError(enum libusb_transfer_status status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:	return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT:	return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:	return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_OVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+		case LIBUSB_TRANSFER_NO_DEVICE:	return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_CANCELLED:	return LIBUSB_ERROR_INTERRUPTED;
+		default:			break;
+	}
+	return LIBUSB_ERROR_IO;
+}
+
+/**
+ * libusb completion callback for submitBulkTransfer().
+ * @param xfer libusb transfer.
+ */
+static void LIBUSB_CALL asyncBulkTransferCallback(struct libusb_transfer *xfer)
+{
+	AsyncBulkTransfer *const abt = static_cast<AsyncBulkTransfer*>(xfer->user_data);
+	const int ret = transferStatusToError(xfer->status);
+	const uint64_t te = NitroTrace::now();
+	if (abt->latency) {
+		abt->latency->record(te - abt->ts);
+	}
+	if (abt->recorder) {
+		abt->recorder->record(xfer->endpoint, xfer->buffer, xfer->length,
+			xfer->actual_length, ret, abt->ts, te);
+	}
+	if (abt->metrics) {
+		abt->metrics->recordTransfer(xfer->endpoint, xfer->actual_length, ret, te - abt->ts);
+	}
+	abt->callback(ret, xfer->actual_length, abt->userdata);
+	delete abt;
+	libusb_free_transfer(xfer);
+}
+
+/**
+ * Submit an asynchronous bulk transfer.
+ *
+ * The callback is called from libusb_handle_events() for the
+ * context this unit was opened with, either by the caller or
+ * by a NitroEventThread. In replay mode, the
+ * transfer is done synchronously and the callback is called
+ * before this function returns.
+ *
+ * @param endpoint	[in] Endpoint.
+ * @param data		[in/out] Data. (Must remain valid until the callback is called.)
+ * @param len		[in] Length of data.
+ * @param callback	[in] Completion callback.
+ * @param userdata	[in] User data.
+ * @return 0 on success; libusb error code on error. (callback is not called on error)
+ */
+int ISNitro::submitBulkTransfer(uint8_t endpoint, uint8_t *data, int len,
+	BulkCallback callback, void *userdata)
+{
+	if (m_replay) {
+		int transferred = 0;
+		int ret = m_replay->transfer(endpoint, data, len, &transferred);
+		callback(ret, transferred, userdata);
+		return 0;
+	}
+	if (!m_device)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	struct libusb_transfer *const xfer = libusb_alloc_transfer(0);
+	if (!xfer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	AsyncBulkTransfer *const abt = new AsyncBulkTransfer;
+	abt->recorder = m_recorder;
+	abt->latency = m_latency;
+	abt->metrics = m_metrics;
+	abt->callback = callback;
+	abt->userdata = userdata;
+	abt->ts = NitroTrace::now();
+
+	libusb_fill_bulk_transfer(xfer, m_device, endpoint, data, len,
+		asyncBulkTransferCallback, abt, 1000);
+	int ret = libusb_submit_transfer(xfer);
+	if (ret < 0) {
+		delete abt;
+		libusb_free_transfer(xfer);
+	}
+	return ret;
+}
+
 /**
  * Send a READ command.
  * @param cmd		[in] Command.
@@ -95,6 +347,27 @@ ISNitro::~ISNitro()
  * @return 0 on success; libusb error code on error.
  */
 int ISNitro::sendReadCommand(uint16_t cmd, uint8_t _slot, uint32_t address, uint8_t *data, uint32_t len)
+{
+	if (!m_trace) {
+		return sendReadCommand_int(cmd, _slot, address, data, len);
+	}
+
+	const uint64_t ts = NitroTrace::now();
+	int ret = sendReadCommand_int(cmd, _slot, address, data, len);
+	m_trace->recordCommand(cmd, NITRO_OP_READ, _slot, address, len, ts, ret);
+	return ret;
+}
+
+/**
+ * Send a READ command. (internal function)
+ * @param cmd		[in] Command.
+ * @param _slot		[in] Slot number for EMULATOR memory.
+ * @param address	[in] Source address.
+ * @param data		[out] Data.
+ * @param len		[in] Length of data.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::sendReadCommand_int(uint16_t cmd, uint8_t _slot, uint32_t address, uint8_t *data, uint32_t len)
 {
 	NitroUSBCmd cdb;
 	cdb.cmd = cpu_to_le16(cmd);
@@ -106,8 +379,8 @@ int ISNitro::sendReadCommand(uint16_t cmd, uint8_t _slot, uint32_t address, uint
 
 	// Send the READ command.
 	int transferred = 0;
-	int ret = libusb_bulk_transfer(m_device, BULK_EP_OUT,
-		(uint8_t*)&cdb, (int)sizeof(cdb), &transferred, 1000);
+	int ret = bulkTransfer(BULK_EP_OUT,
+		(uint8_t*)&cdb, (int)sizeof(cdb), &transferred);
 	if (ret < 0) {
 		return ret;
 	}
@@ -117,8 +390,8 @@ int ISNitro::sendReadCommand(uint16_t cmd, uint8_t _slot, uint32_t address, uint
 	}
 
 	// Read the data.
-	ret = libusb_bulk_transfer(m_device, BULK_EP_IN,
-		data, (int)len, &transferred, 1000);
+	ret = bulkTransfer(BULK_EP_IN,
+		data, (int)len, &transferred);
 	if (ret < 0) {
 		return ret;
 	}
@@ -130,6 +403,41 @@ int ISNitro::sendReadCommand(uint16_t cmd, uint8_t _slot, uint32_t address, uint
 	return 0;
 }
 
+/**
+ * Send a WRITE packet.
+ * The command header is filled in by this function.
+ * @param cmd		[in] Command.
+ * @param _slot		[in] Slot number for EMULATOR memory.
+ * @param address	[in] Destination address.
+ * @param packet	[in/out] Packet: Space for NitroUSBCmd, followed by the payload.
+ * @param len		[in] Length of the payload.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::sendPacket(uint16_t cmd, uint8_t _slot, uint32_t address, uint8_t *packet, uint32_t len)
+{
+	NitroUSBCmd cdb;
+	cdb.cmd = cpu_to_le16(cmd);
+	cdb.op = NITRO_OP_WRITE;
+	cdb._slot = _slot;
+	cdb.address = cpu_to_le32(address);
+	cdb.length = cpu_to_le32(len);
+	cdb.zero = 0;
+	memcpy(packet, &cdb, sizeof(cdb));
+
+	const int txlen = (int)(sizeof(cdb) + len);
+	const uint64_t ts = (m_trace ? NitroTrace::now() : 0);
+	int transferred = 0;
+	int ret = bulkTransfer(BULK_EP_OUT, packet, txlen, &transferred);
+	if (ret == 0 && transferred != txlen) {
+		// Short write.
+		ret = LIBUSB_ERROR_TIMEOUT;
+	}
+	if (m_trace) {
+		m_trace->recordCommand(cmd, NITRO_OP_WRITE, _slot, address, len, ts, ret);
+	}
+	return ret;
+}
+
 /**
  * Send a WRITE command.
  * @param cmd		[in] Command.
@@ -141,56 +449,29 @@ int ISNitro::sendReadCommand(uint16_t cmd, uint8_t _slot, uint32_t address, uint
  */
 int ISNitro::sendWriteCommand(uint16_t cmd, uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len)
 {
-	if (len == 0) {
-		// No payload. Send the command buffer directly.
-		NitroUSBCmd cdb;
-		cdb.cmd = cpu_to_le16(cmd);
-		cdb.op = NITRO_OP_WRITE;
-		cdb._slot = _slot;
-		cdb.address = cpu_to_le32(address);
-		cdb.length = 0;
-		cdb.zero = 0;
-
-		int transferred = 0;
-		int ret = libusb_bulk_transfer(m_device, BULK_EP_OUT,
-			(uint8_t*)&cdb, (int)sizeof(cdb), &transferred, 1000);
-		if (ret < 0)
-			return ret;
-		if (transferred != (int)sizeof(cdb)) {
-			// Short write.
-			return LIBUSB_ERROR_TIMEOUT;
+	// Small payloads (control commands, NEC registers) are
+	// sent from the stack.
+	static const uint32_t STACK_SIZE = 256;
+	if (len <= STACK_SIZE) {
+		uint8_t packet[sizeof(NitroUSBCmd) + STACK_SIZE];
+		if (len > 0) {
+			memcpy(&packet[sizeof(NitroUSBCmd)], data, len);
 		}
-		return 0;
+		return sendPacket(cmd, _slot, address, packet, len);
 	}
 
 	// NOTE: We need to include the command header before the payload,
-	// so we'll send 8 KB chunks to avoid memory issues.
+	// so we'll send 1 MB chunks to avoid memory issues.
 	static const uint32_t CHUNK_SIZE = 1048576U;
-	unique_ptr<uint8_t[]> cdb_raw(new uint8_t[sizeof(NitroUSBCmd)+CHUNK_SIZE]);
-	NitroUSBCmd *const pCdb = reinterpret_cast<NitroUSBCmd*>(cdb_raw.get());
+	unique_ptr<uint8_t[]> cdb_raw(new uint8_t[sizeof(NitroUSBCmd) + std::min(len, CHUNK_SIZE)]);
 	uint8_t *const pData = &cdb_raw[sizeof(NitroUSBCmd)];
 
-	pCdb->cmd = cpu_to_le16(cmd);
-	pCdb->op = NITRO_OP_WRITE;
-	pCdb->_slot = _slot;
-	pCdb->zero = 0;
-
 	while (len > 0) {
 		const uint32_t curlen = std::min(len, CHUNK_SIZE);
-		const uint32_t txlen = curlen + sizeof(NitroUSBCmd);
-		pCdb->address = cpu_to_le32(address);
-		pCdb->length = cpu_to_le32(curlen);
 		memcpy(pData, data, curlen);
-
-		int transferred = 0;
-		int ret = libusb_bulk_transfer(m_device, BULK_EP_OUT,
-			cdb_raw.get(), (int)txlen, &transferred, 1000);
+		int ret = sendPacket(cmd, _slot, address, cdb_raw.get(), curlen);
 		if (ret < 0)
 			return ret;
-		if (transferred != (int)txlen) {
-			// Short write.
-			return LIBUSB_ERROR_TIMEOUT;
-		}
 
 		address += curlen;
 		data += curlen;
@@ -206,14 +487,21 @@ int ISNitro::sendWriteCommand(uint16_t cmd, uint8_t _slot, uint32_t address, con
  */
 int ISNitro::fullReset(void)
 {
+	const uint64_t ts = NitroTrace::now();
+
 	// Turn off Slot 2 if it's enabled.
 	// (Full Reset doesn't turn it off for some reason.)
 	int ret = setSlotPower(2, false);
-	if (ret < 0)
-		return ret;
+	if (ret == 0) {
+		ret = sendCommand(NitroCmdFullReset());
+	}
+	// Full Reset resets the NEC registers.
+	invalidateRegisterCache();
 
-	static const uint8_t data[] = {NITRO_CMD_FULL_RESET, 0xF2};
-	return sendWriteCommand(NITRO_CMD_FULL_RESET, 0, 0, data, sizeof(data));
+	if (m_metrics) {
+		m_metrics->recordOperation(NitroMetrics::OP_RESET, NitroTrace::now() - ts, ret);
+	}
+	return ret;
 }
 
 /**
@@ -226,8 +514,7 @@ int ISNitro::fullReset(void)
  */
 int ISNitro::ndsReset(bool reset)
 {
-	const uint8_t data[] = {NITRO_CMD_NDS_RESET, 0x00, reset, 0x00};
-	return sendWriteCommand(NITRO_CMD_NDS_RESET, 0, 0, data, sizeof(data));
+	return sendCommand(NitroCmdNDSReset(reset));
 }
 
  /**
@@ -240,28 +527,18 @@ int ISNitro::setSlotPower(uint8_t _slot, bool on)
 {
 	assert(_slot == 1 || _slot == 2);
 
-	uint8_t data[] = {
-		NITRO_CMD_SLOT_POWER, 0x00, 0x00, 0x00,
-		0 /* device */, 0x00, 0x00, 0x00,
-		on,   0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00
-	};
-
 	int ret = 0;
 	if (_slot == 1) {
-		data[4] = 0x0A;	// slot 1
-		ret = sendWriteCommand(NITRO_CMD_SLOT_POWER, 0, 0, data, sizeof(data));
+		// slot 1
+		ret = sendCommand(NitroCmdSlotPower(0x0A, on));
 	} else /*if (_slot == 2)*/ {
-		data[4] = 0x02;	// slot 2 (primary?)
-		ret = sendWriteCommand(NITRO_CMD_SLOT_POWER, 0, 0, data, sizeof(data));
+		// slot 2 (primary?)
+		ret = sendCommand(NitroCmdSlotPower(0x02, on));
 		if (ret < 0)
 			return ret;
 		if (on) {
-			data[4] = 0x04;	// slot 2 (secondary?)
-			data[8] = 0;
-			ret = sendWriteCommand(NITRO_CMD_SLOT_POWER, 0, 0, data, sizeof(data));
+			// slot 2 (secondary?)
+			ret = sendCommand(NitroCmdSlotPower(0x04, false));
 		}
 	}
 
@@ -271,8 +548,9 @@ int ISNitro::setSlotPower(uint8_t _slot, bool on)
 /**
  * Write to Slot-1 EMULATOR memory.
  *
- * NOTE: Caller should call this function in chunks itself for
- * better UI interactivity.
+ * NOTE: For large writes, use NitroUploadOperation, which
+ * splits the data into chunks on a worker thread and
+ * supports progress reporting and cancellation.
  *
  * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
  * @param address Destination address.
@@ -289,51 +567,146 @@ int ISNitro::writeEmulationMemory(uint8_t _slot, uint32_t address, const uint8_t
 }
 
 /**
- * Install the debugger ROM.
- * This is required in order to load an NDS game successfully.
+ * Read from EMULATOR memory.
  *
- * @param toFirmware If true, boot to NDS firmware instead of the game.
+ * NOTE: Large reads should be split into chunks.
+ * NitroDumpOperation does this on a worker thread.
+ *
+ * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+ * @param address Source address.
+ * @param data Data buffer.
+ * @param len Length of data.
  * @return 0 on success; libusb error code on error.
  */
-int ISNitro::installDebuggerROM(bool toFirmware)
+int ISNitro::readEmulationMemory(uint8_t _slot, uint32_t address, uint8_t *data, uint32_t len)
 {
-	// Debugger ROM is installed at 0xFF80000 in EMULATOR memory.
+	// NOTE: Must be a multiple of two bytes.
+	assert(_slot == 1 || _slot == 2);
+	assert(len % 2 == 0);
+	return sendReadCommand(NITRO_CMD_EMULATOR_MEMORY, _slot, address, data, len);
+}
 
-	// ROM header and CONF section.
-	uint8_t hdr[0x300];
-	memcpy(hdr, debugger_code, sizeof(hdr));
+/**
+ * Get the amount of installed Slot-1 EMULATOR memory.
+ *
+ * The size is probed by writing small patterns at power-of-two
+ * boundaries and checking if they are mirrored at address 0.
+ * The result is cached, so the probe only runs once per unit.
+ *
+ * WARNING: The probe overwrites a few bytes of EMULATOR memory
+ * at address 0 and at each boundary. The NDS should be in reset,
+ * and a ROM image should be loaded afterwards.
+ *
+ * @param pSize [out] EMULATOR memory size, in bytes.
+ * @return 0 on success; LIBUSB_ERROR_NOT_SUPPORTED if readback doesn't work; libusb error code on error.
+ */
+int ISNitro::getEmulationMemorySize(uint32_t *pSize)
+{
+	if (m_emuMemSize != 0) {
+		*pSize = m_emuMemSize;
+		return 0;
+	}
 
-	// Set the current RTC value.
-	// TODO: Option to set the RTC?
-	// RTC value is at 0x218
-	// - Format (BCD): YY mm dd dw HH MM ss
-	// - (dw == day of week; 2 == Tuesday)
-#define DEC_TO_BCD(n) ((((n) / 10) << 4) | ((n) % 10))
-	// TODO: localtime_r() if available.
-	time_t now = time(nullptr);
-	struct tm tm = *localtime(&now);
-	// TODO: Validate fields.
-	// FIXME: Only seems to work the first time the debugger ROM is loaded...
-	hdr[0x218] = DEC_TO_BCD(tm.tm_year - 100);
-	hdr[0x219] = DEC_TO_BCD(tm.tm_mon + 1);
-	hdr[0x21A] = DEC_TO_BCD(tm.tm_mday);
-	hdr[0x21B] = tm.tm_wday;
-	hdr[0x21C] = DEC_TO_BCD(tm.tm_hour);
-	hdr[0x21D] = DEC_TO_BCD(tm.tm_min);
-	hdr[0x21E] = DEC_TO_BCD(tm.tm_sec);
-	int ret = writeEmulationMemory(1, 0xFF80000, hdr, sizeof(hdr));
+	NitroTraceSpan span(m_trace, "getEmulationMemorySize");
+
+	// Probe patterns: "ORTN" followed by the boundary address.
+	// Address 0 gets its own pattern.
+	static const uint32_t MIN_SIZE = 32U*1024*1024;
+	static const uint32_t MAX_SIZE = 1024U*1024*1024;
+	uint32_t pattern[2] = {cpu_to_le32(0x4E54524F), 0};
+	uint32_t readback[2];
+
+	// Make sure readback works. Otherwise, every boundary
+	// would look like the end of memory.
+	int ret = writeEmulationMemory(1, 0, (const uint8_t*)pattern, sizeof(pattern));
 	if (ret < 0)
 		return ret;
-
-	// Write the rest of the debugger ROM.
-	ret = writeEmulationMemory(1, 0xFF80000+sizeof(hdr),
-		&debugger_code[sizeof(hdr)], sizeof(debugger_code)-sizeof(hdr));
+	ret = readEmulationMemory(1, 0, (uint8_t*)readback, sizeof(readback));
 	if (ret < 0)
 		return ret;
+	if (memcmp(pattern, readback, sizeof(pattern)) != 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	uint32_t size = MIN_SIZE;
+	for (; size < MAX_SIZE; size <<= 1) {
+		pattern[1] = cpu_to_le32(size);
+		ret = writeEmulationMemory(1, size, (const uint8_t*)pattern, sizeof(pattern));
+		if (ret < 0)
+			return ret;
+
+		// If address 0 now has the boundary pattern, memory is mirrored.
+		ret = readEmulationMemory(1, 0, (uint8_t*)readback, sizeof(readback));
+		if (ret < 0)
+			return ret;
+		if (!memcmp(pattern, readback, sizeof(pattern)))
+			break;
+
+		// If the boundary doesn't have the pattern, there's no memory there.
+		ret = readEmulationMemory(1, size, (uint8_t*)readback, sizeof(readback));
+		if (ret < 0)
+			return ret;
+		if (memcmp(pattern, readback, sizeof(pattern)) != 0)
+			break;
+	}
+
+	m_emuMemSize = size;
+	*pSize = size;
+	return 0;
+}
 
-	// Set the ISID in Slot 2.
-	uint8_t isid[1024];
-	memset(isid, 0, sizeof(isid));
+// Debugger ROM address in EMULATOR memory.
+static const uint32_t DEBUGGER_ROM_ADDRESS = 0xFF80000;
+
+// RTC value in the debugger ROM header.
+// - Format (BCD): YY mm dd dw HH MM ss
+// - (dw == day of week; 2 == Tuesday)
+static const uint32_t DEBUGGER_RTC_OFFSET = 0x218;
+
+// Debugger ROM header and CONF section.
+// This is written separately, since it contains the RTC value.
+static const uint32_t DEBUGGER_HEADER_SIZE = 0x300;
+
+// Debugging pointers in the game's ROM header.
+static const uint32_t DEBUG_PTRS_OFFSET = 0x160;
+
+// Residency check: The header and CONF section are read back in full,
+// along with windows of the rest of the debugger ROM.
+static const unsigned int DEBUGGER_PROBE_COUNT = 16;
+static const unsigned int DEBUGGER_PROBE_LEN = 1024;
+static_assert(sizeof(debugger_code) >= DEBUGGER_HEADER_SIZE + DEBUGGER_PROBE_LEN,
+	"debugger_code is too small for the residency check");
+
+// ISID block in Slot 2.
+static const unsigned int ISID_SIZE = 1024;
+
+/**
+ * Initialize a USB command header at the start of a packet.
+ * @param packet	[out] Packet.
+ * @param cmd		[in] Command.
+ * @param op		[in] Opcode.
+ * @param _slot		[in] Slot number for EMULATOR memory.
+ * @param address	[in] Address.
+ * @param len		[in] Data length.
+ */
+static void init_cdb(uint8_t *packet, uint16_t cmd, uint8_t op, uint8_t _slot, uint32_t address, uint32_t len)
+{
+	NitroUSBCmd cdb;
+	cdb.cmd = cpu_to_le16(cmd);
+	cdb.op = op;
+	cdb._slot = _slot;
+	cdb.address = cpu_to_le32(address);
+	cdb.length = cpu_to_le32(len);
+	cdb.zero = 0;
+	memcpy(packet, &cdb, sizeof(cdb));
+}
+
+/**
+ * Build the ISID block for Slot 2.
+ * @param isid [out] ISID block. (ISID_SIZE bytes)
+ */
+static void build_isid(uint8_t *isid)
+{
+	memset(isid, 0, ISID_SIZE);
 	memset(isid, 0xFF, 0x90);
 	memset(&isid[0xA0], 0xFF, 0x10);
 	isid[0xF6] = 0xFF;
@@ -343,68 +716,278 @@ int ISNitro::installDebuggerROM(bool toFirmware)
 	isid[0x102] = 'I';
 	isid[0x103] = 'D';
 	isid[0x104] = 1;
-	ret = writeEmulationMemory(2, 0, isid, sizeof(isid));
-	if (ret < 0)
-		return ret;
+}
 
-	// Overwrite the debugging pointers in the ROM header.
+/**
+ * Get the offset of a residency check window in the debugger ROM.
+ * Windows are spread evenly from the end of the header
+ * and CONF section to the end of the image.
+ * @param i Window index.
+ * @return Offset.
+ */
+static inline uint32_t debugger_probe_offset(unsigned int i)
+{
+	static const uint32_t step = (((uint32_t)sizeof(debugger_code) - DEBUGGER_HEADER_SIZE - DEBUGGER_PROBE_LEN)
+		/ (DEBUGGER_PROBE_COUNT - 1)) & ~1U;
+	return DEBUGGER_HEADER_SIZE + (i * step);
+}
+
+/**
+ * Patch the debugging pointers into a game's ROM header.
+ * This must be done for the debugger ROM to boot the game.
+ * The patch is normally written by installDebuggerROM(), but
+ * patching the first chunk before it's uploaded saves a command.
+ * @param header ROM header.
+ * @param len Length of the buffer.
+ * @return 0 on success; LIBUSB_ERROR_INVALID_PARAM if the buffer is too small.
+ */
+int ISNitro::patchDebugPointers(uint8_t *header, size_t len)
+{
 	const uint32_t debug_ptrs[4] = {
-		cpu_to_le32(0x8FF80000), cpu_to_le32((uint32_t)sizeof(debugger_code)),
+		cpu_to_le32(0x80000000 | DEBUGGER_ROM_ADDRESS), cpu_to_le32((uint32_t)sizeof(debugger_code)),
 		cpu_to_le32(0x02700000), cpu_to_le32(0x02700004),
 	};
-	if (!toFirmware) {
-		ret = writeEmulationMemory(1, 0x160, (const uint8_t*)debug_ptrs, sizeof(debug_ptrs));
+	if (len < DEBUG_PTRS_OFFSET + sizeof(debug_ptrs))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	memcpy(&header[DEBUG_PTRS_OFFSET], debug_ptrs, sizeof(debug_ptrs));
+	return 0;
+}
+
+/**
+ * Check if the debugger ROM and ISID are already in EMULATOR memory.
+ * The debugger ROM header and CONF section, windows of the rest of
+ * the debugger ROM, and the ISID block are read back in one
+ * pipelined batch. The RTC value isn't checked.
+ * @return 1 if resident; 0 if not; libusb error code on error.
+ */
+int ISNitro::isDebuggerROMResident(void)
+{
+	if (m_capture) {
+		// Can't read back in capture mode.
+		return 0;
 	}
-	return ret;
+
+	// Reads: Header and CONF section, windows, ISID.
+	static const unsigned int READS = 1 + DEBUGGER_PROBE_COUNT + 1;
+	uint8_t cdbs[READS][sizeof(NitroUSBCmd)];
+	vector<uint8_t> buf(DEBUGGER_HEADER_SIZE + (DEBUGGER_PROBE_COUNT * DEBUGGER_PROBE_LEN) + ISID_SIZE);
+	uint8_t *const hdr = &buf[0];
+	uint8_t *const probes = &buf[DEBUGGER_HEADER_SIZE];
+	uint8_t *const isid = &probes[DEBUGGER_PROBE_COUNT * DEBUGGER_PROBE_LEN];
+	PipelineXfer xfers[READS * 2];
+
+	for (unsigned int i = 0; i < READS; i++) {
+		uint8_t *data;
+		uint32_t len;
+		if (i == 0) {
+			data = hdr;
+			len = DEBUGGER_HEADER_SIZE;
+			init_cdb(cdbs[i], NITRO_CMD_EMULATOR_MEMORY, NITRO_OP_READ, 1,
+				DEBUGGER_ROM_ADDRESS, len);
+		} else if (i <= DEBUGGER_PROBE_COUNT) {
+			data = &probes[(i - 1) * DEBUGGER_PROBE_LEN];
+			len = DEBUGGER_PROBE_LEN;
+			init_cdb(cdbs[i], NITRO_CMD_EMULATOR_MEMORY, NITRO_OP_READ, 1,
+				DEBUGGER_ROM_ADDRESS + debugger_probe_offset(i - 1), len);
+		} else {
+			data = isid;
+			len = ISID_SIZE;
+			init_cdb(cdbs[i], NITRO_CMD_EMULATOR_MEMORY, NITRO_OP_READ, 2, 0, len);
+		}
+		xfers[i*2].endpoint = BULK_EP_OUT;
+		xfers[i*2].data = cdbs[i];
+		xfers[i*2].len = (int)sizeof(cdbs[i]);
+		xfers[i*2 + 1].endpoint = BULK_EP_IN;
+		xfers[i*2 + 1].data = data;
+		xfers[i*2 + 1].len = (int)len;
+	}
+
+	int ret = runPipelined(xfers, READS * 2);
+	if (ret < 0)
+		return ret;
+
+	// Header and CONF section, except for the RTC value.
+	// NOTE: The byte after the RTC value is written with its original value.
+	static const uint32_t RTC_END = DEBUGGER_RTC_OFFSET + 7;
+	if (memcmp(hdr, debugger_code, DEBUGGER_RTC_OFFSET) != 0 ||
+	    memcmp(&hdr[RTC_END], &debugger_code[RTC_END], DEBUGGER_HEADER_SIZE - RTC_END) != 0)
+	{
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < DEBUGGER_PROBE_COUNT; i++) {
+		if (memcmp(&probes[i * DEBUGGER_PROBE_LEN], &debugger_code[debugger_probe_offset(i)], DEBUGGER_PROBE_LEN) != 0)
+			return 0;
+	}
+	uint8_t expected[ISID_SIZE];
+	build_isid(expected);
+	return (memcmp(isid, expected, ISID_SIZE) == 0 ? 1 : 0);
 }
 
 /**
- * Wait for the debugger ROM to initialize.
- * Debugger ROM must be installed and NDS must be out of reset.
+ * Install the debugger ROM.
+ * This is required in order to load an NDS game successfully.
+ *
+ * If the same debugger ROM is already installed, e.g. from a previous
+ * load, only the RTC value is updated.
+ *
+ * @param toFirmware If true, boot to NDS firmware instead of the game.
+ * @param headerPatched If true, the game's ROM header was already patched with patchDebugPointers().
  * @return 0 on success; libusb error code on error.
  */
-int ISNitro::waitForDebuggerROM(void)
+int ISNitro::installDebuggerROM(bool toFirmware, bool headerPatched)
 {
-	uint8_t cmdSetCPU[] = {NITRO_CMD_SET_CPU, 0, 0, 0};
+	NitroTraceSpan span(m_trace, "installDebuggerROM");
 
-	// Try up to 1000 times.
-	for (int i = 0; i < 1000; i++) {
-		uint8_t bufARM9[8], bufARM7[8];
+	// Debugger ROM is installed at 0xFF80000 in EMULATOR memory.
 
-		// Set the current CPU to ARM9.
-		cmdSetCPU[2] = NITRO_CPU_ARM9;
-		int ret = sendWriteCommand(NITRO_CMD_SET_CPU, 0, 0, cmdSetCPU, sizeof(cmdSetCPU));
+	// Set the current RTC value.
+	// TODO: Option to set the RTC?
+	// NOTE: Writes must be a multiple of two bytes, so the byte
+	// after the RTC value is included.
+#define DEC_TO_BCD(n) ((((n) / 10) << 4) | ((n) % 10))
+	// TODO: localtime_r() if available.
+	time_t now = time(nullptr);
+	struct tm tm = *localtime(&now);
+	// TODO: Validate fields.
+	// FIXME: Only seems to work the first time the debugger ROM is loaded...
+	uint8_t rtc[8];
+	rtc[0] = DEC_TO_BCD(tm.tm_year - 100);
+	rtc[1] = DEC_TO_BCD(tm.tm_mon + 1);
+	rtc[2] = DEC_TO_BCD(tm.tm_mday);
+	rtc[3] = tm.tm_wday;
+	rtc[4] = DEC_TO_BCD(tm.tm_hour);
+	rtc[5] = DEC_TO_BCD(tm.tm_min);
+	rtc[6] = DEC_TO_BCD(tm.tm_sec);
+	rtc[7] = debugger_code[DEBUGGER_RTC_OFFSET + 7];
+
+	// If the readback fails, assume the debugger ROM isn't resident.
+	// The full install will report the error if the device is gone.
+	int ret = isDebuggerROMResident();
+	if (ret > 0) {
+		// Debugger ROM is already installed.
+		// Only the RTC value needs to be updated.
+		ret = writeEmulationMemory(1, DEBUGGER_ROM_ADDRESS + DEBUGGER_RTC_OFFSET, rtc, sizeof(rtc));
 		if (ret < 0)
 			return ret;
-
-		// Read the debugger state. (cmd139?)
-		ret = sendReadCommand(139, 0, 0, bufARM9, sizeof(bufARM9));
+	} else {
+		// ROM header and CONF section.
+		uint8_t hdr[DEBUGGER_HEADER_SIZE];
+		memcpy(hdr, debugger_code, sizeof(hdr));
+		memcpy(&hdr[DEBUGGER_RTC_OFFSET], rtc, sizeof(rtc));
+		ret = writeEmulationMemory(1, DEBUGGER_ROM_ADDRESS, hdr, sizeof(hdr));
 		if (ret < 0)
 			return ret;
 
-		// Set the current CPU to ARM7.
-		cmdSetCPU[2] = NITRO_CPU_ARM7;
-		ret = sendWriteCommand(NITRO_CMD_SET_CPU, 0, 0, cmdSetCPU, sizeof(cmdSetCPU));
+		// Write the rest of the debugger ROM.
+		ret = writeEmulationMemory(1, DEBUGGER_ROM_ADDRESS+sizeof(hdr),
+			&debugger_code[sizeof(hdr)], sizeof(debugger_code)-sizeof(hdr));
 		if (ret < 0)
 			return ret;
 
-		// Read the debugger state. (cmd139?)
-		ret = sendReadCommand(139, 0, 0, bufARM7, sizeof(bufARM7));
+		// Set the ISID in Slot 2.
+		uint8_t isid[ISID_SIZE];
+		build_isid(isid);
+		ret = writeEmulationMemory(2, 0, isid, sizeof(isid));
 		if (ret < 0)
 			return ret;
+	}
+
+	// Overwrite the debugging pointers in the ROM header.
+	if (!toFirmware && !headerPatched) {
+		uint8_t hdr[DEBUG_PTRS_OFFSET + 16];
+		patchDebugPointers(hdr, sizeof(hdr));
+		ret = writeEmulationMemory(1, DEBUG_PTRS_OFFSET, &hdr[DEBUG_PTRS_OFFSET], 16);
+	}
+	return ret;
+}
+
+/**
+ * Wait for the debugger ROM to initialize.
+ * Debugger ROM must be installed and NDS must be out of reset.
+ *
+ * Each poll queries both CPUs in one pipelined batch. The first
+ * few milliseconds are polled back-to-back, since that's when the
+ * debugger ROM usually finishes; after that, the delay between
+ * polls backs off exponentially. The time to boot is recorded
+ * in NitroMetrics as the "debugger_boot" operation.
+ *
+ * @param timeout_ms Timeout, in milliseconds.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::waitForDebuggerROM(unsigned int timeout_ms)
+{
+	// Back-to-back polls for the first 5 ms.
+	static const uint64_t BUSY_US = 5000;
+	// Backoff: 500 us, 1 ms, 2 ms, ... up to 10 ms.
+	static const uint64_t MIN_DELAY_US = 500;
+	static const uint64_t MAX_DELAY_US = 10000;
+
+	if (m_capture) {
+		// Can't read the debugger state in capture mode.
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	NitroTraceSpan span(m_trace, "waitForDebuggerROM");
+	const uint64_t ts = NitroTrace::now();
+	const uint64_t deadline = ts + (uint64_t)timeout_ms * 1000;
+
+	// Poll: Set the current CPU to ARM9, read the debugger state,
+	// set the current CPU to ARM7, read the debugger state.
+	// (cmd139: READ of NITRO_CMD_SET_CPU)
+	const NitroCmdSetCPU setARM9(NITRO_CPU_ARM9), setARM7(NITRO_CPU_ARM7);
+	uint8_t cmdARM9[sizeof(NitroUSBCmd) + NitroCmdSetCPU::SIZE];
+	uint8_t cmdARM7[sizeof(NitroUSBCmd) + NitroCmdSetCPU::SIZE];
+	uint8_t cmdState[sizeof(NitroUSBCmd)];
+	uint8_t bufARM9[8], bufARM7[8];
+	init_cdb(cmdARM9, NitroCmdSetCPU::CMD, NITRO_OP_WRITE, 0, 0, NitroCmdSetCPU::SIZE);
+	memcpy(&cmdARM9[sizeof(NitroUSBCmd)], setARM9.bytes, NitroCmdSetCPU::SIZE);
+	init_cdb(cmdARM7, NitroCmdSetCPU::CMD, NITRO_OP_WRITE, 0, 0, NitroCmdSetCPU::SIZE);
+	memcpy(&cmdARM7[sizeof(NitroUSBCmd)], setARM7.bytes, NitroCmdSetCPU::SIZE);
+	init_cdb(cmdState, NITRO_CMD_SET_CPU, NITRO_OP_READ, 0, 0, sizeof(bufARM9));
+
+	const PipelineXfer poll[] = {
+		{BULK_EP_OUT, cmdARM9, (int)sizeof(cmdARM9)},
+		{BULK_EP_OUT, cmdState, (int)sizeof(cmdState)},
+		{BULK_EP_IN, bufARM9, (int)sizeof(bufARM9)},
+		{BULK_EP_OUT, cmdARM7, (int)sizeof(cmdARM7)},
+		{BULK_EP_OUT, cmdState, (int)sizeof(cmdState)},
+		{BULK_EP_IN, bufARM7, (int)sizeof(bufARM7)},
+	};
+
+	int ret;
+	uint64_t delay_us = MIN_DELAY_US;
+	for (;;) {
+		ret = runPipelined(poll, sizeof(poll)/sizeof(poll[0]));
+		if (ret < 0) {
+			m_curCPU = CPU_UNKNOWN;
+			break;
+		}
+		m_curCPU = NITRO_CPU_ARM7;
 
 		// Is the debugger initialized?
 		if (bufARM9[3] == 1 && bufARM7[3] == 1) {
 			// Debugger initialized!
-			return 0;
+			break;
 		}
 
-		// Wait 10ms and try again.
-		usleep(10000);
+		const uint64_t now = NitroTrace::now();
+		if (now >= deadline) {
+			// Debugger ROM failed to initialize...
+			ret = LIBUSB_ERROR_TIMEOUT;
+			break;
+		}
+		if (now - ts < BUSY_US)
+			continue;
+
+		usleep((useconds_t)std::min(delay_us, deadline - now));
+		delay_us = std::min(delay_us * 2, MAX_DELAY_US);
 	}
 
-	// Debugger ROM failed to initialize...
-	return LIBUSB_ERROR_TIMEOUT;
+	if (m_metrics) {
+		m_metrics->recordOperation(NitroMetrics::OP_DEBUGGER_BOOT, NitroTrace::now() - ts, ret);
+	}
+	return ret;
 }
 
 /**
@@ -420,41 +1003,290 @@ int ISNitro::writeNECMemory(uint32_t address, const uint8_t *data, uint32_t len)
 	// NEC commands have an 8-byte structure, followed by the payload.
 	// Payload must be a multiple of 2 bytes.
 	assert(len % 2 == 0);
+	NitroNECCommand necCmd;
+	necCmd.cmd = NITRO_CMD_NEC_MEMORY;
+	necCmd.unitSize = 2;
+	necCmd.length = cpu_to_le16(len / 2);
+	necCmd.address = cpu_to_le32(address);
+
+	// Register writes are small, so build the whole packet
+	// on the stack instead of copying the payload twice.
+	static const uint32_t STACK_SIZE = 256;
 	const uint32_t cdblen = len + sizeof(NitroNECCommand);
-	unique_ptr<uint8_t[]> cdb(new uint8_t[cdblen]);
-	NitroNECCommand *const pNecCmd = reinterpret_cast<NitroNECCommand*>(cdb.get());
-	pNecCmd->cmd = NITRO_CMD_NEC_MEMORY;
-	pNecCmd->unitSize = 2;
-	pNecCmd->length = cpu_to_le16(len / 2);
-	pNecCmd->address = cpu_to_le32(address);
-	memcpy(&cdb[sizeof(NitroNECCommand)], data, len);
-	return sendWriteCommand(NITRO_CMD_NEC_MEMORY, 0, 0, cdb.get(), cdblen);
+	int ret;
+	if (len <= STACK_SIZE) {
+		uint8_t packet[sizeof(NitroUSBCmd) + sizeof(NitroNECCommand) + STACK_SIZE];
+		memcpy(&packet[sizeof(NitroUSBCmd)], &necCmd, sizeof(necCmd));
+		memcpy(&packet[sizeof(NitroUSBCmd) + sizeof(NitroNECCommand)], data, len);
+		ret = sendPacket(NITRO_CMD_NEC_MEMORY, 0, 0, packet, cdblen);
+	} else {
+		unique_ptr<uint8_t[]> cdb(new uint8_t[cdblen]);
+		memcpy(cdb.get(), &necCmd, sizeof(necCmd));
+		memcpy(&cdb[sizeof(NitroNECCommand)], data, len);
+		ret = sendWriteCommand(NITRO_CMD_NEC_MEMORY, 0, 0, cdb.get(), cdblen);
+	}
+	// NOTE: In capture mode, the write hasn't actually been sent yet,
+	// so the shadow copies can't be trusted.
+	updateNECShadow(address, data, len, (ret == 0 && !m_capture));
+	return ret;
 }
 
 /**
- * Unlock the AV functionality.
+ * Read from the NEC CPU's memory.
+ *
+ * @param address Source address.
+ * @param data Data buffer.
+ * @param len Length of data. (Must be a multiple of two bytes.)
  * @return 0 on success; libusb error code on error.
  */
-int ISNitro::unlockAV(void)
+int ISNitro::readNECMemory(uint32_t address, uint8_t *data, uint32_t len)
+{
+	// NOTE: Reads use the same form as EMULATOR memory reads,
+	// with the NEC address in the command header.
+	assert(len % 2 == 0);
+	return sendReadCommand(NITRO_CMD_NEC_MEMORY, 0, address, data, len);
+}
+
+/**
+ * Read the NEC NDS status registers.
+ * Both registers are read with a single command.
+ * @param reg0 [out] NITRO_NEC_NDS_REG0. (See NitroNECNDSReg0_e.)
+ * @param reg1 [out] NITRO_NEC_NDS_REG1. (See NitroNECNDSReg1_e.)
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::readNDSStatus(uint16_t *reg0, uint16_t *reg1)
 {
-	static const uint8_t cmd1[] = {0x59, 0x00};
-	int ret = writeNECMemory(NITRO_NEC_REG_VIDEO_UNLOCK0, cmd1, sizeof(cmd1));
+	uint16_t regs[2];
+	int ret = readNECMemory(NITRO_NEC_NDS_REG0, (uint8_t*)regs, sizeof(regs));
 	if (ret < 0)
 		return ret;
+	*reg0 = le16_to_cpu(regs[0]);
+	*reg1 = le16_to_cpu(regs[1]);
+	return 0;
+}
 
-	static const uint8_t cmd2[] = {0x4F, 0x00};
-	ret = writeNECMemory(NITRO_NEC_REG_VIDEO_UNLOCK1, cmd2, sizeof(cmd2));
+/**
+ * Wait for bits in a NEC register to have the specified value.
+ *
+ * The register is polled back-to-back at first, since most
+ * state changes take effect within a few milliseconds, then
+ * with an exponentially increasing delay.
+ *
+ * @param address Register address.
+ * @param mask Bits to check.
+ * @param value Expected value of the masked bits.
+ * @param timeout_ms Timeout, in milliseconds.
+ * @return 0 on success; LIBUSB_ERROR_TIMEOUT if the register didn't change in time;
+ *         other libusb error code if the register couldn't be read.
+ *         (A read timeout is returned as LIBUSB_ERROR_IO.)
+ */
+int ISNitro::waitForNECRegister(uint32_t address, uint16_t mask, uint16_t value, unsigned int timeout_ms)
+{
+	// Back-to-back polls before backing off.
+	static const unsigned int BUSY_POLLS = 4;
+	// Backoff: 1 ms, 2 ms, 4 ms, ... up to 32 ms.
+	static const uint64_t MIN_DELAY_US = 1000;
+	static const uint64_t MAX_DELAY_US = 32000;
+
+	NitroTraceSpan span(m_trace, "waitForNECRegister");
+	const uint64_t deadline = NitroTrace::now() + (uint64_t)timeout_ms * 1000;
+	uint64_t delay_us = MIN_DELAY_US;
+	for (unsigned int poll = 0; ; poll++) {
+		uint16_t reg;
+		int ret = readNECMemory(address, (uint8_t*)&reg, sizeof(reg));
+		if (ret < 0) {
+			// LIBUSB_ERROR_TIMEOUT is reserved for the deadline,
+			// so callers can tell "not yet" from "not readable".
+			return (ret == LIBUSB_ERROR_TIMEOUT ? LIBUSB_ERROR_IO : ret);
+		}
+		if ((le16_to_cpu(reg) & mask) == (value & mask))
+			return 0;
+
+		const uint64_t now = NitroTrace::now();
+		if (now >= deadline)
+			break;
+		if (poll < BUSY_POLLS)
+			continue;
+
+		usleep((useconds_t)std::min(delay_us, deadline - now));
+		delay_us = std::min(delay_us * 2, MAX_DELAY_US);
+	}
+
+	return LIBUSB_ERROR_TIMEOUT;
+}
+
+/**
+ * Reset the Nintendo DS subsystem and restart it.
+ *
+ * The system is held in RESET until the NDS status registers
+ * report that it's in RESET, but for at least 100 ms. If the
+ * status registers can't be read, a fixed 500 ms delay is
+ * used instead.
+ *
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::softReset(void)
+{
+	static const unsigned int RESET_TIMEOUT_MS = 500;
+	// Minimum RESET hold time. The NEC register read form hasn't been
+	// confirmed on hardware, so a status that reads as RESET too early,
+	// e.g. 0xFFFF, must not release the system immediately.
+	static const uint64_t RESET_MIN_HOLD_US = 100000;
+
+	int ret = ndsReset(true);
 	if (ret < 0)
 		return ret;
+	const uint64_t start = NitroTrace::now();
+
+	ret = waitForNECRegister(NITRO_NEC_NDS_REG0,
+		NITRO_NEC_NDS_REG0_RESET, NITRO_NEC_NDS_REG0_RESET, RESET_TIMEOUT_MS);
+	if (ret < 0 && ret != LIBUSB_ERROR_TIMEOUT) {
+		// Status isn't readable. Fall back to a fixed delay.
+		usleep(RESET_TIMEOUT_MS * 1000);
+	} else {
+		const uint64_t elapsed = NitroTrace::now() - start;
+		if (elapsed < RESET_MIN_HOLD_US) {
+			usleep((useconds_t)(RESET_MIN_HOLD_US - elapsed));
+		}
+	}
 
-	static const uint8_t cmd3[] = {0x4B, 0x00};
-	ret = writeNECMemory(NITRO_NEC_REG_VIDEO_UNLOCK2, cmd3, sizeof(cmd3));
+	ret = ndsReset(false);
 	if (ret < 0)
 		return ret;
 
-	static const uint8_t cmd4[] = {0x4F, 0x00};
-	ret = writeNECMemory(NITRO_NEC_REG_VIDEO_UNLOCK3, cmd4, sizeof(cmd4));
-	return ret;
+	// Wait for the system to leave RESET, if the status is readable.
+	// This isn't fatal; the system has been released either way.
+	waitForNECRegister(NITRO_NEC_NDS_REG0, NITRO_NEC_NDS_REG0_RESET, 0, RESET_TIMEOUT_MS);
+	return 0;
+}
+
+/**
+ * NEC registers that can be shadowed.
+ * Bit n is the register at 0x08000000 + (n * 2).
+ *
+ * Registers with side effects, e.g. the AV unlock sequence,
+ * the monitor config data port, and the NDS control registers,
+ * are always written.
+ */
+static const uint32_t nec_shadow_mask =
+	(1U << ((NITRO_NEC_REG_MONITOR_BG_R - NITRO_NEC_NDS_REG0) / 2)) |
+	(1U << ((NITRO_NEC_REG_MONITOR_BG_G - NITRO_NEC_NDS_REG0) / 2)) |
+	(1U << ((NITRO_NEC_REG_MONITOR_BG_B - NITRO_NEC_NDS_REG0) / 2)) |
+	(1U << ((NITRO_NEC_REG_MONITOR_STATE - NITRO_NEC_NDS_REG0) / 2)) |
+	(1U << ((NITRO_NEC_REG_CURSOR_IMAGE_OFFSET - NITRO_NEC_NDS_REG0) / 2)) |
+	(1U << ((NITRO_NEC_REG_CURSOR_POS_X - NITRO_NEC_NDS_REG0) / 2)) |
+	(1U << ((NITRO_NEC_REG_CURSOR_POS_Y - NITRO_NEC_NDS_REG0) / 2));
+
+/**
+ * Update the NEC register shadow copies after a write.
+ * @param address Destination address.
+ * @param data Data.
+ * @param len Length of data.
+ * @param ok True if the write succeeded; false to invalidate.
+ */
+void ISNitro::updateNECShadow(uint32_t address, const uint8_t *data, uint32_t len, bool ok)
+{
+	for (uint32_t i = 0; i < len; i += 2) {
+		const uint32_t reg = address + i;
+		if (reg < NITRO_NEC_NDS_REG0 || reg >= NITRO_NEC_NDS_REG0 + (NEC_SHADOW_COUNT * 2))
+			continue;
+		const unsigned int idx = (reg - NITRO_NEC_NDS_REG0) / 2;
+		if (ok && (nec_shadow_mask & (1U << idx))) {
+			m_necShadow[idx] = data[i] | (data[i+1] << 8);
+			m_necShadowValid |= (1U << idx);
+		} else {
+			m_necShadowValid &= ~(1U << idx);
+		}
+	}
+}
+
+/**
+ * Check if a NEC register's shadow copy has the specified value.
+ * @param address Register address.
+ * @param value Value.
+ * @return True if the register is known to have this value.
+ */
+bool ISNitro::necShadowMatches(uint32_t address, uint16_t value) const
+{
+	if (address < NITRO_NEC_NDS_REG0 || address >= NITRO_NEC_NDS_REG0 + (NEC_SHADOW_COUNT * 2))
+		return false;
+	const unsigned int idx = (address - NITRO_NEC_NDS_REG0) / 2;
+	return ((m_necShadowValid & (1U << idx)) && m_necShadow[idx] == value);
+}
+
+/**
+ * Write a batch of NEC registers.
+ *
+ * Consecutive writes to contiguous registers are merged into
+ * a single NEC command. Registers whose shadow copy already
+ * has the specified value are skipped, unless they're between
+ * two registers that need to be written, since rewriting them
+ * is cheaper than an extra command.
+ *
+ * @param batch Batch.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::writeNECBatch(const NitroNECBatch &batch)
+{
+	const auto &writes = batch.writes();
+	uint8_t data[64];
+	for (size_t i = 0; i < writes.size(); ) {
+		// Find the end of this run of contiguous registers.
+		size_t end = i + 1;
+		while (end < writes.size() && !writes[end].split &&
+		       writes[end].address == writes[end-1].address + 2 &&
+		       (end - i) < (sizeof(data) / 2))
+		{
+			end++;
+		}
+
+		// Trim registers that already have the correct value.
+		size_t first = i, last = end;
+		while (first < last && necShadowMatches(writes[first].address, writes[first].value))
+			first++;
+		while (last > first && necShadowMatches(writes[last-1].address, writes[last-1].value))
+			last--;
+
+		if (first < last) {
+			for (size_t j = first; j < last; j++) {
+				data[(j - first) * 2] = writes[j].value & 0xFF;
+				data[(j - first) * 2 + 1] = writes[j].value >> 8;
+			}
+			int ret = writeNECMemory(writes[first].address, data, (uint32_t)((last - first) * 2));
+			if (ret < 0)
+				return ret;
+		}
+		i = end;
+	}
+	return 0;
+}
+
+/**
+ * Invalidate the NEC register shadow copies and the cached current CPU.
+ * The next write to each register will be sent to the device
+ * even if the value hasn't changed. Call this if something
+ * else may have changed the registers, e.g. another program.
+ */
+void ISNitro::invalidateRegisterCache(void)
+{
+	m_necShadowValid = 0;
+	m_monitorShadowValid = 0;
+	m_curCPU = CPU_UNKNOWN;
+}
+
+/**
+ * Unlock the AV functionality.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::unlockAV(void)
+{
+	// "YOKO"
+	NitroNECBatch batch;
+	batch.write(NITRO_NEC_REG_VIDEO_UNLOCK0, 0x59)
+	     .write(NITRO_NEC_REG_VIDEO_UNLOCK1, 0x4F)
+	     .write(NITRO_NEC_REG_VIDEO_UNLOCK2, 0x4B)
+	     .write(NITRO_NEC_REG_VIDEO_UNLOCK3, 0x4F);
+	return writeNECBatch(batch);
 }
 
 /**
@@ -465,18 +1297,30 @@ int ISNitro::unlockAV(void)
  */
 int ISNitro::writeMonitorConfigRegister(uint8_t reg, uint16_t value)
 {
-	const uint8_t cmd1[] = {reg, 0};
-	int ret = writeNECMemory(NITRO_NEC_REG_MONITOR_SEL, cmd1, sizeof(cmd1));
-	if (ret < 0)
-		return ret;
-
-	const uint8_t cmd2[] = {(uint8_t)(value & 0xFF), 0};
-	ret = writeNECMemory(NITRO_NEC_REG_MONITOR_DATA_LO, cmd2, sizeof(cmd2));
-	if (ret < 0)
-		return ret;
+	// Registers 0x00-0x06 (AV2) and 0x80-0x86 (AV1) are shadowed.
+	const unsigned int idx = (reg & 0x7F) + ((reg & 0x80) ? 7 : 0);
+	const bool shadowed = ((reg & 0x7F) < 7);
+	if (shadowed && (m_monitorShadowValid & (1U << idx)) && m_monitorShadow[idx] == value) {
+		// Register already has this value.
+		return 0;
+	}
 
-	const uint8_t cmd3[] = {(uint8_t)(value >> 8), 0};
-	return writeNECMemory(NITRO_NEC_REG_MONITOR_DATA_HI, cmd3, sizeof(cmd3));
+	// The data registers are contiguous, so they're written together.
+	NitroNECBatch batch;
+	batch.write(NITRO_NEC_REG_MONITOR_SEL, reg)
+	     .write(NITRO_NEC_REG_MONITOR_DATA_LO, value & 0xFF)
+	     .write(NITRO_NEC_REG_MONITOR_DATA_HI, value >> 8);
+	int ret = writeNECBatch(batch);
+
+	if (shadowed) {
+		if (ret == 0 && !m_capture) {
+			m_monitorShadow[idx] = value;
+			m_monitorShadowValid |= (1U << idx);
+		} else {
+			m_monitorShadowValid &= ~(1U << idx);
+		}
+	}
+	return ret;
 }
 
 /**
@@ -486,18 +1330,11 @@ int ISNitro::writeMonitorConfigRegister(uint8_t reg, uint16_t value)
  */
 int ISNitro::setBgColor(uint32_t bg_color)
 {
-	uint8_t cmd[] = {(uint8_t)(bg_color & 0xFF), 0x00};
-	int ret = writeNECMemory(NITRO_NEC_REG_MONITOR_BG_B, cmd, sizeof(cmd));
-	if (ret < 0)
-		return ret;
-	bg_color >>= 8;
-	cmd[0] = (uint8_t)(bg_color & 0xFF);
-	ret = writeNECMemory(NITRO_NEC_REG_MONITOR_BG_G, cmd, sizeof(cmd));
-	if (ret < 0)
-		return ret;
-	bg_color >>= 8;
-	cmd[0] = (uint8_t)(bg_color & 0xFF);
-	return writeNECMemory(NITRO_NEC_REG_MONITOR_BG_R, cmd, sizeof(cmd));
+	NitroNECBatch batch;
+	batch.write(NITRO_NEC_REG_MONITOR_BG_R, (bg_color >> 16) & 0xFF)
+	     .write(NITRO_NEC_REG_MONITOR_BG_G, (bg_color >> 8) & 0xFF)
+	     .write(NITRO_NEC_REG_MONITOR_BG_B, bg_color & 0xFF);
+	return writeNECBatch(batch);
 }
 
 /**
@@ -507,6 +1344,25 @@ int ISNitro::setBgColor(uint32_t bg_color)
  */
 int ISNitro::setAVModeSettings(const NitroAVModeSettings_t *mode)
 {
+	NitroTraceSpan span(m_trace, "setAVModeSettings");
+	if (!m_metrics) {
+		return setAVModeSettings_int(mode);
+	}
+
+	const uint64_t ts = NitroTrace::now();
+	int ret = setAVModeSettings_int(mode);
+	m_metrics->recordOperation(NitroMetrics::OP_AVMODE, NitroTrace::now() - ts, ret);
+	return ret;
+}
+
+/**
+ * Set the AV mode settings. (internal function)
+ * @param mode AV mode settings.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::setAVModeSettings_int(const NitroAVModeSettings_t *mode)
+{
+
 	// TODO: Change interlaced to bitfields; add rotation.
 	// Unlock the AV functionality.
 	int ret = unlockAV();
@@ -559,18 +1415,18 @@ int ISNitro::setAVModeSettings(const NitroAVModeSettings_t *mode)
 	if (ret < 0)
 		return ret;
 
-	// Set the background color.
-	ret = setBgColor(mode->bg_color);
-	if (ret < 0)
-		return ret;
-
-	// Monitor state bitfield.
-	uint8_t monitor_state =  (uint8_t)mode->av[1].mode |
+	// Background color and monitor state bitfield.
+	// These registers are contiguous, so they're written together.
+	const uint8_t monitor_state =  (uint8_t)mode->av[1].mode |
 				((uint8_t)mode->rotation << 2) |
 				((uint8_t)mode->av[0].mode << 4) |
 				((uint8_t)mode->deflicker << 6);
-	const uint8_t cmd[] = {monitor_state, 0};
-	ret = writeNECMemory(NITRO_NEC_REG_MONITOR_STATE, cmd, sizeof(cmd));
+	NitroNECBatch batch;
+	batch.write(NITRO_NEC_REG_MONITOR_BG_R, (mode->bg_color >> 16) & 0xFF)
+	     .write(NITRO_NEC_REG_MONITOR_BG_G, (mode->bg_color >> 8) & 0xFF)
+	     .write(NITRO_NEC_REG_MONITOR_BG_B, mode->bg_color & 0xFF)
+	     .write(NITRO_NEC_REG_MONITOR_STATE, monitor_state);
+	ret = writeNECBatch(batch);
 	if (ret < 0)
 		return ret;
 
@@ -578,11 +1434,10 @@ int ISNitro::setAVModeSettings(const NitroAVModeSettings_t *mode)
 	// TODO: Separate into a separate function so we can make use of it later?
 	// X,Y pos are set to 255 to hide the cursor.
 	// FIXME: It doesn't completely hide it... (shows up at the top-right of the screen)
-	uint8_t cmd_cursorPos[] = {0xFF, 0x00};
-	ret = writeNECMemory(NITRO_NEC_REG_CURSOR_POS_X, cmd_cursorPos, sizeof(cmd_cursorPos));
-	if (ret < 0)
-		return ret;
-	return writeNECMemory(NITRO_NEC_REG_CURSOR_POS_Y, cmd_cursorPos, sizeof(cmd_cursorPos));
+	batch.clear();
+	batch.write(NITRO_NEC_REG_CURSOR_POS_X, 0xFF)
+	     .write(NITRO_NEC_REG_CURSOR_POS_Y, 0xFF);
+	return writeNECBatch(batch);
 }
 
 /**
@@ -597,8 +1452,7 @@ int ISNitro::breakProcessor(uint8_t cpu)
 	assert(cpu == 0 || cpu == 1);
 
 	// Set the current CPU.
-	const uint8_t cmdSetCPU[] = {NITRO_CMD_SET_CPU, 0, cpu, 0};
-	int ret = sendWriteCommand(NITRO_CMD_SET_CPU, 0, 0, cmdSetCPU, sizeof(cmdSetCPU));
+	int ret = selectCPU(cpu);
 	if (ret < 0)
 		return ret;
 
@@ -611,16 +1465,12 @@ int ISNitro::breakProcessor(uint8_t cpu)
 		return ret;
 
 	// Send command A0. (What does it do?)
-	const uint8_t cmd160[] = {160, cpu};
-	ret = sendWriteCommand(160, 0, 0, cmd160, sizeof(cmd160));
+	ret = sendCommand(NitroCmdA0(cpu));
 	if (ret < 0)
 		return ret;
 
-	// Set breakpoints.
-	// TODO: Breakpoint builder.
-	// 8 == begin break
-	const uint32_t cmdBkpt[] = {cpu_to_le32(NITRO_CMD_SET_BREAKPOINTS), cpu_to_le32(4), cpu_to_le32(8)};
-	ret = sendWriteCommand(NITRO_CMD_SET_BREAKPOINTS, 0, 0, (const uint8_t*)cmdBkpt, sizeof(cmdBkpt));
+	// Begin break.
+	ret = sendCommand(NitroCmdSetBreakpoints(NITRO_BKPT_BREAK));
 	if (ret < 0)
 		return ret;
 
@@ -638,31 +1488,214 @@ int ISNitro::continueProcessor(uint8_t cpu)
 	assert(cpu == 0 || cpu == 1);
 
 	// Set the current CPU.
-	const uint8_t cmdSetCPU[] = {NITRO_CMD_SET_CPU, 0, cpu, 0};
-	int ret = sendWriteCommand(NITRO_CMD_SET_CPU, 0, 0, cmdSetCPU, sizeof(cmdSetCPU));
+	int ret = selectCPU(cpu);
 	if (ret < 0)
 		return ret;
 
 	// cmd 135?
-	static const uint8_t cmd135[] = {135, 0, 2, 0,    0,0,0,0, 0,0,0,0};
-	ret = sendWriteCommand(135, 0, 0, cmd135, sizeof(cmd135));
+	ret = sendCommand(NitroCmd87());
 	if (ret < 0)
 		return ret;
 
-	// Set breakpoints.
-	// TODO: Breakpoint builder.
-	// 9 == continue from break
-	const uint32_t cmdBkpt[] = {cpu_to_le32(NITRO_CMD_SET_BREAKPOINTS), cpu_to_le32(4), cpu_to_le32(9)};
-	ret = sendWriteCommand(NITRO_CMD_SET_BREAKPOINTS, 0, 0, (const uint8_t*)cmdBkpt, sizeof(cmdBkpt));
+	// Continue from break.
+	ret = sendCommand(NitroCmdSetBreakpoints(NITRO_BKPT_CONTINUE));
 	if (ret < 0)
 		return ret;
 
 	// cmd 133?
-	static const uint8_t cmd133[] = {133, 0};
-	ret = sendWriteCommand(133, 0, 0, cmd133, sizeof(cmd133));
+	ret = sendCommand(NitroCmd85());
+	if (ret < 0)
+		return ret;
+
+	return ret;
+}
+
+/**
+ * Insert breakpoints into both CPUs to pause them.
+ * The commands for both CPUs are sent as one pipelined
+ * sequence, so the CPUs stop as close together as possible.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::breakProcessors(void)
+{
+	return runBothCPUs(&ISNitro::breakProcessor);
+}
+
+/**
+ * Continue both CPUs from break.
+ * The commands for both CPUs are sent as one pipelined
+ * sequence, so the CPUs start as close together as possible.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::continueProcessors(void)
+{
+	return runBothCPUs(&ISNitro::continueProcessor);
+}
+
+/**
+ * Set the current CPU for CPU-specific commands.
+ * The command is skipped if the CPU is already selected.
+ * @param cpu CPU index. (See NitroCPU_e.)
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::selectCPU(uint8_t cpu)
+{
+	if (cpu == m_curCPU && !m_capture)
+		return 0;
+
+	int ret = sendCommand(NitroCmdSetCPU(cpu));
+	// NOTE: In capture mode, the command hasn't actually been sent yet.
+	m_curCPU = (ret == 0 && !m_capture ? cpu : CPU_UNKNOWN);
+	return ret;
+}
+
+/**
+ * Run a per-CPU function for both CPUs as one pipelined sequence.
+ * The commands are captured, then all of them are submitted
+ * before waiting for any of them to complete.
+ * @param fn Function, e.g. &ISNitro::breakProcessor.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::runBothCPUs(int (ISNitro::*fn)(uint8_t cpu))
+{
+	if (m_capture) {
+		// Already capturing for NitroTask.
+		int ret = (this->*fn)(NITRO_CPU_ARM9);
+		if (ret == 0)
+			ret = (this->*fn)(NITRO_CPU_ARM7);
+		return ret;
+	}
+
+	// Commands are traced when they're actually sent.
+	NitroCapture cap;
+	NitroTrace *const trace = m_trace;
+	m_trace = nullptr;
+	m_capture = &cap;
+	int ret = (this->*fn)(NITRO_CPU_ARM9);
+	if (ret == 0)
+		ret = (this->*fn)(NITRO_CPU_ARM7);
+	m_capture = nullptr;
+	m_trace = trace;
 	if (ret < 0)
 		return ret;
 
+	ret = sendPipelined(cap);
+	if (ret == 0) {
+		// The ARM7 was selected last.
+		m_curCPU = NITRO_CPU_ARM7;
+	} else {
+		// The pipeline may have failed partway,
+		// so either CPU may be selected.
+		m_curCPU = CPU_UNKNOWN;
+	}
+	return ret;
+}
+
+/**
+ * Pipelined transfer completion state.
+ */
+struct PipelinedTransfer {
+	std::atomic<unsigned int> *remaining;
+	int *completed;
+	int len;
+	int ret;
+	uint64_t ts;
+};
+
+/**
+ * Completion callback for runPipelined().
+ * @param ret 0 on success; libusb error code on error.
+ * @param transferred Actual transferred length.
+ * @param userdata PipelinedTransfer.
+ */
+static void pipelinedTransferCallback(int ret, int transferred, void *userdata)
+{
+	PipelinedTransfer *const pt = static_cast<PipelinedTransfer*>(userdata);
+	if (ret == 0 && transferred != pt->len) {
+		// Short transfer.
+		ret = LIBUSB_ERROR_TIMEOUT;
+	}
+	pt->ret = ret;
+	if (--(*pt->remaining) == 0) {
+		*pt->completed = 1;
+	}
+}
+
+/**
+ * Send captured OUT transfers without waiting for each one.
+ * @param cap Captured transfers.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::sendPipelined(NitroCapture &cap)
+{
+	vector<PipelineXfer> xfers(cap.transfers.size());
+	for (size_t i = 0; i < xfers.size(); i++) {
+		xfers[i].endpoint = BULK_EP_OUT;
+		xfers[i].data = cap.transfers[i].data();
+		xfers[i].len = (int)cap.transfers[i].size();
+	}
+	return runPipelined(xfers.data(), xfers.size());
+}
+
+/**
+ * Submit transfers in order without waiting for each one,
+ * then wait for all of them to complete.
+ * READ commands are traced when their IN transfer completes.
+ * @param xfers Transfers.
+ * @param count Number of transfers.
+ * @return 0 on success; libusb error code on error.
+ */
+int ISNitro::runPipelined(const PipelineXfer *xfers, size_t count)
+{
+	vector<PipelinedTransfer> pts(count);
+	std::atomic<unsigned int> remaining(0);
+	int completed = 0;
+
+	// Submit everything first. libusb queues the transfers,
+	// so the device sees them back-to-back.
+	int ret = 0;
+	size_t submitted = 0;
+	for (; submitted < count; submitted++) {
+		PipelinedTransfer &pt = pts[submitted];
+		pt.remaining = &remaining;
+		pt.completed = &completed;
+		pt.len = xfers[submitted].len;
+		pt.ret = 0;
+		pt.ts = NitroTrace::now();
+		remaining++;
+		ret = submitBulkTransfer(xfers[submitted].endpoint, xfers[submitted].data, pt.len,
+			pipelinedTransferCallback, &pt);
+		if (ret < 0) {
+			// Not submitted; the callback won't be called.
+			remaining--;
+			break;
+		}
+	}
+
+	// Wait for the submitted transfers.
+	while (remaining > 0) {
+		struct timeval tv = {0, 100000};
+		libusb_handle_events_timeout_completed(m_ctx, &tv, &completed);
+	}
+
+	for (size_t i = 0; i < submitted; i++) {
+		const PipelinedTransfer &pt = pts[i];
+		if (pt.ret < 0 && ret == 0) {
+			ret = pt.ret;
+		}
+
+		if (!m_trace || (xfers[i].endpoint & 0x80) || pt.len < (int)sizeof(NitroUSBCmd))
+			continue;
+		NitroUSBCmd cdb;
+		memcpy(&cdb, xfers[i].data, sizeof(cdb));
+		int cmdRet = pt.ret;
+		if (cdb.op == NITRO_OP_READ && cmdRet == 0) {
+			// Use the result of the IN transfer.
+			cmdRet = (i + 1 < submitted ? pts[i+1].ret : ret);
+		}
+		m_trace->recordCommand(le16_to_cpu(cdb.cmd), cdb.op, cdb._slot,
+			le32_to_cpu(cdb.address), le32_to_cpu(cdb.length), pt.ts, cmdRet);
+	}
 	return ret;
 }
 
@@ -678,12 +1711,10 @@ int ISNitro::sendCpuCMD174(uint8_t cpu)
 	assert(cpu == 0 || cpu == 1);
 
 	// Set the current CPU.
-	const uint8_t cmdSetCPU[] = {NITRO_CMD_SET_CPU, 0, cpu, 0};
-	int ret = sendWriteCommand(NITRO_CMD_SET_CPU, 0, 0, cmdSetCPU, sizeof(cmdSetCPU));
+	int ret = selectCPU(cpu);
 	if (ret < 0)
 		return ret;
 
 	// Send cmd174.
-	const uint32_t cmd174[] = {cpu_to_le32(174), cpu_to_le32(3), cpu_to_le32(1), 0, 0};
-	return sendWriteCommand(174, 0, 0, (const uint8_t*)cmd174, sizeof(cmd174));
+	return sendCommand(NitroCmdAE());
 }
@@ -14,6 +14,25 @@
 
 #include "nitro-usb-cmds.h"
 
+// C includes.
+#include <string.h>
+
+// C++ includes.
+#include <string>
+
+class NitroTrace;
+class NitroRecorder;
+class NitroReplay;
+class NitroTask;
+class NitroLatencyStats;
+class NitroMetrics;
+class NitroNECBatch;
+struct NitroCapture;
+
+/**
+ * IS-NITRO unit.
+ * Not thread-safe; use NitroQueue to share a unit between threads.
+ */
 class ISNitro
 {
 	public:
@@ -27,11 +46,19 @@ class ISNitro
 		 */
 		ISNitro(libusb_context *ctx = nullptr);
 
+		/**
+		 * Create a virtual IS-NITRO unit that replays a command stream log.
+		 * No USB device is opened; all transfers are handled by the replayer.
+		 * @param replay NitroReplay. (must remain valid for the lifetime of this object)
+		 */
+		explicit ISNitro(NitroReplay *replay);
+
 		~ISNitro();
 
 	private:
 		ISNitro(const ISNitro &);
 		ISNitro &operator=(const ISNitro&);
+		friend class NitroTask;
 
 	public:
 		static const uint8_t BULK_EP_OUT	= 0x01;
@@ -42,7 +69,120 @@ class ISNitro
 	public:
 		inline bool isOpen(void) const
 		{
-			return (m_device != nullptr);
+			return (m_device != nullptr || m_replay != nullptr);
+		}
+
+		/**
+		 * Close and re-open the IS-NITRO device.
+		 * This can recover from USB errors caused by flaky hubs.
+		 * EMULATOR memory is not cleared, but the NDS reset state
+		 * should be set again afterwards.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int reopen(void);
+
+		/**
+		 * Attach a trace buffer.
+		 * All USB commands will be recorded, along with spans
+		 * for long-running operations.
+		 * @param trace NitroTrace, or nullptr to disable tracing.
+		 */
+		inline void setTrace(NitroTrace *trace)
+		{
+			m_trace = trace;
+		}
+
+		/**
+		 * Get the attached trace buffer.
+		 * @return NitroTrace, or nullptr if tracing is disabled.
+		 */
+		inline NitroTrace *trace(void) const
+		{
+			return m_trace;
+		}
+
+		/**
+		 * Attach a command stream recorder.
+		 * All bulk transfers will be written to the log.
+		 * @param recorder NitroRecorder, or nullptr to stop recording.
+		 */
+		inline void setRecorder(NitroRecorder *recorder)
+		{
+			m_recorder = recorder;
+		}
+
+		/**
+		 * Attach latency statistics for asynchronous transfers.
+		 * The latency from submission to completion callback
+		 * is recorded for every transfer.
+		 * @param stats NitroLatencyStats, or nullptr to disable.
+		 */
+		inline void setLatencyStats(NitroLatencyStats *stats)
+		{
+			m_latency = stats;
+		}
+
+		/**
+		 * Attach per-unit metrics.
+		 * Bulk transfers, resets, and AV mode changes are recorded.
+		 * @param metrics NitroMetrics, or nullptr to disable.
+		 */
+		inline void setMetrics(NitroMetrics *metrics)
+		{
+			m_metrics = metrics;
+		}
+
+		/**
+		 * Get the attached metrics.
+		 * @return NitroMetrics, or nullptr if not attached.
+		 */
+		inline NitroMetrics *metrics(void) const
+		{
+			return m_metrics;
+		}
+
+		/**
+		 * Get the USB location of this unit, e.g. "3-1.4".
+		 * This is stable across re-plugs into the same port,
+		 * so it can be used to identify units in a rack.
+		 * @return USB location, or "replay" for a replay.
+		 */
+		std::string location(void) const;
+
+		/**
+		 * Asynchronous bulk transfer callback.
+		 * @param ret 0 on success; libusb error code on error.
+		 * @param transferred Actual transferred length.
+		 * @param userdata User data.
+		 */
+		typedef void (*BulkCallback)(int ret, int transferred, void *userdata);
+
+		/**
+		 * Submit an asynchronous bulk transfer.
+		 *
+		 * The callback is called from libusb_handle_events() for the
+		 * context this unit was opened with, either by the caller or
+		 * by a NitroEventThread. In replay mode, the
+		 * transfer is done synchronously and the callback is called
+		 * before this function returns.
+		 *
+		 * @param endpoint	[in] Endpoint.
+		 * @param data		[in/out] Data. (Must remain valid until the callback is called.)
+		 * @param len		[in] Length of data.
+		 * @param callback	[in] Completion callback.
+		 * @param userdata	[in] User data.
+		 * @return 0 on success; libusb error code on error. (callback is not called on error)
+		 */
+		int submitBulkTransfer(uint8_t endpoint, uint8_t *data, int len,
+			BulkCallback callback, void *userdata);
+
+		/**
+		 * Get the libusb context.
+		 * @return libusb_context. (nullptr for default)
+		 */
+		inline libusb_context *context(void) const
+		{
+			return m_ctx;
 		}
 
 	protected:
@@ -68,6 +208,63 @@ class ISNitro
 		 */
 		int sendWriteCommand(uint16_t cmd, uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len);
 
+		/**
+		 * Send a typed WRITE command. (See NitroCommands.hpp.)
+		 * The packet is built on the stack; the payload size
+		 * is known at compile time.
+		 * @param payload	[in] Command payload.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		template<typename T>
+		int sendCommand(const T &payload)
+		{
+			uint8_t packet[sizeof(NitroUSBCmd) + T::SIZE];
+			memcpy(&packet[sizeof(NitroUSBCmd)], payload.bytes, T::SIZE);
+			return sendPacket(T::CMD, 0, 0, packet, T::SIZE);
+		}
+
+	private:
+		/**
+		 * Send a WRITE packet.
+		 * The command header is filled in by this function.
+		 * @param cmd		[in] Command.
+		 * @param _slot		[in] Slot number for EMULATOR memory.
+		 * @param address	[in] Destination address.
+		 * @param packet	[in/out] Packet: Space for NitroUSBCmd, followed by the payload.
+		 * @param len		[in] Length of the payload.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int sendPacket(uint16_t cmd, uint8_t _slot, uint32_t address, uint8_t *packet, uint32_t len);
+
+		/**
+		 * Open the IS-NITRO device.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int openDevice(void);
+
+		/**
+		 * Perform a bulk transfer.
+		 * All USB traffic goes through this function so it can be
+		 * recorded or replayed.
+		 * @param endpoint	[in] Endpoint.
+		 * @param data		[in/out] Data.
+		 * @param len		[in] Length of data.
+		 * @param transferred	[out] Actual transferred length.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int bulkTransfer(uint8_t endpoint, uint8_t *data, int len, int *transferred);
+
+		/**
+		 * Send a READ command. (internal function)
+		 * @param cmd		[in] Command.
+		 * @param _slot		[in] Slot number for EMULATOR memory.
+		 * @param address	[in] Source address.
+		 * @param data		[out] Data.
+		 * @param len		[in] Length of data.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int sendReadCommand_int(uint16_t cmd, uint8_t _slot, uint32_t address, uint8_t *data, uint32_t len);
+
 	public:
 		/**
 		 * Reset the entire IS-NITRO system.
@@ -96,8 +293,9 @@ class ISNitro
 		/**
 		 * Write to Slot-1 EMULATOR memory.
 		 *
-		 * NOTE: Caller should call this function in chunks itself for
-		 * better UI interactivity.
+		 * NOTE: For large writes, use NitroUploadOperation, which
+		 * splits the data into chunks on a worker thread and
+		 * supports progress reporting and cancellation.
 		 *
 		 * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
 		 * @param address Destination address.
@@ -107,21 +305,86 @@ class ISNitro
 		 */
 		int writeEmulationMemory(uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len);
 
+		/**
+		 * Read from EMULATOR memory.
+		 *
+		 * NOTE: Large reads should be split into chunks.
+		 * NitroDumpOperation does this on a worker thread.
+		 *
+		 * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+		 * @param address Source address.
+		 * @param data Data buffer.
+		 * @param len Length of data.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int readEmulationMemory(uint8_t _slot, uint32_t address, uint8_t *data, uint32_t len);
+
+		/**
+		 * Get the amount of installed Slot-1 EMULATOR memory.
+		 *
+		 * The size is probed by writing small patterns at power-of-two
+		 * boundaries and checking if they are mirrored at address 0.
+		 * The result is cached, so the probe only runs once per unit.
+		 *
+		 * WARNING: The probe overwrites a few bytes of EMULATOR memory
+		 * at address 0 and at each boundary. The NDS should be in reset,
+		 * and a ROM image should be loaded afterwards.
+		 *
+		 * @param pSize [out] EMULATOR memory size, in bytes.
+		 * @return 0 on success; LIBUSB_ERROR_NOT_SUPPORTED if readback doesn't work; libusb error code on error.
+		 */
+		int getEmulationMemorySize(uint32_t *pSize);
+
 		/**
 		 * Install the debugger ROM.
 		 * This is required in order to load an NDS game successfully.
 		 *
+		 * If the same debugger ROM is already installed, e.g. from a previous
+		 * load, only the RTC value is updated.
+		 *
 		 * @param toFirmware If true, boot to NDS firmware instead of the game.
+		 * @param headerPatched If true, the game's ROM header was already patched with patchDebugPointers().
 		 * @return 0 on success; libusb error code on error.
 		 */
-		int installDebuggerROM(bool toFirmware = false);
+		int installDebuggerROM(bool toFirmware = false, bool headerPatched = false);
+
+		/**
+		 * Patch the debugging pointers into a game's ROM header.
+		 * This must be done for the debugger ROM to boot the game.
+		 * The patch is normally written by installDebuggerROM(), but
+		 * patching the first chunk before it's uploaded saves a command.
+		 * @param header ROM header.
+		 * @param len Length of the buffer.
+		 * @return 0 on success; LIBUSB_ERROR_INVALID_PARAM if the buffer is too small.
+		 */
+		static int patchDebugPointers(uint8_t *header, size_t len);
+
+	private:
+		/**
+		 * Check if the debugger ROM and ISID are already in EMULATOR memory.
+		 * The debugger ROM header and CONF section, windows of the rest of
+		 * the debugger ROM, and the ISID block are read back in one
+		 * pipelined batch. The RTC value isn't checked.
+		 * @return 1 if resident; 0 if not; libusb error code on error.
+		 */
+		int isDebuggerROMResident(void);
+
+	public:
 
 		/**
 		 * Wait for the debugger ROM to initialize.
 		 * Debugger ROM must be installed and NDS must be out of reset.
+		 *
+		 * Each poll queries both CPUs in one pipelined batch. The first
+		 * few milliseconds are polled back-to-back, since that's when the
+		 * debugger ROM usually finishes; after that, the delay between
+		 * polls backs off exponentially. The time to boot is recorded
+		 * in NitroMetrics as the "debugger_boot" operation.
+		 *
+		 * @param timeout_ms Timeout, in milliseconds.
 		 * @return 0 on success; libusb error code on error.
 		 */
-		int waitForDebuggerROM(void);
+		int waitForDebuggerROM(unsigned int timeout_ms = 10000);
 
 		/**
 		 * Write to the NEC CPU's memory.
@@ -133,6 +396,95 @@ class ISNitro
 		 */
 		int writeNECMemory(uint32_t address, const uint8_t *data, uint32_t len);
 
+		/**
+		 * Read from the NEC CPU's memory.
+		 *
+		 * @param address Source address.
+		 * @param data Data buffer.
+		 * @param len Length of data. (Must be a multiple of two bytes.)
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int readNECMemory(uint32_t address, uint8_t *data, uint32_t len);
+
+		/**
+		 * Read the NEC NDS status registers.
+		 * Both registers are read with a single command.
+		 * @param reg0 [out] NITRO_NEC_NDS_REG0. (See NitroNECNDSReg0_e.)
+		 * @param reg1 [out] NITRO_NEC_NDS_REG1. (See NitroNECNDSReg1_e.)
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int readNDSStatus(uint16_t *reg0, uint16_t *reg1);
+
+		/**
+		 * Wait for bits in a NEC register to have the specified value.
+		 *
+		 * The register is polled back-to-back at first, since most
+		 * state changes take effect within a few milliseconds, then
+		 * with an exponentially increasing delay.
+		 *
+		 * @param address Register address.
+		 * @param mask Bits to check.
+		 * @param value Expected value of the masked bits.
+		 * @param timeout_ms Timeout, in milliseconds.
+		 * @return 0 on success; LIBUSB_ERROR_TIMEOUT if the register didn't change in time;
+		 *         other libusb error code if the register couldn't be read.
+		 *         (A read timeout is returned as LIBUSB_ERROR_IO.)
+		 */
+		int waitForNECRegister(uint32_t address, uint16_t mask, uint16_t value, unsigned int timeout_ms);
+
+		/**
+		 * Reset the Nintendo DS subsystem and restart it.
+		 *
+		 * The system is held in RESET until the NDS status registers
+		 * report that it's in RESET, but for at least 100 ms. If the
+		 * status registers can't be read, a fixed 500 ms delay is
+		 * used instead.
+		 *
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int softReset(void);
+
+		/**
+		 * Write a batch of NEC registers.
+		 *
+		 * Consecutive writes to contiguous registers are merged into
+		 * a single NEC command. Registers whose shadow copy already
+		 * has the specified value are skipped, unless they're between
+		 * two registers that need to be written, since rewriting them
+		 * is cheaper than an extra command.
+		 *
+		 * @param batch Batch.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int writeNECBatch(const NitroNECBatch &batch);
+
+		/**
+		 * Invalidate the NEC register shadow copies and the cached current CPU.
+		 * The next write to each register will be sent to the device
+		 * even if the value hasn't changed. Call this if something
+		 * else may have changed the registers, e.g. another program.
+		 */
+		void invalidateRegisterCache(void);
+
+	private:
+		/**
+		 * Check if a NEC register's shadow copy has the specified value.
+		 * @param address Register address.
+		 * @param value Value.
+		 * @return True if the register is known to have this value.
+		 */
+		bool necShadowMatches(uint32_t address, uint16_t value) const;
+
+		/**
+		 * Update the NEC register shadow copies after a write.
+		 * @param address Destination address.
+		 * @param data Data.
+		 * @param len Length of data.
+		 * @param ok True if the write succeeded; false to invalidate.
+		 */
+		void updateNECShadow(uint32_t address, const uint8_t *data, uint32_t len, bool ok);
+
+	public:
 		/**
 		 * Unlock the AV functionality.
 		 * @return 0 on success; libusb error code on error.
@@ -161,6 +513,15 @@ class ISNitro
 		 */
 		int setAVModeSettings(const NitroAVModeSettings_t *mode);
 
+	private:
+		/**
+		 * Set the AV mode settings. (internal function)
+		 * @param mode AV mode settings.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int setAVModeSettings_int(const NitroAVModeSettings_t *mode);
+
+	public:
 		/**
 		 * Insert a breakpoint into a CPU to pause it.
 		 * CPU must be in BREAK in order to read from its memory space.
@@ -176,6 +537,68 @@ class ISNitro
 		 */
 		int continueProcessor(uint8_t cpu);
 
+		/**
+		 * Insert breakpoints into both CPUs to pause them.
+		 * The commands for both CPUs are sent as one pipelined
+		 * sequence, so the CPUs stop as close together as possible.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int breakProcessors(void);
+
+		/**
+		 * Continue both CPUs from break.
+		 * The commands for both CPUs are sent as one pipelined
+		 * sequence, so the CPUs start as close together as possible.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int continueProcessors(void);
+
+	private:
+		/**
+		 * Set the current CPU for CPU-specific commands.
+		 * The command is skipped if the CPU is already selected.
+		 * @param cpu CPU index. (See NitroCPU_e.)
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int selectCPU(uint8_t cpu);
+
+		/**
+		 * Run a per-CPU function for both CPUs as one pipelined sequence.
+		 * The commands are captured, then all of them are submitted
+		 * before waiting for any of them to complete.
+		 * @param fn Function, e.g. &ISNitro::breakProcessor.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int runBothCPUs(int (ISNitro::*fn)(uint8_t cpu));
+
+		/**
+		 * Send captured OUT transfers without waiting for each one.
+		 * @param cap Captured transfers.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int sendPipelined(NitroCapture &cap);
+
+		/**
+		 * Pipelined transfer.
+		 */
+		struct PipelineXfer {
+			uint8_t endpoint;	// Endpoint
+			uint8_t *data;		// Data (OUT) or buffer (IN)
+			int len;		// Length of data
+		};
+
+		/**
+		 * Submit transfers in order without waiting for each one,
+		 * then wait for all of them to complete.
+		 * READ commands are traced when their IN transfer completes.
+		 * @param xfers Transfers.
+		 * @param count Number of transfers.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int runPipelined(const PipelineXfer *xfers, size_t count);
+
+	public:
+
 		/**
 		 * Send cmd174 to the specified CPU.
 		 * This is usually done after initializing the debugger ROM.
@@ -187,6 +610,33 @@ class ISNitro
 	protected:
 		libusb_context *m_ctx;
 		libusb_device_handle *m_device;
+		NitroTrace *m_trace;
+		NitroRecorder *m_recorder;
+		NitroReplay *m_replay;
+		NitroLatencyStats *m_latency;
+		NitroMetrics *m_metrics;
+
+		// Cached EMULATOR memory size. (0 if not probed yet)
+		uint32_t m_emuMemSize;
+
+		// Shadow copies of NEC registers written by this object,
+		// so writes that wouldn't change anything can be skipped.
+		// Invalidated by fullReset() and reopen().
+		static const unsigned int NEC_SHADOW_COUNT = 0x38 / 2;	// 0x08000000-0x08000037
+		uint16_t m_necShadow[NEC_SHADOW_COUNT];
+		uint32_t m_necShadowValid;	// Bit n: m_necShadow[n] is valid
+		uint16_t m_monitorShadow[14];	// Monitor config registers 0x00-0x06, 0x80-0x86
+		uint16_t m_monitorShadowValid;	// Bit n: m_monitorShadow[n] is valid
+
+		// Current CPU for CPU-specific commands. (See NitroCPU_e.)
+		// CPU_UNKNOWN if it hasn't been set by this object.
+		// Invalidated by fullReset() and reopen().
+		static const uint8_t CPU_UNKNOWN = 0xFF;
+		uint8_t m_curCPU;
+
+		// Command capture for NitroTask.
+		// If set, OUT transfers are stored instead of being sent.
+		NitroCapture *m_capture;
 };
 
 #endif /* __ORTIN_ISNITRO_HPP__ */
@@ -0,0 +1,525 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroAsync.cpp: Asynchronous IS-NITRO command sequences.                *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroAsync.hpp"
+#include "ISNitro.hpp"
+#include "NitroCommands.hpp"
+#include "NitroTrace.hpp"
+#include "byteswap.h"
+
+// C includes. (C++ namespace)
+#include <cassert>
+#include <cstring>
+
+// C++ includes.
+#include <algorithm>
+#include <chrono>
+#include <thread>
+using std::shared_ptr;
+using std::vector;
+
+/** NitroExecutor **/
+
+/**
+ * Create an executor.
+ * @param ctx libusb_context. (nullptr for default)
+ */
+NitroExecutor::NitroExecutor(libusb_context *ctx)
+	: m_ctx(ctx)
+	, m_inflight(0)
+	, m_externalEvents(false)
+{ }
+
+/**
+ * Post a job to run on the executor thread.
+ * Can be called from any thread.
+ * @param job Job.
+ */
+void NitroExecutor::post(Job job)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_ready.push_back(std::move(job));
+	m_cond.notify_one();
+}
+
+/**
+ * Post a job to run after a delay.
+ * Must be called from the executor thread.
+ * @param delay_us Delay, in microseconds.
+ * @param job Job.
+ */
+void NitroExecutor::postDelayed(uint64_t delay_us, Job job)
+{
+	m_timers.insert(std::make_pair(NitroTrace::now() + delay_us, std::move(job)));
+}
+
+/**
+ * Run until there are no jobs, timers, or transfers left.
+ * @return 0 on success; libusb error code on error.
+ */
+int NitroExecutor::run(void)
+{
+	std::deque<Job> ready;
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_ready.empty() && m_timers.empty() && m_inflight.load() == 0)
+				break;
+			ready.swap(m_ready);
+		}
+
+		// Run the ready jobs.
+		// Jobs posted while these are running will be
+		// handled on the next iteration.
+		for (auto iter = ready.begin(); iter != ready.end(); ++iter) {
+			(*iter)();
+		}
+		ready.clear();
+
+		// Run expired timers.
+		uint64_t now = NitroTrace::now();
+		while (!m_timers.empty() && m_timers.begin()->first <= now) {
+			Job job = std::move(m_timers.begin()->second);
+			m_timers.erase(m_timers.begin());
+			job();
+		}
+
+		// Wait for transfers or the next timer, whichever comes first.
+		uint64_t wait_us = 1000000;
+		if (!m_timers.empty()) {
+			now = NitroTrace::now();
+			const uint64_t next = m_timers.begin()->first;
+			if (next <= now)
+				continue;
+			wait_us = std::min(wait_us, next - now);
+		}
+
+		if (m_externalEvents || m_inflight.load() == 0) {
+			// Completions are posted by another thread,
+			// or there's nothing to wait for except timers.
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_ready.empty() && (!m_timers.empty() || m_inflight.load() > 0)) {
+				m_cond.wait_for(lock, std::chrono::microseconds(wait_us));
+			}
+		} else {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_ready.empty())
+					continue;
+			}
+			struct timeval tv;
+			tv.tv_sec = (long)(wait_us / 1000000);
+			tv.tv_usec = (long)(wait_us % 1000000);
+			int ret = libusb_handle_events_timeout_completed(m_ctx, &tv, nullptr);
+			if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/** NitroTask **/
+
+/**
+ * Transfer in a command sequence.
+ */
+struct NitroTask::Transfer {
+	uint8_t endpoint;
+	vector<uint8_t> buf;
+	uint64_t ts;		// Submission timestamp, for tracing.
+};
+
+/**
+ * Submitted transfer.
+ */
+struct NitroTask::Pending {
+	NitroTask *task;
+	shared_ptr<vector<Transfer> > xfers;
+	size_t idx;
+	Continuation cont;
+};
+
+/**
+ * Create a task.
+ * @param exec Executor.
+ * @param nitro ISNitro object. (Must use the executor's libusb context.)
+ */
+NitroTask::NitroTask(NitroExecutor *exec, ISNitro *nitro)
+	: m_exec(exec)
+	, m_nitro(nitro)
+	, m_step(0)
+	, m_result(0)
+	, m_finished(false)
+{ }
+
+NitroTask::~NitroTask()
+{
+	// The executor may still have jobs referencing this task.
+	assert(m_finished || m_step == 0);
+}
+
+/**
+ * Run a write-only ISNitro function asynchronously.
+ * The function is called in capture mode; the USB commands
+ * it would have sent are submitted as asynchronous transfers.
+ * Functions that read from the device will fail with
+ * LIBUSB_ERROR_NOT_SUPPORTED.
+ * @param fn Function, e.g. [](ISNitro *n) { return n->ndsReset(false); }
+ * @return *this
+ */
+NitroTask &NitroTask::call(std::function<int(ISNitro*)> fn)
+{
+	m_steps.push_back([this, fn]() {
+		shared_ptr<vector<Transfer> > xfers(new vector<Transfer>);
+		int ret = capture(fn, *xfers);
+		if (ret < 0) {
+			next(ret);
+			return;
+		}
+		runTransfers(xfers, 0, [this](int ret) { next(ret); });
+	});
+	return *this;
+}
+
+/**
+ * Upload data to EMULATOR memory.
+ * Data is captured one chunk at a time.
+ * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+ * @param address Destination address.
+ * @param data Data. (Must remain valid until the task finishes.)
+ * @param len Length of data. (Must be a multiple of two bytes.)
+ * @param chunkSize Chunk size.
+ * @return *this
+ */
+NitroTask &NitroTask::upload(uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len,
+	uint32_t chunkSize)
+{
+	assert(len % 2 == 0);
+	chunkSize = std::max(chunkSize & ~1U, 2U);
+	m_steps.push_back([=]() {
+		uploadChunk(_slot, address, data, len, chunkSize);
+	});
+	return *this;
+}
+
+/**
+ * Wait without blocking the executor.
+ * @param delay_us Delay, in microseconds.
+ * @return *this
+ */
+NitroTask &NitroTask::delay(uint64_t delay_us)
+{
+	m_steps.push_back([this, delay_us]() {
+		m_exec->postDelayed(delay_us, [this]() { next(0); });
+	});
+	return *this;
+}
+
+/**
+ * Run a function on the executor thread.
+ * @param fn Function. Returns 0 to continue, or an error code to stop.
+ * @return *this
+ */
+NitroTask &NitroTask::then(std::function<int()> fn)
+{
+	m_steps.push_back([this, fn]() {
+		next(fn());
+	});
+	return *this;
+}
+
+/**
+ * Wait for the debugger ROM to initialize.
+ * Same as ISNitro::waitForDebuggerROM(), but polls
+ * using executor timers instead of usleep().
+ * @param poll_us Polling interval, in microseconds.
+ * @param maxPolls Maximum number of polls.
+ * @return *this
+ */
+NitroTask &NitroTask::waitForDebuggerROM(uint64_t poll_us, unsigned int maxPolls)
+{
+	m_steps.push_back([=]() {
+		pollDebugger(poll_us, std::max(maxPolls, 1U));
+	});
+	return *this;
+}
+
+/**
+ * Start the task.
+ * @param done Completion callback. (optional)
+ */
+void NitroTask::start(DoneCallback done)
+{
+	assert(m_step == 0);
+	m_done = std::move(done);
+	m_result = 0;
+	m_finished = false;
+	next(0);
+}
+
+/**
+ * Finish the current step.
+ * @param ret 0 to continue; error code to stop.
+ */
+void NitroTask::next(int ret)
+{
+	if (ret < 0 || m_step >= m_steps.size()) {
+		m_result = (ret < 0 ? ret : 0);
+		m_finished = true;
+		if (m_done) {
+			m_done(m_result);
+		}
+		return;
+	}
+
+	m_exec->post(m_steps[m_step++]);
+}
+
+/**
+ * Capture the USB commands sent by an ISNitro function.
+ * @param fn Function.
+ * @param xfers Transfer list.
+ * @return 0 on success; libusb error code on error.
+ */
+int NitroTask::capture(const std::function<int(ISNitro*)> &fn, vector<Transfer> &xfers)
+{
+	NitroCapture cap;
+
+	// Commands are traced when they're actually sent.
+	NitroTrace *const trace = m_nitro->m_trace;
+	m_nitro->m_trace = nullptr;
+	m_nitro->m_capture = &cap;
+	int ret = fn(m_nitro);
+	m_nitro->m_capture = nullptr;
+	m_nitro->m_trace = trace;
+	// The captured commands may select a different CPU when
+	// they're sent, e.g. pollDebugger()'s NITRO_CMD_SET_CPU.
+	m_nitro->m_curCPU = ISNitro::CPU_UNKNOWN;
+	if (ret < 0)
+		return ret;
+
+	xfers.reserve(xfers.size() + cap.transfers.size());
+	for (auto iter = cap.transfers.begin(); iter != cap.transfers.end(); ++iter) {
+		Transfer xfer;
+		xfer.endpoint = ISNitro::BULK_EP_OUT;
+		xfer.buf.swap(*iter);
+		xfer.ts = 0;
+		xfers.push_back(std::move(xfer));
+	}
+	return 0;
+}
+
+/**
+ * Submit transfers in order.
+ * @param xfers Transfer list.
+ * @param idx Index of the next transfer.
+ * @param cont Continuation.
+ */
+void NitroTask::runTransfers(shared_ptr<vector<Transfer> > xfers, size_t idx, Continuation cont)
+{
+	if (idx >= xfers->size()) {
+		cont(0);
+		return;
+	}
+
+	Transfer &xfer = (*xfers)[idx];
+	xfer.ts = NitroTrace::now();
+
+	Pending *const pending = new Pending;
+	pending->task = this;
+	pending->xfers = xfers;
+	pending->idx = idx;
+	pending->cont = cont;
+
+	m_exec->transferStarted();
+	int ret = m_nitro->submitBulkTransfer(xfer.endpoint, xfer.buf.data(), (int)xfer.buf.size(),
+		onTransfer, pending);
+	if (ret < 0) {
+		m_exec->transferFinished();
+		delete pending;
+		traceTransfer(*xfers, idx, ret);
+		cont(ret);
+	}
+}
+
+/**
+ * Asynchronous transfer callback.
+ * @param ret 0 on success; libusb error code on error.
+ * @param transferred Actual transferred length.
+ * @param userdata Pending.
+ */
+void NitroTask::onTransfer(int ret, int transferred, void *userdata)
+{
+	Pending *const pending = static_cast<Pending*>(userdata);
+	NitroTask *const task = pending->task;
+	const Transfer &xfer = (*pending->xfers)[pending->idx];
+	if (ret == 0 && transferred != (int)xfer.buf.size()) {
+		// Short transfer.
+		ret = LIBUSB_ERROR_TIMEOUT;
+	}
+
+	task->traceTransfer(*pending->xfers, pending->idx, ret);
+
+	// Continue on the executor instead of recursing.
+	// (In replay mode, this callback is called from submitBulkTransfer().
+	// With NitroEventThread, it's called on the event thread.)
+	NitroExecutor *const exec = task->m_exec;
+	const shared_ptr<vector<Transfer> > xfers = pending->xfers;
+	const size_t idx = pending->idx;
+	const Continuation cont = pending->cont;
+	delete pending;
+	if (ret < 0) {
+		exec->post([cont, ret]() { cont(ret); });
+	} else {
+		exec->post([task, xfers, idx, cont]() {
+			task->runTransfers(xfers, idx + 1, cont);
+		});
+	}
+
+	// NOTE: This must be done after posting the continuation,
+	// since the executor exits once nothing is in flight.
+	exec->transferFinished();
+}
+
+/**
+ * Record a completed transfer in the trace buffer, if tracing is enabled.
+ * @param xfers Transfer list.
+ * @param idx Index of the completed transfer.
+ * @param ret Transfer result.
+ */
+void NitroTask::traceTransfer(const vector<Transfer> &xfers, size_t idx, int ret)
+{
+	NitroTrace *const trace = m_nitro->trace();
+	if (!trace)
+		return;
+
+	// IN transfers are traced as part of the preceding READ command.
+	const Transfer *cdbXfer = &xfers[idx];
+	if (cdbXfer->endpoint & 0x80) {
+		if (idx == 0)
+			return;
+		cdbXfer = &xfers[idx - 1];
+	}
+	if (cdbXfer->buf.size() < sizeof(NitroUSBCmd))
+		return;
+
+	NitroUSBCmd cdb;
+	memcpy(&cdb, cdbXfer->buf.data(), sizeof(cdb));
+	if (cdb.op == NITRO_OP_READ && !(xfers[idx].endpoint & 0x80) && ret == 0) {
+		// READ command header sent successfully.
+		// Wait for the IN transfer.
+		return;
+	}
+	trace->recordCommand(le16_to_cpu(cdb.cmd), cdb.op, cdb._slot,
+		le32_to_cpu(cdb.address), le32_to_cpu(cdb.length), cdbXfer->ts, ret);
+}
+
+/**
+ * Poll the debugger state.
+ * @param poll_us Polling interval, in microseconds.
+ * @param remaining Remaining polls.
+ */
+void NitroTask::pollDebugger(uint64_t poll_us, unsigned int remaining)
+{
+	static const uint8_t cpus[2] = {NITRO_CPU_ARM9, NITRO_CPU_ARM7};
+	shared_ptr<vector<Transfer> > xfers(new vector<Transfer>);
+	size_t stateIdx[2];
+
+	for (unsigned int i = 0; i < 2; i++) {
+		// Set the current CPU.
+		const uint8_t cpu = cpus[i];
+		int ret = capture([cpu](ISNitro *n) {
+			return n->sendCommand(NitroCmdSetCPU(cpu));
+		}, *xfers);
+		if (ret < 0) {
+			next(ret);
+			return;
+		}
+
+		// Read the debugger state. (cmd139: READ of NITRO_CMD_SET_CPU)
+		Transfer cdbXfer;
+		cdbXfer.endpoint = ISNitro::BULK_EP_OUT;
+		cdbXfer.buf.resize(sizeof(NitroUSBCmd));
+		cdbXfer.ts = 0;
+		NitroUSBCmd *const cdb = reinterpret_cast<NitroUSBCmd*>(cdbXfer.buf.data());
+		cdb->cmd = cpu_to_le16(NITRO_CMD_SET_CPU);
+		cdb->op = NITRO_OP_READ;
+		cdb->_slot = 0;
+		cdb->address = 0;
+		cdb->length = cpu_to_le32(8);
+		cdb->zero = 0;
+		xfers->push_back(std::move(cdbXfer));
+
+		Transfer stateXfer;
+		stateXfer.endpoint = ISNitro::BULK_EP_IN;
+		stateXfer.buf.resize(8);
+		stateXfer.ts = 0;
+		stateIdx[i] = xfers->size();
+		xfers->push_back(std::move(stateXfer));
+	}
+
+	const size_t idx9 = stateIdx[0], idx7 = stateIdx[1];
+	runTransfers(xfers, 0, [this, xfers, idx9, idx7, poll_us, remaining](int ret) {
+		if (ret < 0) {
+			next(ret);
+			return;
+		}
+
+		// Is the debugger initialized?
+		if ((*xfers)[idx9].buf[3] == 1 && (*xfers)[idx7].buf[3] == 1) {
+			// Debugger initialized!
+			next(0);
+			return;
+		}
+
+		if (remaining <= 1) {
+			// Debugger ROM failed to initialize...
+			next(LIBUSB_ERROR_TIMEOUT);
+			return;
+		}
+
+		m_exec->postDelayed(poll_us, [this, poll_us, remaining]() {
+			pollDebugger(poll_us, remaining - 1);
+		});
+	});
+}
+
+/**
+ * Upload a chunk.
+ * @param _slot Emulated slot number.
+ * @param address Destination address.
+ * @param data Data.
+ * @param len Remaining length of data.
+ * @param chunkSize Chunk size.
+ */
+void NitroTask::uploadChunk(uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len, uint32_t chunkSize)
+{
+	if (len == 0) {
+		next(0);
+		return;
+	}
+
+	const uint32_t curlen = std::min(len, chunkSize);
+	shared_ptr<vector<Transfer> > xfers(new vector<Transfer>);
+	int ret = capture([=](ISNitro *n) {
+		return n->writeEmulationMemory(_slot, address, data, curlen);
+	}, *xfers);
+	if (ret < 0) {
+		next(ret);
+		return;
+	}
+
+	runTransfers(xfers, 0, [=](int ret) {
+		if (ret < 0) {
+			next(ret);
+			return;
+		}
+		uploadChunk(_slot, address + curlen, data + curlen, len - curlen, chunkSize);
+	});
+}
@@ -0,0 +1,314 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroAsync.hpp: Asynchronous IS-NITRO command sequences.                *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROASYNC_HPP__
+#define __ORTIN_LIBORTIN_NITROASYNC_HPP__
+
+#include <stdint.h>
+#include <libusb.h>
+
+// C++ includes.
+#include <deque>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class ISNitro;
+
+/**
+ * Captured OUT transfers.
+ * Used by NitroTask to turn synchronous ISNitro methods
+ * into asynchronous transfers.
+ */
+struct NitroCapture {
+	std::vector<std::vector<uint8_t> > transfers;
+};
+
+/**
+ * Single-threaded executor for asynchronous IS-NITRO operations.
+ *
+ * Drives libusb asynchronous transfers, timers, and posted jobs
+ * from the thread that calls run(). Any number of IS-NITRO units
+ * opened with the same libusb context can be driven concurrently.
+ *
+ * By default, run() handles libusb events itself. If a
+ * NitroEventThread is servicing the context, call
+ * setExternalEvents(true); completions are then posted to
+ * the executor from the event thread.
+ */
+class NitroExecutor
+{
+	public:
+		typedef std::function<void()> Job;
+
+		/**
+		 * Create an executor.
+		 * @param ctx libusb_context. (nullptr for default)
+		 */
+		explicit NitroExecutor(libusb_context *ctx = nullptr);
+
+	private:
+		NitroExecutor(const NitroExecutor &);
+		NitroExecutor &operator=(const NitroExecutor&);
+
+	public:
+		/**
+		 * Post a job to run on the executor thread.
+		 * Can be called from any thread.
+		 * @param job Job.
+		 */
+		void post(Job job);
+
+		/**
+		 * Post a job to run after a delay.
+		 * Must be called from the executor thread.
+		 * @param delay_us Delay, in microseconds.
+		 * @param job Job.
+		 */
+		void postDelayed(uint64_t delay_us, Job job);
+
+		/**
+		 * Set whether libusb events are handled by another thread.
+		 * Must be called before run().
+		 * @param external If true, run() won't call libusb_handle_events().
+		 */
+		inline void setExternalEvents(bool external)
+		{
+			m_externalEvents = external;
+		}
+
+		/**
+		 * Run until there are no jobs, timers, or transfers left.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int run(void);
+
+		/**
+		 * Notify the executor that a transfer was submitted.
+		 * run() won't return while transfers are in flight.
+		 */
+		inline void transferStarted(void)
+		{
+			m_inflight++;
+		}
+
+		/**
+		 * Notify the executor that a transfer has completed.
+		 * Can be called from any thread.
+		 */
+		inline void transferFinished(void)
+		{
+			m_inflight--;
+		}
+
+	private:
+		libusb_context *const m_ctx;
+
+		// Ready jobs. Protected by m_mutex.
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::deque<Job> m_ready;
+
+		// Timers. Only accessed from the executor thread.
+		std::multimap<uint64_t, Job> m_timers;
+
+		std::atomic<unsigned int> m_inflight;
+		bool m_externalEvents;
+};
+
+/**
+ * Asynchronous IS-NITRO command sequence.
+ *
+ * Steps are added with the builder functions and run in order on
+ * the executor thread once start() is called. Each USB command is
+ * submitted as an asynchronous transfer, so the executor can drive
+ * other tasks while this one is waiting for the device.
+ *
+ * If a step fails, the remaining steps are skipped and the
+ * completion callback receives the error code.
+ *
+ * Example:
+ *   NitroTask task(&exec, nitro);
+ *   task.call([](ISNitro *n) { return n->ndsReset(true); })
+ *       .upload(1, 0, rom, rom_size)
+ *       .call([](ISNitro *n) { return n->installDebuggerROM(); })
+ *       .call([](ISNitro *n) { return n->ndsReset(false); })
+ *       .waitForDebuggerROM()
+ *       .start([](int ret) { ... });
+ *   exec.run();
+ */
+class NitroTask
+{
+	public:
+		typedef std::function<void(int ret)> DoneCallback;
+
+		/**
+		 * Create a task.
+		 * @param exec Executor.
+		 * @param nitro ISNitro object. (Must use the executor's libusb context.)
+		 */
+		NitroTask(NitroExecutor *exec, ISNitro *nitro);
+		~NitroTask();
+
+	private:
+		NitroTask(const NitroTask &);
+		NitroTask &operator=(const NitroTask&);
+
+	public:
+		/** Builder functions **/
+
+		/**
+		 * Run a write-only ISNitro function asynchronously.
+		 * The function is called in capture mode; the USB commands
+		 * it would have sent are submitted as asynchronous transfers.
+		 * Functions that read from the device will fail with
+		 * LIBUSB_ERROR_NOT_SUPPORTED.
+		 * @param fn Function, e.g. [](ISNitro *n) { return n->ndsReset(false); }
+		 * @return *this
+		 */
+		NitroTask &call(std::function<int(ISNitro*)> fn);
+
+		/**
+		 * Upload data to EMULATOR memory.
+		 * Data is captured one chunk at a time.
+		 * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+		 * @param address Destination address.
+		 * @param data Data. (Must remain valid until the task finishes.)
+		 * @param len Length of data. (Must be a multiple of two bytes.)
+		 * @param chunkSize Chunk size.
+		 * @return *this
+		 */
+		NitroTask &upload(uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len,
+			uint32_t chunkSize = 1048576U);
+
+		/**
+		 * Wait without blocking the executor.
+		 * @param delay_us Delay, in microseconds.
+		 * @return *this
+		 */
+		NitroTask &delay(uint64_t delay_us);
+
+		/**
+		 * Run a function on the executor thread.
+		 * @param fn Function. Returns 0 to continue, or an error code to stop.
+		 * @return *this
+		 */
+		NitroTask &then(std::function<int()> fn);
+
+		/**
+		 * Wait for the debugger ROM to initialize.
+		 * Same as ISNitro::waitForDebuggerROM(), but polls
+		 * using executor timers instead of usleep().
+		 * @param poll_us Polling interval, in microseconds.
+		 * @param maxPolls Maximum number of polls.
+		 * @return *this
+		 */
+		NitroTask &waitForDebuggerROM(uint64_t poll_us = 10000, unsigned int maxPolls = 1000);
+
+		/** Execution **/
+
+		/**
+		 * Start the task.
+		 * @param done Completion callback. (optional)
+		 */
+		void start(DoneCallback done = DoneCallback());
+
+		/**
+		 * Has the task finished?
+		 * @return True if finished.
+		 */
+		inline bool isFinished(void) const
+		{
+			return m_finished;
+		}
+
+		/**
+		 * Get the task result.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		inline int result(void) const
+		{
+			return m_result;
+		}
+
+	private:
+		struct Transfer;
+		struct Pending;
+		typedef std::function<void()> Step;
+		typedef std::function<void(int ret)> Continuation;
+
+		/**
+		 * Finish the current step.
+		 * @param ret 0 to continue; error code to stop.
+		 */
+		void next(int ret);
+
+		/**
+		 * Capture the USB commands sent by an ISNitro function.
+		 * @param fn Function.
+		 * @param xfers Transfer list.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int capture(const std::function<int(ISNitro*)> &fn, std::vector<Transfer> &xfers);
+
+		/**
+		 * Submit transfers in order.
+		 * @param xfers Transfer list.
+		 * @param idx Index of the next transfer.
+		 * @param cont Continuation.
+		 */
+		void runTransfers(std::shared_ptr<std::vector<Transfer> > xfers, size_t idx, Continuation cont);
+
+		/**
+		 * Asynchronous transfer callback.
+		 * @param ret 0 on success; libusb error code on error.
+		 * @param transferred Actual transferred length.
+		 * @param userdata Pending.
+		 */
+		static void onTransfer(int ret, int transferred, void *userdata);
+
+		/**
+		 * Record a completed transfer in the trace buffer, if tracing is enabled.
+		 * @param xfers Transfer list.
+		 * @param idx Index of the completed transfer.
+		 * @param ret Transfer result.
+		 */
+		void traceTransfer(const std::vector<Transfer> &xfers, size_t idx, int ret);
+
+		/**
+		 * Poll the debugger state.
+		 * @param poll_us Polling interval, in microseconds.
+		 * @param remaining Remaining polls.
+		 */
+		void pollDebugger(uint64_t poll_us, unsigned int remaining);
+
+		/**
+		 * Upload a chunk.
+		 * @param _slot Emulated slot number.
+		 * @param address Destination address.
+		 * @param data Data.
+		 * @param len Remaining length of data.
+		 * @param chunkSize Chunk size.
+		 */
+		void uploadChunk(uint8_t _slot, uint32_t address, const uint8_t *data, uint32_t len, uint32_t chunkSize);
+
+	private:
+		NitroExecutor *const m_exec;
+		ISNitro *const m_nitro;
+		std::vector<Step> m_steps;
+		size_t m_step;
+		DoneCallback m_done;
+		int m_result;
+		bool m_finished;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROASYNC_HPP__ */
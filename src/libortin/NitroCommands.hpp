@@ -0,0 +1,145 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroCommands.hpp: Typed IS-NITRO command payloads.                     *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROCOMMANDS_HPP__
+#define __ORTIN_LIBORTIN_NITROCOMMANDS_HPP__
+
+#include "nitro-usb-cmds.h"
+
+/**
+ * Fixed-size command payloads.
+ *
+ * Each command has its own type with a constexpr constructor, so
+ * the payload is serialized at compile time where possible, and
+ * the size is known at compile time. Send them with
+ * ISNitro::sendCommand(), which builds the USB packet on the stack.
+ *
+ * All multi-byte fields are little-endian.
+ */
+
+// Little-endian 32-bit value as four initializer bytes.
+#define NITRO_LE32(v) \
+	(uint8_t)((v) & 0xFF), (uint8_t)(((v) >> 8) & 0xFF), \
+	(uint8_t)(((v) >> 16) & 0xFF), (uint8_t)(((v) >> 24) & 0xFF)
+
+/**
+ * Command payload base.
+ * @tparam Cmd Command. (See NitroCommand_e.)
+ * @tparam N Payload size.
+ */
+template<uint16_t Cmd, unsigned int N>
+struct NitroCommandPayload {
+	static const uint16_t CMD = Cmd;
+	static const unsigned int SIZE = N;
+	uint8_t bytes[N];
+};
+
+/**
+ * NITRO_CMD_FULL_RESET: Reset the entire IS-NITRO system.
+ */
+struct NitroCmdFullReset : public NitroCommandPayload<NITRO_CMD_FULL_RESET, 2> {
+	constexpr NitroCmdFullReset()
+		: NitroCommandPayload{{NITRO_CMD_FULL_RESET, 0xF2}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdFullReset, 2);
+
+/**
+ * NITRO_CMD_NDS_RESET: Set the RESET state of the Nintendo DS subsystem.
+ */
+struct NitroCmdNDSReset : public NitroCommandPayload<NITRO_CMD_NDS_RESET, 4> {
+	constexpr explicit NitroCmdNDSReset(bool reset)
+		: NitroCommandPayload{{NITRO_CMD_NDS_RESET, 0, (uint8_t)reset, 0}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdNDSReset, 4);
+
+/**
+ * NITRO_CMD_SET_CPU: Set the current CPU for CPU-specific commands.
+ */
+struct NitroCmdSetCPU : public NitroCommandPayload<NITRO_CMD_SET_CPU, 4> {
+	constexpr explicit NitroCmdSetCPU(uint8_t cpu)
+		: NitroCommandPayload{{NITRO_CMD_SET_CPU, 0, cpu, 0}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdSetCPU, 4);
+
+/**
+ * NITRO_CMD_SLOT_POWER: Set slot power.
+ */
+struct NitroCmdSlotPower : public NitroCommandPayload<NITRO_CMD_SLOT_POWER, 24> {
+	/**
+	 * @param device Device: 0x0A == Slot 1; 0x02, 0x04 == Slot 2
+	 * @param on True to turn on; false to turn off.
+	 */
+	constexpr NitroCmdSlotPower(uint8_t device, bool on)
+		: NitroCommandPayload{{
+			NITRO_CMD_SLOT_POWER, 0, 0, 0,
+			device, 0, 0, 0,
+			(uint8_t)on, 0, 0, 0,
+			0, 0, 0, 0,
+			0, 0, 0, 0,
+			0, 0, 0, 0}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdSlotPower, 24);
+
+/**
+ * NITRO_CMD_SET_BREAKPOINTS: Set breakpoints for the current CPU.
+ */
+struct NitroCmdSetBreakpoints : public NitroCommandPayload<NITRO_CMD_SET_BREAKPOINTS, 12> {
+	/**
+	 * @param action Action. (See NitroBreakpointAction_e.)
+	 */
+	constexpr explicit NitroCmdSetBreakpoints(uint32_t action)
+		: NitroCommandPayload{{NITRO_LE32(NITRO_CMD_SET_BREAKPOINTS), NITRO_LE32(4), NITRO_LE32(action)}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdSetBreakpoints, 12);
+
+/**
+ * NITRO_CMD_85: cmd133. Sent after continuing a CPU.
+ */
+struct NitroCmd85 : public NitroCommandPayload<NITRO_CMD_85, 2> {
+	constexpr NitroCmd85()
+		: NitroCommandPayload{{NITRO_CMD_85, 0}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmd85, 2);
+
+/**
+ * NITRO_CMD_87: cmd135. Sent before continuing a CPU.
+ */
+struct NitroCmd87 : public NitroCommandPayload<NITRO_CMD_87, 12> {
+	constexpr NitroCmd87()
+		: NitroCommandPayload{{NITRO_CMD_87, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmd87, 12);
+
+/**
+ * NITRO_CMD_A0: cmd160. Sent before breaking a CPU.
+ */
+struct NitroCmdA0 : public NitroCommandPayload<NITRO_CMD_A0, 2> {
+	constexpr explicit NitroCmdA0(uint8_t cpu)
+		: NitroCommandPayload{{NITRO_CMD_A0, cpu}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdA0, 2);
+
+/**
+ * NITRO_CMD_AE: cmd174. Sent after initializing the debugger ROM.
+ */
+struct NitroCmdAE : public NitroCommandPayload<NITRO_CMD_AE, 20> {
+	constexpr NitroCmdAE()
+		: NitroCommandPayload{{NITRO_LE32(NITRO_CMD_AE), NITRO_LE32(3), NITRO_LE32(1), NITRO_LE32(0), NITRO_LE32(0)}}
+	{ }
+};
+ASSERT_STRUCT(NitroCmdAE, 20);
+
+#endif /* __ORTIN_LIBORTIN_NITROCOMMANDS_HPP__ */
@@ -0,0 +1,232 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroEventThread.cpp: Dedicated libusb event handling thread.           *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroEventThread.hpp"
+
+#ifdef __linux__
+// Thread affinity and scheduling.
+# include <pthread.h>
+# include <sched.h>
+# include <sys/resource.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif /* __linux__ */
+
+// C includes. (C++ namespace)
+#include <cerrno>
+
+// C++ includes.
+#include <system_error>
+
+/** NitroLatencyStats **/
+
+NitroLatencyStats::NitroLatencyStats()
+{
+	reset();
+}
+
+/**
+ * Record a transfer latency.
+ * @param us Latency, in microseconds.
+ */
+void NitroLatencyStats::record(uint64_t us)
+{
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_total.fetch_add(us, std::memory_order_relaxed);
+
+	uint64_t prev = m_max.load(std::memory_order_relaxed);
+	while (us > prev && !m_max.compare_exchange_weak(prev, us, std::memory_order_relaxed)) { }
+
+	// Bucket index is the number of significant bits.
+	unsigned int bucket = 0;
+	for (uint64_t v = us; v != 0 && bucket < BUCKETS-1; v >>= 1) {
+		bucket++;
+	}
+	m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Reset all statistics.
+ */
+void NitroLatencyStats::reset(void)
+{
+	m_count.store(0, std::memory_order_relaxed);
+	m_total.store(0, std::memory_order_relaxed);
+	m_max.store(0, std::memory_order_relaxed);
+	for (unsigned int i = 0; i < BUCKETS; i++) {
+		m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Get the mean latency.
+ * @return Mean latency, in microseconds.
+ */
+double NitroLatencyStats::mean(void) const
+{
+	const uint64_t count = this->count();
+	if (count == 0)
+		return 0;
+	return (double)m_total.load(std::memory_order_relaxed) / (double)count;
+}
+
+/**
+ * Estimate a latency percentile from the histogram.
+ * @param p Percentile. (0.0 - 1.0)
+ * @return Upper bound of the bucket containing the percentile, in microseconds.
+ */
+uint64_t NitroLatencyStats::percentile(double p) const
+{
+	uint64_t counts[BUCKETS];
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < BUCKETS; i++) {
+		counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+	if (total == 0)
+		return 0;
+
+	const uint64_t target = (uint64_t)(p * (double)total + 0.5);
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= target && counts[i] > 0) {
+			return (i == 0 ? 0 : (1ULL << i) - 1);
+		}
+	}
+	return max();
+}
+
+/** NitroEventThread **/
+
+/**
+ * Create an event thread.
+ * @param ctx libusb_context. (nullptr for default)
+ */
+NitroEventThread::NitroEventThread(libusb_context *ctx)
+	: m_ctx(ctx)
+	, m_stop(false)
+{ }
+
+/**
+ * Stop the event thread.
+ */
+NitroEventThread::~NitroEventThread()
+{
+	stop();
+}
+
+/**
+ * Start the event thread.
+ * If the affinity or priority can't be set, the thread
+ * is stopped and an error is returned.
+ * @param options Options.
+ * @return 0 on success; libusb error code on error.
+ */
+int NitroEventThread::start(const Options &options)
+{
+	if (m_thread.joinable())
+		return LIBUSB_ERROR_BUSY;
+
+	m_stop.store(false);
+	std::promise<int> startResult;
+	std::future<int> future = startResult.get_future();
+	try {
+		m_thread = std::thread(&NitroEventThread::threadFunc, this, options, &startResult);
+	} catch (const std::system_error &) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	int ret = future.get();
+	if (ret != 0) {
+		// The thread exits on its own if the options couldn't be applied.
+		m_thread.join();
+	}
+	return ret;
+}
+
+/**
+ * Stop the event thread.
+ * Transfers that are still in flight will not complete
+ * until events are handled again.
+ */
+void NitroEventThread::stop(void)
+{
+	if (!m_thread.joinable())
+		return;
+
+	m_stop.store(true);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	// libusb-1.0.21: Wake up the event handler immediately.
+	libusb_interrupt_event_handler(m_ctx);
+#endif
+	m_thread.join();
+}
+
+/**
+ * Apply the affinity and priority options to the current thread.
+ * @param options Options.
+ * @return 0 on success; libusb error code on error.
+ */
+int NitroEventThread::applyOptions(const Options &options)
+{
+#ifdef __linux__
+	if (options.cpuMask != 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		for (unsigned int cpu = 0; cpu < 64; cpu++) {
+			if (options.cpuMask & (1ULL << cpu)) {
+				CPU_SET(cpu, &cpuset);
+			}
+		}
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (options.rtPriority > 0) {
+		struct sched_param param;
+		param.sched_priority = options.rtPriority;
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err != 0)
+			return (err == EPERM ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_INVALID_PARAM);
+	} else if (options.nice != 0) {
+		// On Linux, the nice value is per-thread.
+		errno = 0;
+		if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), options.nice) != 0)
+			return (errno == EACCES || errno == EPERM ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_INVALID_PARAM);
+	}
+	return 0;
+#else /* !__linux__ */
+	// TODO: Windows: SetThreadAffinityMask(), SetThreadPriority().
+	if (options.cpuMask != 0 || options.rtPriority != 0 || options.nice != 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return 0;
+#endif /* __linux__ */
+}
+
+/**
+ * Event thread function.
+ * @param options Options.
+ * @param startResult Result of applying the options.
+ */
+void NitroEventThread::threadFunc(Options options, std::promise<int> *startResult)
+{
+	int ret = applyOptions(options);
+	startResult->set_value(ret);
+	if (ret != 0)
+		return;
+
+	while (!m_stop.load()) {
+		// Short timeout in case libusb_interrupt_event_handler()
+		// isn't available.
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout_completed(m_ctx, &tv, nullptr);
+	}
+}
@@ -0,0 +1,197 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroEventThread.hpp: Dedicated libusb event handling thread.           *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROEVENTTHREAD_HPP__
+#define __ORTIN_LIBORTIN_NITROEVENTTHREAD_HPP__
+
+#include <stdint.h>
+#include <libusb.h>
+
+// C++ includes.
+#include <atomic>
+#include <future>
+#include <thread>
+
+/**
+ * Asynchronous transfer latency statistics.
+ * Latency is measured from submission to the completion callback.
+ * Recording is lock-free and can be done from any thread.
+ */
+class NitroLatencyStats
+{
+	public:
+		NitroLatencyStats();
+
+	private:
+		NitroLatencyStats(const NitroLatencyStats &);
+		NitroLatencyStats &operator=(const NitroLatencyStats&);
+
+	public:
+		// Histogram buckets: bucket n holds latencies in [2^(n-1), 2^n) us.
+		static const unsigned int BUCKETS = 32;
+
+		/**
+		 * Record a transfer latency.
+		 * @param us Latency, in microseconds.
+		 */
+		void record(uint64_t us);
+
+		/**
+		 * Reset all statistics.
+		 */
+		void reset(void);
+
+		/**
+		 * Get the number of transfers recorded.
+		 * @return Number of transfers.
+		 */
+		inline uint64_t count(void) const
+		{
+			return m_count.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Get the sum of all latencies.
+		 * @return Total latency, in microseconds.
+		 */
+		inline uint64_t total(void) const
+		{
+			return m_total.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Get the mean latency.
+		 * @return Mean latency, in microseconds.
+		 */
+		double mean(void) const;
+
+		/**
+		 * Get the maximum latency.
+		 * @return Maximum latency, in microseconds.
+		 */
+		inline uint64_t max(void) const
+		{
+			return m_max.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Get the number of transfers in a histogram bucket.
+		 * @param bucket Bucket index. (See BUCKETS.)
+		 * @return Number of transfers.
+		 */
+		inline uint64_t bucket(unsigned int bucket) const
+		{
+			return (bucket < BUCKETS ? m_buckets[bucket].load(std::memory_order_relaxed) : 0);
+		}
+
+		/**
+		 * Estimate a latency percentile from the histogram.
+		 * @param p Percentile. (0.0 - 1.0)
+		 * @return Upper bound of the bucket containing the percentile, in microseconds.
+		 */
+		uint64_t percentile(double p) const;
+
+	private:
+		std::atomic<uint64_t> m_count;
+		std::atomic<uint64_t> m_total;
+		std::atomic<uint64_t> m_max;
+		std::atomic<uint64_t> m_buckets[BUCKETS];
+};
+
+/**
+ * Dedicated libusb event handling thread.
+ *
+ * Services libusb_handle_events() for all asynchronous transfers
+ * on a context, which may be shared by multiple IS-NITRO units.
+ * Completion callbacks run on this thread.
+ *
+ * The thread can be pinned to specific CPUs and given a higher
+ * scheduling priority so completions aren't delayed by unrelated
+ * work on busy hosts.
+ */
+class NitroEventThread
+{
+	public:
+		/**
+		 * Event thread options.
+		 */
+		struct Options {
+			uint64_t cpuMask;	// CPU affinity mask (bit n == CPU n); 0 for no affinity
+			int rtPriority;		// SCHED_FIFO priority (1-99); 0 for the default scheduler
+			int nice;		// Nice value for the default scheduler; 0 for unchanged
+
+			Options()
+				: cpuMask(0)
+				, rtPriority(0)
+				, nice(0)
+			{ }
+		};
+
+		/**
+		 * Create an event thread.
+		 * @param ctx libusb_context. (nullptr for default)
+		 */
+		explicit NitroEventThread(libusb_context *ctx = nullptr);
+
+		/**
+		 * Stop the event thread.
+		 */
+		~NitroEventThread();
+
+	private:
+		NitroEventThread(const NitroEventThread &);
+		NitroEventThread &operator=(const NitroEventThread&);
+
+	public:
+		/**
+		 * Start the event thread.
+		 * If the affinity or priority can't be set, the thread
+		 * is stopped and an error is returned.
+		 * @param options Options.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int start(const Options &options = Options());
+
+		/**
+		 * Stop the event thread.
+		 * Transfers that are still in flight will not complete
+		 * until events are handled again.
+		 */
+		void stop(void);
+
+		/**
+		 * Is the event thread running?
+		 * @return True if running.
+		 */
+		inline bool isRunning(void) const
+		{
+			return m_thread.joinable();
+		}
+
+	private:
+		/**
+		 * Apply the affinity and priority options to the current thread.
+		 * @param options Options.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		static int applyOptions(const Options &options);
+
+		/**
+		 * Event thread function.
+		 * @param options Options.
+		 * @param startResult Result of applying the options.
+		 */
+		void threadFunc(Options options, std::promise<int> *startResult);
+
+	private:
+		libusb_context *const m_ctx;
+		std::thread m_thread;
+		std::atomic<bool> m_stop;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROEVENTTHREAD_HPP__ */
@@ -0,0 +1,375 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroLog.cpp: IS-NITRO USB command stream recording and replay.         *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroLog.hpp"
+#include "nitro-usb-cmds.h"
+#include "NitroTrace.hpp"
+#include "byteswap.h"
+#include "xxh64.h"
+
+// libusb
+#include <libusb.h>
+
+// C includes. (C++ namespace)
+#include <cerrno>
+#include <cstring>
+
+// C++ includes.
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+using std::unique_ptr;
+
+// OUT transfers larger than this are stored as header + hash.
+static const unsigned int NITROLOG_MAX_OUT_DATA = 64;
+static const unsigned int NITROLOG_HASHED_SIZE = sizeof(NitroUSBCmd) + sizeof(uint64_t);
+
+// Debugger ROM RTC value in Slot 1 EMULATOR memory.
+// This is set to the current time by ISNitro::installDebuggerROM(),
+// so it's masked out when recording and comparing OUT transfers.
+static const uint32_t NITROLOG_RTC_ADDRESS = 0xFF80218;
+static const uint32_t NITROLOG_RTC_LEN = 7;
+
+/**
+ * Find the debugger ROM RTC value in an OUT transfer.
+ * @param data		[in] Data.
+ * @param length	[in] Length of data.
+ * @param pOffset	[out] Offset of the RTC bytes in the transfer.
+ * @param pLen		[out] Number of RTC bytes in the transfer.
+ * @return True if the transfer contains RTC bytes.
+ */
+static bool findRTC(const uint8_t *data, uint32_t length, uint32_t *pOffset, uint32_t *pLen)
+{
+	if (length <= sizeof(NitroUSBCmd))
+		return false;
+
+	NitroUSBCmd cdb;
+	memcpy(&cdb, data, sizeof(cdb));
+	if (le16_to_cpu(cdb.cmd) != NITRO_CMD_EMULATOR_MEMORY ||
+	    cdb.op != NITRO_OP_WRITE || cdb._slot != 1)
+	{
+		return false;
+	}
+
+	const uint32_t start = le32_to_cpu(cdb.address);
+	const uint32_t end = start + (length - (uint32_t)sizeof(cdb));
+	const uint32_t rtcStart = std::max(start, NITROLOG_RTC_ADDRESS);
+	const uint32_t rtcEnd = std::min(end, NITROLOG_RTC_ADDRESS + NITROLOG_RTC_LEN);
+	if (rtcStart >= rtcEnd)
+		return false;
+
+	*pOffset = (uint32_t)sizeof(cdb) + (rtcStart - start);
+	*pLen = rtcEnd - rtcStart;
+	return true;
+}
+
+/**
+ * Build the stored data for an OUT transfer.
+ * The debugger ROM RTC value is zeroed.
+ * @param data		[in] Data.
+ * @param length	[in] Length of data.
+ * @param buf		[out] Buffer. (NITROLOG_MAX_OUT_DATA bytes)
+ * @param pFlags	[out] Flags.
+ * @return Pointer to the data to store.
+ */
+static const uint8_t *hashOutData(const uint8_t *data, uint32_t length, uint8_t *buf, uint8_t *pFlags)
+{
+	uint32_t rtcOffset = 0, rtcLen = 0;
+	const bool hasRTC = findRTC(data, length, &rtcOffset, &rtcLen);
+
+	if (length <= NITROLOG_MAX_OUT_DATA) {
+		*pFlags = 0;
+		if (!hasRTC)
+			return data;
+		memcpy(buf, data, length);
+		memset(&buf[rtcOffset], 0, rtcLen);
+		return buf;
+	}
+
+	uint64_t hash;
+	if (hasRTC) {
+		static const uint8_t zero[NITROLOG_RTC_LEN] = {0};
+		XXH64_State xxh;
+		xxh64_init(&xxh, 0);
+		xxh64_update(&xxh, data, rtcOffset);
+		xxh64_update(&xxh, zero, rtcLen);
+		xxh64_update(&xxh, &data[rtcOffset + rtcLen], length - rtcOffset - rtcLen);
+		hash = xxh64_digest(&xxh);
+	} else {
+		hash = xxh64(data, length, 0);
+	}
+
+	memcpy(buf, data, sizeof(NitroUSBCmd));
+	hash = cpu_to_le64(hash);
+	memcpy(&buf[sizeof(NitroUSBCmd)], &hash, sizeof(hash));
+	*pFlags = NITROLOG_FLAG_HASHED;
+	return buf;
+}
+
+/** NitroRecorder **/
+
+NitroRecorder::NitroRecorder()
+	: m_file(nullptr)
+	, m_lastEnd(0)
+{ }
+
+NitroRecorder::~NitroRecorder()
+{
+	close();
+}
+
+/**
+ * Open a log file for recording.
+ * @param filename Log filename.
+ * @return 0 on success; negative POSIX error code on error.
+ */
+int NitroRecorder::open(const char *filename)
+{
+	close();
+
+	errno = 0;
+	m_file = fopen(filename, "wb");
+	if (!m_file) {
+		int err = errno;
+		return (err != 0 ? -err : -EIO);
+	}
+
+	NitroLogHeader hdr;
+	memcpy(hdr.magic, NITROLOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(NITROLOG_VERSION);
+	hdr.reserved = 0;
+	if (fwrite(&hdr, sizeof(hdr), 1, m_file) != 1) {
+		fclose(m_file);
+		m_file = nullptr;
+		return -EIO;
+	}
+
+	m_lastEnd = 0;
+	return 0;
+}
+
+/**
+ * Close the log file.
+ * @return 0 on success; negative POSIX error code on error.
+ */
+int NitroRecorder::close(void)
+{
+	if (!m_file)
+		return 0;
+
+	int ret = fclose(m_file);
+	m_file = nullptr;
+	return (ret == 0 ? 0 : -EIO);
+}
+
+/**
+ * Record a bulk transfer.
+ * @param endpoint	[in] Endpoint.
+ * @param data		[in] Data. (sent for OUT, received for IN)
+ * @param length	[in] Requested length.
+ * @param transferred	[in] Actual transferred length.
+ * @param result	[in] libusb result.
+ * @param ts		[in] Start timestamp. (NitroTrace::now())
+ * @param te		[in] End timestamp. (NitroTrace::now())
+ */
+void NitroRecorder::record(uint8_t endpoint, const uint8_t *data, int length,
+	int transferred, int result, uint64_t ts, uint64_t te)
+{
+	if (!m_file)
+		return;
+
+	NitroLogRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	// NOTE: Pipelined transfers overlap, so there's no gap
+	// if this transfer started before the previous one ended.
+	rec.gap_us = cpu_to_le32(m_lastEnd != 0 && ts > m_lastEnd
+		? (uint32_t)std::min<uint64_t>(ts - m_lastEnd, UINT32_MAX) : 0);
+	rec.dur_us = cpu_to_le32((uint32_t)std::min<uint64_t>(te - ts, UINT32_MAX));
+	rec.result = (int32_t)cpu_to_le32((uint32_t)result);
+	rec.length = cpu_to_le32((uint32_t)length);
+	rec.transferred = cpu_to_le32((uint32_t)transferred);
+	rec.endpoint = endpoint;
+	m_lastEnd = std::max(m_lastEnd, te);
+
+	const uint8_t *stored;
+	uint32_t storedLen;
+	uint8_t hashBuf[NITROLOG_MAX_OUT_DATA];
+	if (endpoint & 0x80) {
+		// IN: Store the received data.
+		stored = data;
+		storedLen = (result == 0 ? (uint32_t)transferred : 0);
+	} else {
+		// OUT: Store the sent data, or a hash if it's large.
+		stored = hashOutData(data, (uint32_t)length, hashBuf, &rec.flags);
+		storedLen = (rec.flags & NITROLOG_FLAG_HASHED) ? NITROLOG_HASHED_SIZE : (uint32_t)length;
+	}
+	rec.stored = cpu_to_le32(storedLen);
+
+	fwrite(&rec, sizeof(rec), 1, m_file);
+	if (storedLen > 0) {
+		fwrite(stored, 1, storedLen, m_file);
+	}
+}
+
+/** NitroReplay **/
+
+NitroReplay::NitroReplay()
+	: m_file(nullptr)
+	, m_speed(1.0)
+	, m_lastEnd(0)
+	, m_replayed(0)
+	, m_diverged(false)
+{ }
+
+NitroReplay::~NitroReplay()
+{
+	if (m_file) {
+		fclose(m_file);
+	}
+}
+
+/**
+ * Open a log file for replay.
+ * @param filename Log filename.
+ * @return 0 on success; negative POSIX error code on error.
+ */
+int NitroReplay::open(const char *filename)
+{
+	if (m_file) {
+		fclose(m_file);
+	}
+	m_lastEnd = 0;
+	m_replayed = 0;
+	m_diverged = false;
+
+	errno = 0;
+	m_file = fopen(filename, "rb");
+	if (!m_file) {
+		int err = errno;
+		return (err != 0 ? -err : -EIO);
+	}
+
+	NitroLogHeader hdr;
+	if (fread(&hdr, sizeof(hdr), 1, m_file) != 1 ||
+	    memcmp(hdr.magic, NITROLOG_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    le32_to_cpu(hdr.version) != NITROLOG_VERSION)
+	{
+		fclose(m_file);
+		m_file = nullptr;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * Report a divergence.
+ * @param msg Description.
+ * @return LIBUSB_ERROR_IO
+ */
+int NitroReplay::diverge(const char *msg)
+{
+	if (!m_diverged) {
+		fprintf(stderr, "*** REPLAY DIVERGED at transfer %u: %s\n", m_replayed + 1, msg);
+		m_diverged = true;
+	}
+	return LIBUSB_ERROR_IO;
+}
+
+/**
+ * Replay a bulk transfer.
+ * Same semantics as libusb_bulk_transfer().
+ * @param endpoint	[in] Endpoint.
+ * @param data		[in/out] Data.
+ * @param length	[in] Length.
+ * @param transferred	[out] Actual transferred length.
+ * @return libusb result.
+ */
+int NitroReplay::transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred)
+{
+	*transferred = 0;
+	if (m_diverged || !m_file)
+		return LIBUSB_ERROR_IO;
+
+	NitroLogRecord rec;
+	if (fread(&rec, sizeof(rec), 1, m_file) != 1)
+		return diverge("end of log");
+
+	// Don't trust the sizes in the log. A transfer never stores
+	// more than its length, or the hash for a large OUT transfer.
+	const uint32_t stored = le32_to_cpu(rec.stored);
+	if (length < 0 || stored > std::max((uint32_t)length, NITROLOG_HASHED_SIZE))
+		return diverge("stored length mismatch");
+	unique_ptr<uint8_t[]> buf(new uint8_t[std::max(stored, 1U)]);
+	if (stored > 0 && fread(buf.get(), 1, stored, m_file) != stored)
+		return diverge("truncated log");
+
+	if (rec.endpoint != endpoint)
+		return diverge("endpoint mismatch");
+	if (le32_to_cpu(rec.length) != (uint32_t)length)
+		return diverge("length mismatch");
+	const uint32_t recTransferred = le32_to_cpu(rec.transferred);
+	if (recTransferred > (uint32_t)length)
+		return diverge("transferred length mismatch");
+
+	if (!(endpoint & 0x80)) {
+		// OUT: Verify the data.
+		uint8_t hashBuf[NITROLOG_MAX_OUT_DATA];
+		uint8_t flags;
+		const uint8_t *const expected = hashOutData(data, (uint32_t)length, hashBuf, &flags);
+		const uint32_t expectedLen = (flags & NITROLOG_FLAG_HASHED) ? NITROLOG_HASHED_SIZE : (uint32_t)length;
+		if (flags != rec.flags || expectedLen != stored || memcmp(expected, buf.get(), stored) != 0)
+			return diverge("OUT data mismatch");
+	} else {
+		// IN: Return the recorded data.
+		if (stored > (uint32_t)length)
+			return diverge("IN data length mismatch");
+		memcpy(data, buf.get(), stored);
+	}
+
+	if (m_speed > 0) {
+		// Reproduce the time between transfers. Time spent by the
+		// host since the previous transfer counts towards the gap.
+		if (m_lastEnd != 0) {
+			const uint64_t target = m_lastEnd + (uint64_t)(le32_to_cpu(rec.gap_us) / m_speed);
+			const uint64_t now = NitroTrace::now();
+			if (target > now) {
+				std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(target - now)));
+			}
+		}
+
+		// Simulate the device latency.
+		const uint32_t dur_us = le32_to_cpu(rec.dur_us);
+		std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(dur_us / m_speed)));
+		m_lastEnd = NitroTrace::now();
+	}
+
+	m_replayed++;
+	*transferred = (int)recTransferred;
+	return (int)(int32_t)le32_to_cpu((uint32_t)rec.result);
+}
+
+/**
+ * Count the remaining records in the log.
+ * This consumes the rest of the log.
+ * @return Number of records that were not replayed.
+ */
+unsigned int NitroReplay::remaining(void)
+{
+	if (!m_file)
+		return 0;
+
+	unsigned int count = 0;
+	NitroLogRecord rec;
+	while (fread(&rec, sizeof(rec), 1, m_file) == 1) {
+		count++;
+		if (fseek(m_file, (long)le32_to_cpu(rec.stored), SEEK_CUR) != 0)
+			break;
+	}
+	return count;
+}
@@ -0,0 +1,187 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroLog.hpp: IS-NITRO USB command stream recording and replay.         *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROLOG_HPP__
+#define __ORTIN_LIBORTIN_NITROLOG_HPP__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Command stream log file header.
+ * All fields are little-endian.
+ */
+typedef struct _NitroLogHeader {
+	char magic[8];		// "ORTINLOG"
+	uint32_t version;	// NITROLOG_VERSION
+	uint32_t reserved;
+} NitroLogHeader;
+static_assert(sizeof(NitroLogHeader) == 16, "NitroLogHeader is the wrong size");
+
+#define NITROLOG_MAGIC "ORTINLOG"
+#define NITROLOG_VERSION 1
+
+/**
+ * Command stream log record.
+ * One record is written for each bulk transfer, followed
+ * by `stored` bytes of data.
+ * All fields are little-endian.
+ */
+typedef struct _NitroLogRecord {
+	uint32_t gap_us;	// Time since the end of the previous transfer
+	uint32_t dur_us;	// Transfer duration
+	int32_t result;		// libusb result
+	uint32_t length;	// Requested length
+	uint32_t transferred;	// Actual transferred length
+	uint32_t stored;	// Number of data bytes following this record
+	uint8_t endpoint;	// Endpoint
+	uint8_t flags;		// See NitroLogFlags_e
+	uint8_t reserved[2];
+} NitroLogRecord;
+static_assert(sizeof(NitroLogRecord) == 28, "NitroLogRecord is the wrong size");
+
+typedef enum {
+	// Large OUT transfers only store the NitroUSBCmd header,
+	// followed by the xxHash64 of the entire transfer.
+	NITROLOG_FLAG_HASHED	= (1U << 0),
+} NitroLogFlags_e;
+
+/**
+ * Records bulk transfers to a command stream log.
+ */
+class NitroRecorder
+{
+	public:
+		NitroRecorder();
+		~NitroRecorder();
+
+	private:
+		NitroRecorder(const NitroRecorder &);
+		NitroRecorder &operator=(const NitroRecorder&);
+
+	public:
+		/**
+		 * Open a log file for recording.
+		 * @param filename Log filename.
+		 * @return 0 on success; negative POSIX error code on error.
+		 */
+		int open(const char *filename);
+
+		/**
+		 * Close the log file.
+		 * @return 0 on success; negative POSIX error code on error.
+		 */
+		int close(void);
+
+		/**
+		 * Record a bulk transfer.
+		 * @param endpoint	[in] Endpoint.
+		 * @param data		[in] Data. (sent for OUT, received for IN)
+		 * @param length	[in] Requested length.
+		 * @param transferred	[in] Actual transferred length.
+		 * @param result	[in] libusb result.
+		 * @param ts		[in] Start timestamp. (NitroTrace::now())
+		 * @param te		[in] End timestamp. (NitroTrace::now())
+		 */
+		void record(uint8_t endpoint, const uint8_t *data, int length,
+			int transferred, int result, uint64_t ts, uint64_t te);
+
+	private:
+		FILE *m_file;
+		uint64_t m_lastEnd;
+};
+
+/**
+ * Replays a command stream log.
+ *
+ * OUT transfers are compared against the log; the first mismatch
+ * is reported as a divergence and all further transfers fail.
+ * The debugger ROM RTC value isn't compared, since it's set
+ * to the current time when the debugger ROM is installed.
+ * IN transfers return the recorded responses.
+ */
+class NitroReplay
+{
+	public:
+		NitroReplay();
+		~NitroReplay();
+
+	private:
+		NitroReplay(const NitroReplay &);
+		NitroReplay &operator=(const NitroReplay&);
+
+	public:
+		/**
+		 * Open a log file for replay.
+		 * @param filename Log filename.
+		 * @return 0 on success; negative POSIX error code on error.
+		 */
+		int open(const char *filename);
+
+		/**
+		 * Set the replay speed.
+		 * @param speed Speed factor. (1.0 == original timing; 0 == no delays)
+		 */
+		inline void setSpeed(double speed)
+		{
+			m_speed = speed;
+		}
+
+		/**
+		 * Replay a bulk transfer.
+		 * Same semantics as libusb_bulk_transfer().
+		 * @param endpoint	[in] Endpoint.
+		 * @param data		[in/out] Data.
+		 * @param length	[in] Length.
+		 * @param transferred	[out] Actual transferred length.
+		 * @return libusb result.
+		 */
+		int transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred);
+
+		/**
+		 * Count the remaining records in the log.
+		 * This consumes the rest of the log.
+		 * @return Number of records that were not replayed.
+		 */
+		unsigned int remaining(void);
+
+		/**
+		 * Get the number of transfers replayed successfully.
+		 * @return Number of transfers.
+		 */
+		inline unsigned int replayed(void) const
+		{
+			return m_replayed;
+		}
+
+		/**
+		 * Has the replay diverged from the log?
+		 * @return True if diverged.
+		 */
+		inline bool diverged(void) const
+		{
+			return m_diverged;
+		}
+
+	private:
+		/**
+		 * Report a divergence.
+		 * @param msg Description.
+		 * @return LIBUSB_ERROR_IO
+		 */
+		int diverge(const char *msg);
+
+	private:
+		FILE *m_file;
+		double m_speed;
+		uint64_t m_lastEnd;
+		unsigned int m_replayed;
+		bool m_diverged;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROLOG_HPP__ */
@@ -0,0 +1,190 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroMetrics.cpp: Per-unit USB and operation metrics.                   *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroMetrics.hpp"
+
+#include <libusb.h>
+
+// C includes. (C++ namespace)
+#include <cstdio>
+
+using std::string;
+
+// Operation names for the "op" label.
+static const char *const op_names[NitroMetrics::OP_MAX] = {
+	"load", "reset", "avmode", "debugger_boot",
+};
+
+NitroMetrics::NitroMetrics()
+	: m_bytesOut(0)
+	, m_bytesIn(0)
+	, m_transfersOut(0)
+	, m_transfersIn(0)
+{
+	for (unsigned int i = 0; i < ERROR_CODES; i++) {
+		m_errors[i].store(0, std::memory_order_relaxed);
+	}
+	for (unsigned int i = 0; i < OP_MAX; i++) {
+		m_opFailures[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Get the error counter index for a libusb error code.
+ * @param ret libusb error code.
+ * @return Index.
+ */
+unsigned int NitroMetrics::errorIndex(int ret)
+{
+	// libusb error codes are -1 through -12, plus LIBUSB_ERROR_OTHER (-99).
+	if (ret < 0 && -ret < (int)ERROR_CODES - 1)
+		return (unsigned int)-ret;
+	return ERROR_CODES - 1;
+}
+
+/**
+ * Record a bulk transfer.
+ * @param endpoint Endpoint.
+ * @param transferred Number of bytes transferred.
+ * @param ret libusb error code.
+ * @param us Duration, in microseconds.
+ */
+void NitroMetrics::recordTransfer(uint8_t endpoint, int transferred, int ret, uint64_t us)
+{
+	if (endpoint & 0x80) {
+		m_transfersIn.fetch_add(1, std::memory_order_relaxed);
+		m_bytesIn.fetch_add(transferred, std::memory_order_relaxed);
+	} else {
+		m_transfersOut.fetch_add(1, std::memory_order_relaxed);
+		m_bytesOut.fetch_add(transferred, std::memory_order_relaxed);
+	}
+	if (ret < 0) {
+		m_errors[errorIndex(ret)].fetch_add(1, std::memory_order_relaxed);
+	}
+	m_transferLatency.record(us);
+}
+
+/**
+ * Record an operation.
+ * @param op Operation.
+ * @param us Duration, in microseconds.
+ * @param ret Result. (0 on success)
+ */
+void NitroMetrics::recordOperation(Operation op, uint64_t us, int ret)
+{
+	if (op < 0 || op >= OP_MAX)
+		return;
+	m_opDuration[op].record(us);
+	if (ret != 0) {
+		m_opFailures[op].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Append a Prometheus histogram.
+ * @param out Output string.
+ * @param name Metric name.
+ * @param labels Labels, without braces.
+ * @param stats Latency statistics, in microseconds.
+ */
+static void appendHistogram(string &out, const char *name, const string &labels, const NitroLatencyStats &stats)
+{
+	// NitroLatencyStats bucket n holds [2^(n-1), 2^n) us.
+	char buf[256];
+	uint64_t cumulative = 0;
+	for (unsigned int i = 0; i < NitroLatencyStats::BUCKETS; i++) {
+		cumulative += stats.bucket(i);
+		snprintf(buf, sizeof(buf), "%s_bucket{%s,le=\"%g\"} %llu\n",
+			name, labels.c_str(), (double)(1ULL << i) / 1000000.0,
+			(unsigned long long)cumulative);
+		out += buf;
+	}
+	snprintf(buf, sizeof(buf), "%s_bucket{%s,le=\"+Inf\"} %llu\n",
+		name, labels.c_str(), (unsigned long long)stats.count());
+	out += buf;
+	snprintf(buf, sizeof(buf), "%s_sum{%s} %.6f\n",
+		name, labels.c_str(), (double)stats.total() / 1000000.0);
+	out += buf;
+	snprintf(buf, sizeof(buf), "%s_count{%s} %llu\n",
+		name, labels.c_str(), (unsigned long long)stats.count());
+	out += buf;
+}
+
+/**
+ * Export the metrics in Prometheus text format.
+ * @param out Output string. (Metrics are appended.)
+ * @param unit Unit name for the "unit" label.
+ */
+void NitroMetrics::exportPrometheus(string &out, const char *unit) const
+{
+	// Escape the unit name for use as a label value.
+	string labels = "unit=\"";
+	for (const char *p = unit; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"') {
+			labels += '\\';
+		} else if (*p == '\n') {
+			labels += "\\n";
+			continue;
+		}
+		labels += *p;
+	}
+	labels += '"';
+	const char *const l = labels.c_str();
+
+	char buf[256];
+	out += "# HELP ortin_usb_bytes_total Bytes transferred over USB.\n"
+	       "# TYPE ortin_usb_bytes_total counter\n";
+	snprintf(buf, sizeof(buf), "ortin_usb_bytes_total{%s,direction=\"out\"} %llu\n"
+		"ortin_usb_bytes_total{%s,direction=\"in\"} %llu\n",
+		l, (unsigned long long)m_bytesOut.load(std::memory_order_relaxed),
+		l, (unsigned long long)m_bytesIn.load(std::memory_order_relaxed));
+	out += buf;
+
+	out += "# HELP ortin_usb_transfers_total USB bulk transfers.\n"
+	       "# TYPE ortin_usb_transfers_total counter\n";
+	snprintf(buf, sizeof(buf), "ortin_usb_transfers_total{%s,direction=\"out\"} %llu\n"
+		"ortin_usb_transfers_total{%s,direction=\"in\"} %llu\n",
+		l, (unsigned long long)m_transfersOut.load(std::memory_order_relaxed),
+		l, (unsigned long long)m_transfersIn.load(std::memory_order_relaxed));
+	out += buf;
+
+	out += "# HELP ortin_usb_errors_total USB transfer errors by libusb error code.\n"
+	       "# TYPE ortin_usb_errors_total counter\n";
+	for (unsigned int i = 1; i < ERROR_CODES; i++) {
+		const int code = (i == ERROR_CODES - 1 ? LIBUSB_ERROR_OTHER : -(int)i);
+		snprintf(buf, sizeof(buf), "ortin_usb_errors_total{%s,code=\"%s\"} %llu\n",
+			l, libusb_error_name(code),
+			(unsigned long long)m_errors[i].load(std::memory_order_relaxed));
+		out += buf;
+	}
+
+	out += "# HELP ortin_usb_timeouts_total USB transfer timeouts.\n"
+	       "# TYPE ortin_usb_timeouts_total counter\n";
+	snprintf(buf, sizeof(buf), "ortin_usb_timeouts_total{%s} %llu\n", l,
+		(unsigned long long)m_errors[errorIndex(LIBUSB_ERROR_TIMEOUT)].load(std::memory_order_relaxed));
+	out += buf;
+
+	out += "# HELP ortin_usb_transfer_duration_seconds USB bulk transfer duration.\n"
+	       "# TYPE ortin_usb_transfer_duration_seconds histogram\n";
+	appendHistogram(out, "ortin_usb_transfer_duration_seconds", labels, m_transferLatency);
+
+	out += "# HELP ortin_operation_duration_seconds Duration of loads, resets, and AV mode changes.\n"
+	       "# TYPE ortin_operation_duration_seconds histogram\n";
+	for (unsigned int i = 0; i < OP_MAX; i++) {
+		appendHistogram(out, "ortin_operation_duration_seconds",
+			labels + ",op=\"" + op_names[i] + '"', m_opDuration[i]);
+	}
+
+	out += "# HELP ortin_operation_failures_total Failed loads, resets, and AV mode changes.\n"
+	       "# TYPE ortin_operation_failures_total counter\n";
+	for (unsigned int i = 0; i < OP_MAX; i++) {
+		snprintf(buf, sizeof(buf), "ortin_operation_failures_total{%s,op=\"%s\"} %llu\n",
+			l, op_names[i], (unsigned long long)m_opFailures[i].load(std::memory_order_relaxed));
+		out += buf;
+	}
+}
@@ -0,0 +1,98 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroMetrics.hpp: Per-unit USB and operation metrics.                   *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROMETRICS_HPP__
+#define __ORTIN_LIBORTIN_NITROMETRICS_HPP__
+
+#include <stdint.h>
+
+// NitroLatencyStats
+#include "NitroEventThread.hpp"
+
+// C++ includes.
+#include <atomic>
+#include <string>
+
+/**
+ * Per-unit metrics.
+ *
+ * Counts USB transfers, bytes, and errors, and keeps latency
+ * histograms for transfers and long-running operations.
+ * Recording is lock-free and can be done from any thread,
+ * so metrics can be exported while the unit is in use.
+ */
+class NitroMetrics
+{
+	public:
+		NitroMetrics();
+
+	private:
+		NitroMetrics(const NitroMetrics &);
+		NitroMetrics &operator=(const NitroMetrics&);
+
+	public:
+		/**
+		 * Timed operations.
+		 */
+		enum Operation {
+			OP_LOAD		= 0,	// Loading a ROM image
+			OP_RESET	= 1,	// ISNitro::fullReset()
+			OP_AVMODE	= 2,	// ISNitro::setAVModeSettings()
+			OP_DEBUGGER_BOOT	= 3,	// ISNitro::waitForDebuggerROM()
+
+			OP_MAX
+		};
+
+		/**
+		 * Record a bulk transfer.
+		 * @param endpoint Endpoint.
+		 * @param transferred Number of bytes transferred.
+		 * @param ret libusb error code.
+		 * @param us Duration, in microseconds.
+		 */
+		void recordTransfer(uint8_t endpoint, int transferred, int ret, uint64_t us);
+
+		/**
+		 * Record an operation.
+		 * @param op Operation.
+		 * @param us Duration, in microseconds.
+		 * @param ret Result. (0 on success)
+		 */
+		void recordOperation(Operation op, uint64_t us, int ret);
+
+		/**
+		 * Export the metrics in Prometheus text format.
+		 * @param out Output string. (Metrics are appended.)
+		 * @param unit Unit name for the "unit" label.
+		 */
+		void exportPrometheus(std::string &out, const char *unit) const;
+
+	private:
+		/**
+		 * Get the error counter index for a libusb error code.
+		 * @param ret libusb error code.
+		 * @return Index.
+		 */
+		static unsigned int errorIndex(int ret);
+
+	private:
+		std::atomic<uint64_t> m_bytesOut;
+		std::atomic<uint64_t> m_bytesIn;
+		std::atomic<uint64_t> m_transfersOut;
+		std::atomic<uint64_t> m_transfersIn;
+
+		// libusb errors, indexed by -code. (LIBUSB_ERROR_OTHER is last.)
+		static const unsigned int ERROR_CODES = 14;
+		std::atomic<uint64_t> m_errors[ERROR_CODES];
+
+		NitroLatencyStats m_transferLatency;
+		NitroLatencyStats m_opDuration[OP_MAX];
+		std::atomic<uint64_t> m_opFailures[OP_MAX];
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROMETRICS_HPP__ */
@@ -0,0 +1,97 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroNECBatch.hpp: NEC register write builder.                          *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITRONECBATCH_HPP__
+#define __ORTIN_LIBORTIN_NITRONECBATCH_HPP__
+
+#include <stdint.h>
+
+// C++ includes.
+#include <vector>
+
+/**
+ * NEC register write builder.
+ *
+ * Writes are sent in the order they were added. Consecutive writes
+ * to ascending, contiguous register addresses are merged into a
+ * single multi-unit NEC command by ISNitro::writeNECBatch().
+ *
+ * A new command is started whenever the next address isn't
+ * contiguous, including when the same register is written again.
+ * Use split() to force a new command where the device needs to
+ * see the writes separately.
+ *
+ * Example:
+ *   NitroNECBatch batch;
+ *   batch.write(NITRO_NEC_REG_MONITOR_BG_R, r)
+ *        .write(NITRO_NEC_REG_MONITOR_BG_G, g)
+ *        .write(NITRO_NEC_REG_MONITOR_BG_B, b);
+ *   nitro->writeNECBatch(batch);	// one USB command
+ */
+class NitroNECBatch
+{
+	public:
+		struct Write {
+			uint32_t address;	// Register address
+			uint16_t value;		// Value
+			bool split;		// Start a new command here
+		};
+
+		NitroNECBatch()
+			: m_split(false)
+		{ }
+
+	public:
+		/**
+		 * Add a register write.
+		 * @param address Register address. (See NitroNECVideoRegister_e.)
+		 * @param value Value.
+		 * @return *this
+		 */
+		inline NitroNECBatch &write(uint32_t address, uint16_t value)
+		{
+			const Write w = {address, value, m_split};
+			m_writes.push_back(w);
+			m_split = false;
+			return *this;
+		}
+
+		/**
+		 * Don't merge the next write with the previous one.
+		 * @return *this
+		 */
+		inline NitroNECBatch &split(void)
+		{
+			m_split = true;
+			return *this;
+		}
+
+		/**
+		 * Get the writes.
+		 * @return Writes.
+		 */
+		inline const std::vector<Write> &writes(void) const
+		{
+			return m_writes;
+		}
+
+		/**
+		 * Remove all writes.
+		 */
+		inline void clear(void)
+		{
+			m_writes.clear();
+			m_split = false;
+		}
+
+	private:
+		std::vector<Write> m_writes;
+		bool m_split;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITRONECBATCH_HPP__ */
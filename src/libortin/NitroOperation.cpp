@@ -0,0 +1,269 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroOperation.cpp: Long-running IS-NITRO operations.                   *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroOperation.hpp"
+#include "ISNitro.hpp"
+#include "NitroTrace.hpp"
+
+// C includes. (C++ namespace)
+#include <cassert>
+
+// C++ includes.
+#include <algorithm>
+#include <system_error>
+
+/** NitroOperation **/
+
+/**
+ * Create an operation.
+ * @param nitro ISNitro object.
+ * @param name Operation name, for tracing. (Must be a static string.)
+ */
+NitroOperation::NitroOperation(ISNitro *nitro, const char *name)
+	: m_nitro(nitro)
+	, m_name(name)
+	, m_callback(nullptr)
+	, m_userdata(nullptr)
+	, m_done(0)
+	, m_total(0)
+	, m_cancel(false)
+	, m_finished(false)
+	, m_result(0)
+{ }
+
+/**
+ * Destroy the operation.
+ * If it's still running, it will be cancelled.
+ */
+NitroOperation::~NitroOperation()
+{
+	// NOTE: Subclasses must also cancel and wait in their
+	// destructors, since run() can't be called once the
+	// derived object has been destroyed.
+	cancel();
+	wait();
+}
+
+/**
+ * Set the progress callback.
+ * Must be called before start().
+ * @param callback Progress callback, or nullptr for none.
+ * @param userdata User data.
+ */
+void NitroOperation::setProgressCallback(ProgressCallback callback, void *userdata)
+{
+	assert(!m_thread.joinable());
+	m_callback = callback;
+	m_userdata = userdata;
+}
+
+/**
+ * Start the operation on a worker thread.
+ * @return 0 on success; libusb error code on error.
+ */
+int NitroOperation::start(void)
+{
+	if (m_thread.joinable())
+		return LIBUSB_ERROR_BUSY;
+	if (!m_nitro->isOpen())
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	m_done.store(0, std::memory_order_relaxed);
+	m_cancel.store(false, std::memory_order_relaxed);
+	m_finished.store(false, std::memory_order_relaxed);
+	m_result = 0;
+
+	try {
+		m_thread = std::thread(&NitroOperation::threadFunc, this);
+	} catch (const std::system_error &) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	return 0;
+}
+
+/**
+ * Request cancellation.
+ * This returns immediately; call wait() to wait for
+ * the operation to stop.
+ */
+void NitroOperation::cancel(void)
+{
+	m_cancel.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * Wait for the operation to finish.
+ * @return 0 on success; libusb error code on error.
+ */
+int NitroOperation::wait(void)
+{
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	return m_result;
+}
+
+/**
+ * Add completed units and report progress.
+ * @param units Units completed.
+ */
+void NitroOperation::addProgress(uint64_t units)
+{
+	const uint64_t done = m_done.fetch_add(units, std::memory_order_relaxed) + units;
+	if (m_callback) {
+		m_callback(this, done, total(), m_userdata);
+	}
+}
+
+/**
+ * Worker thread function.
+ */
+void NitroOperation::threadFunc(void)
+{
+	int ret;
+	{
+		NitroTraceSpan span(m_nitro->trace(), m_name);
+		ret = run();
+	}
+
+	if (ret < 0) {
+		// Cancelled or failed. Remove the NDS from reset
+		// so the unit is left in a usable state.
+		m_nitro->ndsReset(false);
+	}
+
+	m_result = ret;
+	m_finished.store(true, std::memory_order_release);
+}
+
+/** NitroUploadOperation **/
+
+/**
+ * Create an upload operation.
+ * @param nitro ISNitro object.
+ * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+ * @param address Destination address.
+ * @param data Data. (Must remain valid until the operation finishes.)
+ * @param len Length of data. (Must be a multiple of two bytes.)
+ * @param chunkSize Chunk size.
+ */
+NitroUploadOperation::NitroUploadOperation(ISNitro *nitro, uint8_t _slot, uint32_t address,
+	const uint8_t *data, uint32_t len, uint32_t chunkSize)
+	: NitroOperation(nitro, "NitroUploadOperation")
+	, m_slot(_slot)
+	, m_address(address)
+	, m_data(data)
+	, m_len(len)
+	, m_chunkSize(std::max(chunkSize & ~1U, 2U))
+{
+	assert(len % 2 == 0);
+	setTotal(len);
+}
+
+NitroUploadOperation::~NitroUploadOperation()
+{
+	cancel();
+	wait();
+}
+
+int NitroUploadOperation::run(void)
+{
+	for (uint32_t pos = 0; pos < m_len; ) {
+		if (isCancelled())
+			return LIBUSB_ERROR_INTERRUPTED;
+
+		const uint32_t curlen = std::min(m_len - pos, m_chunkSize);
+		int ret = m_nitro->writeEmulationMemory(m_slot, m_address + pos, &m_data[pos], curlen);
+		if (ret < 0)
+			return ret;
+
+		pos += curlen;
+		addProgress(curlen);
+	}
+	return 0;
+}
+
+/** NitroDumpOperation **/
+
+/**
+ * Create a dump operation.
+ * @param nitro ISNitro object.
+ * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+ * @param address Source address.
+ * @param data Data buffer. (Must remain valid until the operation finishes.)
+ * @param len Length of data. (Must be a multiple of two bytes.)
+ * @param chunkSize Chunk size.
+ */
+NitroDumpOperation::NitroDumpOperation(ISNitro *nitro, uint8_t _slot, uint32_t address,
+	uint8_t *data, uint32_t len, uint32_t chunkSize)
+	: NitroOperation(nitro, "NitroDumpOperation")
+	, m_slot(_slot)
+	, m_address(address)
+	, m_data(data)
+	, m_len(len)
+	, m_chunkSize(std::max(chunkSize & ~1U, 2U))
+{
+	assert(len % 2 == 0);
+	setTotal(len);
+}
+
+NitroDumpOperation::~NitroDumpOperation()
+{
+	cancel();
+	wait();
+}
+
+int NitroDumpOperation::run(void)
+{
+	for (uint32_t pos = 0; pos < m_len; ) {
+		if (isCancelled())
+			return LIBUSB_ERROR_INTERRUPTED;
+
+		const uint32_t curlen = std::min(m_len - pos, m_chunkSize);
+		int ret = m_nitro->readEmulationMemory(m_slot, m_address + pos, &m_data[pos], curlen);
+		if (ret < 0)
+			return ret;
+
+		pos += curlen;
+		addProgress(curlen);
+	}
+	return 0;
+}
+
+/** NitroDebuggerInstallOperation **/
+
+/**
+ * Create a debugger install operation.
+ * @param nitro ISNitro object.
+ * @param toFirmware If true, boot to NDS firmware instead of the game.
+ */
+NitroDebuggerInstallOperation::NitroDebuggerInstallOperation(ISNitro *nitro, bool toFirmware)
+	: NitroOperation(nitro, "NitroDebuggerInstallOperation")
+	, m_toFirmware(toFirmware)
+{
+	setTotal(1);
+}
+
+NitroDebuggerInstallOperation::~NitroDebuggerInstallOperation()
+{
+	cancel();
+	wait();
+}
+
+int NitroDebuggerInstallOperation::run(void)
+{
+	if (isCancelled())
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	int ret = m_nitro->installDebuggerROM(m_toFirmware);
+	if (ret < 0)
+		return ret;
+
+	addProgress(1);
+	return 0;
+}
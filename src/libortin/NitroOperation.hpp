@@ -0,0 +1,260 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroOperation.hpp: Long-running IS-NITRO operations.                   *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROOPERATION_HPP__
+#define __ORTIN_LIBORTIN_NITROOPERATION_HPP__
+
+#include <stdint.h>
+
+// C++ includes.
+#include <atomic>
+#include <thread>
+
+class ISNitro;
+
+/**
+ * Long-running IS-NITRO operation.
+ *
+ * The operation runs on a worker thread. Progress can be polled
+ * with done() and total(), or reported through a callback, which
+ * is called on the worker thread after each chunk.
+ *
+ * Cancellation is cooperative: the operation stops after the
+ * current chunk and returns LIBUSB_ERROR_INTERRUPTED.
+ * If the operation is cancelled or fails, the NDS is taken out
+ * of reset so the unit isn't left stuck.
+ *
+ * The ISNitro object must not be used by any other thread
+ * while the operation is running.
+ */
+class NitroOperation
+{
+	public:
+		/**
+		 * Progress callback.
+		 * Called on the worker thread.
+		 * @param op Operation.
+		 * @param done Units completed.
+		 * @param total Total units.
+		 * @param userdata User data.
+		 */
+		typedef void (*ProgressCallback)(NitroOperation *op, uint64_t done, uint64_t total, void *userdata);
+
+	protected:
+		/**
+		 * Create an operation.
+		 * @param nitro ISNitro object.
+		 * @param name Operation name, for tracing. (Must be a static string.)
+		 */
+		NitroOperation(ISNitro *nitro, const char *name);
+
+	public:
+		/**
+		 * Destroy the operation.
+		 * If it's still running, it will be cancelled.
+		 */
+		virtual ~NitroOperation();
+
+	private:
+		NitroOperation(const NitroOperation &);
+		NitroOperation &operator=(const NitroOperation&);
+
+	public:
+		/**
+		 * Set the progress callback.
+		 * Must be called before start().
+		 * @param callback Progress callback, or nullptr for none.
+		 * @param userdata User data.
+		 */
+		void setProgressCallback(ProgressCallback callback, void *userdata);
+
+		/**
+		 * Start the operation on a worker thread.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int start(void);
+
+		/**
+		 * Request cancellation.
+		 * This returns immediately; call wait() to wait for
+		 * the operation to stop.
+		 */
+		void cancel(void);
+
+		/**
+		 * Wait for the operation to finish.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		int wait(void);
+
+		/**
+		 * Has the operation finished?
+		 * @return True if finished.
+		 */
+		inline bool isFinished(void) const
+		{
+			return m_finished.load(std::memory_order_acquire);
+		}
+
+		/**
+		 * Get the number of units completed.
+		 * @return Units completed.
+		 */
+		inline uint64_t done(void) const
+		{
+			return m_done.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Get the total number of units.
+		 * @return Total units.
+		 */
+		inline uint64_t total(void) const
+		{
+			return m_total.load(std::memory_order_relaxed);
+		}
+
+	protected:
+		/**
+		 * Run the operation.
+		 * Called on the worker thread.
+		 * @return 0 on success; libusb error code on error.
+		 */
+		virtual int run(void) = 0;
+
+		/**
+		 * Has cancellation been requested?
+		 * @return True if cancellation was requested.
+		 */
+		inline bool isCancelled(void) const
+		{
+			return m_cancel.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Set the total number of units.
+		 * @param total Total units.
+		 */
+		inline void setTotal(uint64_t total)
+		{
+			m_total.store(total, std::memory_order_relaxed);
+		}
+
+		/**
+		 * Add completed units and report progress.
+		 * @param units Units completed.
+		 */
+		void addProgress(uint64_t units);
+
+	private:
+		/**
+		 * Worker thread function.
+		 */
+		void threadFunc(void);
+
+	protected:
+		ISNitro *const m_nitro;
+
+	private:
+		const char *const m_name;
+		ProgressCallback m_callback;
+		void *m_userdata;
+
+		std::thread m_thread;
+		std::atomic<uint64_t> m_done;
+		std::atomic<uint64_t> m_total;
+		std::atomic<bool> m_cancel;
+		std::atomic<bool> m_finished;
+		int m_result;
+};
+
+/**
+ * Upload a buffer to EMULATOR memory.
+ * Progress units are bytes.
+ */
+class NitroUploadOperation : public NitroOperation
+{
+	public:
+		/**
+		 * Create an upload operation.
+		 * @param nitro ISNitro object.
+		 * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+		 * @param address Destination address.
+		 * @param data Data. (Must remain valid until the operation finishes.)
+		 * @param len Length of data. (Must be a multiple of two bytes.)
+		 * @param chunkSize Chunk size.
+		 */
+		NitroUploadOperation(ISNitro *nitro, uint8_t _slot, uint32_t address,
+			const uint8_t *data, uint32_t len, uint32_t chunkSize = 1048576U);
+		~NitroUploadOperation() final;
+
+	protected:
+		int run(void) final;
+
+	private:
+		const uint8_t m_slot;
+		const uint32_t m_address;
+		const uint8_t *const m_data;
+		const uint32_t m_len;
+		const uint32_t m_chunkSize;
+};
+
+/**
+ * Dump EMULATOR memory to a buffer.
+ * Progress units are bytes.
+ */
+class NitroDumpOperation : public NitroOperation
+{
+	public:
+		/**
+		 * Create a dump operation.
+		 * @param nitro ISNitro object.
+		 * @param _slot Emulated slot number. (1 for DS, 2 for GBA)
+		 * @param address Source address.
+		 * @param data Data buffer. (Must remain valid until the operation finishes.)
+		 * @param len Length of data. (Must be a multiple of two bytes.)
+		 * @param chunkSize Chunk size.
+		 */
+		NitroDumpOperation(ISNitro *nitro, uint8_t _slot, uint32_t address,
+			uint8_t *data, uint32_t len, uint32_t chunkSize = 1048576U);
+		~NitroDumpOperation() final;
+
+	protected:
+		int run(void) final;
+
+	private:
+		const uint8_t m_slot;
+		const uint32_t m_address;
+		uint8_t *const m_data;
+		const uint32_t m_len;
+		const uint32_t m_chunkSize;
+};
+
+/**
+ * Install the debugger ROM.
+ * This is a single step and cannot be cancelled once started.
+ */
+class NitroDebuggerInstallOperation : public NitroOperation
+{
+	public:
+		/**
+		 * Create a debugger install operation.
+		 * @param nitro ISNitro object.
+		 * @param toFirmware If true, boot to NDS firmware instead of the game.
+		 */
+		explicit NitroDebuggerInstallOperation(ISNitro *nitro, bool toFirmware = false);
+		~NitroDebuggerInstallOperation() final;
+
+	protected:
+		int run(void) final;
+
+	private:
+		const bool m_toFirmware;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROOPERATION_HPP__ */
@@ -0,0 +1,169 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroQueue.cpp: Thread-safe IS-NITRO command submission queue.          *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroQueue.hpp"
+#include "ISNitro.hpp"
+
+// libusb
+#include <libusb.h>
+
+/**
+ * Start the USB thread.
+ * @param nitro ISNitro object. (Must not be used directly while the queue exists.)
+ */
+NitroQueue::NitroQueue(ISNitro *nitro)
+	: m_nitro(nitro)
+	, m_head(&m_stub)
+	, m_tail(&m_stub)
+	, m_sleeping(false)
+	, m_stop(false)
+	, m_submitting(0)
+{
+	m_stub.next.store(nullptr, std::memory_order_relaxed);
+	m_thread = std::thread(&NitroQueue::threadFunc, this);
+}
+
+/**
+ * Stop the USB thread.
+ * Operations that were already submitted are run first.
+ * Operations submitted after this point fail with LIBUSB_ERROR_NO_DEVICE.
+ */
+NitroQueue::~NitroQueue()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop.store(true);
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+/**
+ * Push a node. (producer)
+ * @param node Node.
+ */
+void NitroQueue::push(Node *node)
+{
+	node->next.store(nullptr, std::memory_order_relaxed);
+	Node *const prev = m_head.exchange(node);
+	// NOTE: The consumer can't see this node until prev->next is set.
+	prev->next.store(node, std::memory_order_release);
+}
+
+/**
+ * Pop a node. (consumer)
+ * @return Node, or nullptr if the queue is empty.
+ */
+NitroQueue::Node *NitroQueue::pop(void)
+{
+	Node *tail = m_tail;
+	Node *next = tail->next.load(std::memory_order_acquire);
+	if (tail == &m_stub) {
+		if (!next)
+			return nullptr;
+		// Skip the stub node.
+		m_tail = next;
+		tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+
+	if (next) {
+		m_tail = next;
+		return tail;
+	}
+
+	if (tail != m_head.load(std::memory_order_acquire)) {
+		// A producer is in the middle of push().
+		// Try again later.
+		return nullptr;
+	}
+
+	// Last node: Re-insert the stub so the node can be removed.
+	push(&m_stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if (next) {
+		m_tail = next;
+		return tail;
+	}
+	return nullptr;
+}
+
+/**
+ * Submit an operation.
+ * Can be called from any thread.
+ * @param op Operation.
+ * @return Future for the operation's result. (LIBUSB_ERROR_NO_DEVICE if the queue is stopping)
+ */
+std::future<int> NitroQueue::submit(Operation op)
+{
+	// NOTE: m_submitting is incremented before checking m_stop,
+	// so the USB thread can't exit between the check and push().
+	m_submitting++;
+	if (m_stop.load()) {
+		m_submitting--;
+		std::promise<int> promise;
+		promise.set_value(LIBUSB_ERROR_NO_DEVICE);
+		return promise.get_future();
+	}
+
+	Node *const node = new Node;
+	node->op = std::move(op);
+	std::future<int> future = node->promise.get_future();
+	push(node);
+
+	// Wake up the USB thread if it's sleeping.
+	if (m_sleeping.load()) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cond.notify_one();
+	}
+	m_submitting--;
+	return future;
+}
+
+/**
+ * USB thread function.
+ */
+void NitroQueue::threadFunc(void)
+{
+	while (true) {
+		Node *const node = pop();
+		if (node) {
+			try {
+				node->promise.set_value(node->op(m_nitro));
+			} catch (...) {
+				// Rethrown by the future's get().
+				node->promise.set_exception(std::current_exception());
+			}
+			delete node;
+			continue;
+		}
+
+		if (m_head.load() != m_tail || m_tail->next.load() != nullptr) {
+			// A push is in progress.
+			std::this_thread::yield();
+			continue;
+		}
+
+		// Queue is empty.
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_stop.load()) {
+			// Don't exit while a submit() may still push a node.
+			if (m_submitting.load() == 0 && m_head.load() == m_tail && m_tail->next.load() == nullptr)
+				break;
+			lock.unlock();
+			std::this_thread::yield();
+			continue;
+		}
+		m_sleeping.store(true);
+		// Check again in case a producer pushed before seeing m_sleeping.
+		if (m_head.load() == m_tail && m_tail->next.load() == nullptr) {
+			m_cond.wait(lock);
+		}
+		m_sleeping.store(false);
+	}
+}
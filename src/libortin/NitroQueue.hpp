@@ -0,0 +1,139 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroQueue.hpp: Thread-safe IS-NITRO command submission queue.          *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROQUEUE_HPP__
+#define __ORTIN_LIBORTIN_NITROQUEUE_HPP__
+
+#include <stdint.h>
+
+// C++ includes.
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+class ISNitro;
+
+/**
+ * Thread-safe access to an IS-NITRO unit.
+ *
+ * ISNitro itself is not thread-safe. NitroQueue owns a USB thread
+ * that is the only thread allowed to use the ISNitro object; other
+ * threads submit operations to a lock-free multi-producer,
+ * single-consumer queue.
+ *
+ * Each operation runs to completion before the next one starts,
+ * so multi-command sequences that depend on device state, e.g.
+ * NITRO_CMD_SET_CPU followed by a command for that CPU, are atomic
+ * with respect to other submitters. Wrap the entire sequence in
+ * one operation:
+ *
+ *   queue.call([](ISNitro *n) {
+ *       int ret = n->breakProcessor(NITRO_CPU_ARM9);
+ *       ...
+ *       return ret;
+ *   });
+ */
+class NitroQueue
+{
+	public:
+		typedef std::function<int(ISNitro*)> Operation;
+
+		/**
+		 * Start the USB thread.
+		 * @param nitro ISNitro object. (Must not be used directly while the queue exists.)
+		 */
+		explicit NitroQueue(ISNitro *nitro);
+
+		/**
+		 * Stop the USB thread.
+		 * Operations that were already submitted are run first.
+		 * Operations submitted after this point fail with LIBUSB_ERROR_NO_DEVICE.
+		 */
+		~NitroQueue();
+
+	private:
+		NitroQueue(const NitroQueue &);
+		NitroQueue &operator=(const NitroQueue&);
+
+	public:
+		/**
+		 * Submit an operation.
+		 * Can be called from any thread.
+		 * If the operation throws an exception, the future's get() rethrows it.
+		 * @param op Operation.
+		 * @return Future for the operation's result. (LIBUSB_ERROR_NO_DEVICE if the queue is stopping)
+		 */
+		std::future<int> submit(Operation op);
+
+		/**
+		 * Submit an operation and wait for it to finish.
+		 * Must not be called from an operation. (This would deadlock.)
+		 * @param op Operation.
+		 * @return Operation's result.
+		 */
+		inline int call(Operation op)
+		{
+			return submit(std::move(op)).get();
+		}
+
+		/**
+		 * Is the current thread the USB thread?
+		 * @return True if called from an operation.
+		 */
+		inline bool isUSBThread(void) const
+		{
+			return (std::this_thread::get_id() == m_thread.get_id());
+		}
+
+	private:
+		struct Node {
+			std::atomic<Node*> next;
+			Operation op;
+			std::promise<int> promise;
+		};
+
+		/**
+		 * Push a node. (producer)
+		 * @param node Node.
+		 */
+		void push(Node *node);
+
+		/**
+		 * Pop a node. (consumer)
+		 * @return Node, or nullptr if the queue is empty.
+		 */
+		Node *pop(void);
+
+		/**
+		 * USB thread function.
+		 */
+		void threadFunc(void);
+
+	private:
+		ISNitro *const m_nitro;
+
+		// Intrusive MPSC queue. (Vyukov)
+		// Producers exchange m_head; the consumer owns m_tail.
+		std::atomic<Node*> m_head;
+		Node *m_tail;
+		Node m_stub;
+
+		// Used only to sleep when the queue is empty.
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::atomic<bool> m_sleeping;
+		std::atomic<bool> m_stop;
+		std::atomic<unsigned int> m_submitting;	// submit() calls in progress
+
+		std::thread m_thread;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROQUEUE_HPP__ */
@@ -0,0 +1,192 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroTrace.cpp: USB command tracing.                                    *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "NitroTrace.hpp"
+#include "nitro-usb-cmds.h"
+
+// C includes. (C++ namespace)
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+
+// C++ includes.
+#include <chrono>
+
+/**
+ * Create a trace buffer.
+ * @param capacity Maximum number of events.
+ */
+NitroTrace::NitroTrace(unsigned int capacity)
+	: m_events(new Event[capacity > 0 ? capacity : 1])
+	, m_capacity(capacity > 0 ? capacity : 1)
+	, m_head(0)
+	, m_epoch(now())
+{
+	for (unsigned int i = 0; i < m_capacity; i++) {
+		m_events[i].seq.store(0, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Get the current timestamp.
+ * @return Timestamp, in microseconds since an arbitrary epoch.
+ */
+uint64_t NitroTrace::now(void)
+{
+	using namespace std::chrono;
+	return (uint64_t)duration_cast<microseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Record a USB command.
+ * @param cmd		[in] Command. (See NitroCommand_e.)
+ * @param op		[in] Opcode. (See NitroOpcode_e.)
+ * @param _slot		[in] Slot number for EMULATOR memory.
+ * @param address	[in] Address.
+ * @param length	[in] Data length.
+ * @param ts		[in] Start timestamp, from now().
+ * @param result	[in] libusb result.
+ */
+void NitroTrace::recordCommand(uint16_t cmd, uint8_t op, uint8_t _slot,
+	uint32_t address, uint32_t length, uint64_t ts, int result)
+{
+	const uint64_t end = now();
+	uint64_t seq;
+	Event *const ev = alloc(seq);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	ev->type = EVENT_COMMAND;
+	ev->ts = ts;
+	ev->dur = end - ts;
+	ev->name = nullptr;
+	ev->cmd = cmd;
+	ev->op = op;
+	ev->_slot = _slot;
+	ev->address = address;
+	ev->length = length;
+	ev->result = result;
+	ev->seq.store(seq + 1, std::memory_order_release);
+}
+
+/**
+ * Record a span.
+ * @param name	[in] Span name. (Must be a static string.)
+ * @param ts	[in] Start timestamp, from now().
+ */
+void NitroTrace::recordSpan(const char *name, uint64_t ts)
+{
+	const uint64_t end = now();
+	uint64_t seq;
+	Event *const ev = alloc(seq);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	ev->type = EVENT_SPAN;
+	ev->ts = ts;
+	ev->dur = end - ts;
+	ev->name = name;
+	ev->cmd = 0;
+	ev->op = 0;
+	ev->_slot = 0;
+	ev->address = 0;
+	ev->length = 0;
+	ev->result = 0;
+	ev->seq.store(seq + 1, std::memory_order_release);
+}
+
+/**
+ * Get a command name for tracing.
+ * @param cmd Command.
+ * @return Command name, or nullptr if unknown.
+ */
+static const char *commandName(uint16_t cmd)
+{
+	switch (cmd) {
+		case NITRO_CMD_EMULATOR_MEMORY:	return "EMULATOR_MEMORY";
+		case NITRO_CMD_NEC_MEMORY:	return "NEC_MEMORY";
+		case NITRO_CMD_FULL_RESET:	return "FULL_RESET";
+		case NITRO_CMD_NDS_RESET:	return "NDS_RESET";
+		case NITRO_CMD_SET_CPU:		return "SET_CPU";
+		case NITRO_CMD_SET_FIQ_PIN:	return "SET_FIQ_PIN";
+		case NITRO_CMD_SLOT_POWER:	return "SLOT_POWER";
+		case NITRO_CMD_SET_BREAKPOINTS:	return "SET_BREAKPOINTS";
+		default:			break;
+	}
+	return nullptr;
+}
+
+/**
+ * Export the trace as Chrome trace event JSON.
+ * This can be loaded in chrome://tracing or Perfetto.
+ * @param filename Output filename.
+ * @return 0 on success; negative POSIX error code on error.
+ */
+int NitroTrace::exportChromeTrace(const char *filename) const
+{
+	errno = 0;
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		int err = errno;
+		return (err != 0 ? -err : -EIO);
+	}
+
+	// Spans are on tid 1; USB commands are on tid 2.
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"Operations\"}},\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"USB\"}}", f);
+
+	const uint64_t head = m_head.load(std::memory_order_acquire);
+	const uint64_t first = (head > m_capacity ? head - m_capacity : 0);
+	for (uint64_t seq = first; seq < head; seq++) {
+		const Event &src = m_events[seq % m_capacity];
+
+		// Copy the event and make sure it wasn't overwritten while copying.
+		const uint64_t seq1 = src.seq.load(std::memory_order_acquire);
+		if (seq1 != seq + 1)
+			continue;
+		const uint64_t ts = src.ts - m_epoch;
+		const uint64_t dur = src.dur;
+		const char *const name = src.name;
+		const uint32_t address = src.address;
+		const uint32_t length = src.length;
+		const int32_t result = src.result;
+		const uint16_t cmd = src.cmd;
+		const uint8_t op = src.op;
+		const uint8_t _slot = src._slot;
+		const uint8_t type = src.type;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (src.seq.load(std::memory_order_relaxed) != seq1)
+			continue;
+
+		if (type == EVENT_SPAN) {
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"op\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+				"\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}",
+				name, ts, dur);
+			continue;
+		}
+
+		const char *const cmdName = commandName(cmd);
+		const char *const opName = (op == NITRO_OP_READ ? "READ" : "WRITE");
+		if (cmdName) {
+			fprintf(f, ",\n{\"name\":\"%s %s\"", cmdName, opName);
+		} else {
+			fprintf(f, ",\n{\"name\":\"cmd%u %s\"", cmd, opName);
+		}
+		fprintf(f, ",\"cat\":\"usb\",\"ph\":\"X\",\"pid\":1,\"tid\":2,"
+			"\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"args\":{"
+			"\"cmd\":%u,\"op\":%u,\"slot\":%u,\"address\":\"0x%08X\",\"length\":%u,\"result\":%d}}",
+			ts, dur, cmd, op, _slot, address, length, result);
+	}
+
+	fprintf(f, "\n],\"otherData\":{\"dropped\":%" PRIu64 "}}\n", first);
+	if (fclose(f) != 0) {
+		int err = errno;
+		return (err != 0 ? -err : -EIO);
+	}
+	return 0;
+}
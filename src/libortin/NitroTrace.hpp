@@ -0,0 +1,146 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * NitroTrace.hpp: USB command tracing.                                    *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_NITROTRACE_HPP__
+#define __ORTIN_LIBORTIN_NITROTRACE_HPP__
+
+#include <stdint.h>
+
+// C++ includes.
+#include <atomic>
+#include <memory>
+
+/**
+ * Trace buffer for IS-NITRO USB commands and higher-level spans.
+ *
+ * Events are stored in a fixed-size ring buffer. Recording is
+ * lock-free and can be done from multiple threads; if the buffer
+ * fills up, the oldest events are overwritten.
+ *
+ * Tracing is disabled by not attaching a NitroTrace to the ISNitro
+ * object, in which case the only overhead is a NULL pointer check.
+ */
+class NitroTrace
+{
+	public:
+		/**
+		 * Create a trace buffer.
+		 * @param capacity Maximum number of events.
+		 */
+		explicit NitroTrace(unsigned int capacity = 65536);
+
+	private:
+		NitroTrace(const NitroTrace &);
+		NitroTrace &operator=(const NitroTrace&);
+
+	public:
+		/**
+		 * Get the current timestamp.
+		 * @return Timestamp, in microseconds since an arbitrary epoch.
+		 */
+		static uint64_t now(void);
+
+		/**
+		 * Record a USB command.
+		 * @param cmd		[in] Command. (See NitroCommand_e.)
+		 * @param op		[in] Opcode. (See NitroOpcode_e.)
+		 * @param _slot		[in] Slot number for EMULATOR memory.
+		 * @param address	[in] Address.
+		 * @param length	[in] Data length.
+		 * @param ts		[in] Start timestamp, from now().
+		 * @param result	[in] libusb result.
+		 */
+		void recordCommand(uint16_t cmd, uint8_t op, uint8_t _slot,
+			uint32_t address, uint32_t length, uint64_t ts, int result);
+
+		/**
+		 * Record a span.
+		 * @param name	[in] Span name. (Must be a static string.)
+		 * @param ts	[in] Start timestamp, from now().
+		 */
+		void recordSpan(const char *name, uint64_t ts);
+
+		/**
+		 * Export the trace as Chrome trace event JSON.
+		 * This can be loaded in chrome://tracing or Perfetto.
+		 * @param filename Output filename.
+		 * @return 0 on success; negative POSIX error code on error.
+		 */
+		int exportChromeTrace(const char *filename) const;
+
+	private:
+		enum EventType : uint8_t {
+			EVENT_COMMAND,
+			EVENT_SPAN,
+		};
+
+		struct Event {
+			std::atomic<uint64_t> seq;	// Sequence number + 1; 0 if unused
+			uint64_t ts;		// Start timestamp
+			uint64_t dur;		// Duration
+			const char *name;	// Span name
+			uint32_t address;
+			uint32_t length;
+			int32_t result;
+			uint16_t cmd;
+			uint8_t op;
+			uint8_t _slot;
+			uint8_t type;		// See EventType
+		};
+
+		/**
+		 * Allocate an event slot.
+		 * @param seq [out] Sequence number.
+		 * @return Event.
+		 */
+		inline Event *alloc(uint64_t &seq)
+		{
+			seq = m_head.fetch_add(1, std::memory_order_relaxed);
+			Event *const ev = &m_events[seq % m_capacity];
+			// Mark the slot as being written.
+			ev->seq.store(0, std::memory_order_relaxed);
+			return ev;
+		}
+
+		std::unique_ptr<Event[]> m_events;
+		const unsigned int m_capacity;
+		std::atomic<uint64_t> m_head;
+		uint64_t m_epoch;
+};
+
+/**
+ * RAII span for NitroTrace.
+ * Does nothing if trace is nullptr.
+ */
+class NitroTraceSpan
+{
+	public:
+		NitroTraceSpan(NitroTrace *trace, const char *name)
+			: m_trace(trace)
+			, m_name(name)
+			, m_ts(trace ? NitroTrace::now() : 0)
+		{ }
+
+		~NitroTraceSpan()
+		{
+			if (m_trace) {
+				m_trace->recordSpan(m_name, m_ts);
+			}
+		}
+
+	private:
+		NitroTraceSpan(const NitroTraceSpan &);
+		NitroTraceSpan &operator=(const NitroTraceSpan&);
+
+	private:
+		NitroTrace *const m_trace;
+		const char *const m_name;
+		const uint64_t m_ts;
+};
+
+#endif /* __ORTIN_LIBORTIN_NITROTRACE_HPP__ */
@@ -0,0 +1,506 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * RomIndex.cpp: Memory-mapped ROM catalog.                                *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "RomIndex.hpp"
+
+#include "byteswap.h"
+#include "xxh64.h"
+
+// C includes.
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+# include <windows.h>
+#else /* !_WIN32 */
+# include <dirent.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif /* _WIN32 */
+
+// C includes. (C++ namespace)
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// C++ includes.
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+RomIndex::RomIndex()
+	: m_data(nullptr)
+	, m_size(0)
+	, m_entries(nullptr)
+	, m_count(0)
+	, m_strtab(nullptr)
+	, m_strtab_size(0)
+{ }
+
+RomIndex::~RomIndex()
+{
+	close();
+}
+
+/**
+ * Open a ROM index file.
+ * The file is memory-mapped; entries can be used directly.
+ * @param filename ROM index filename.
+ * @return 0 on success; negative POSIX error code on error.
+ */
+int RomIndex::open(const char *filename)
+{
+	close();
+
+#ifdef _WIN32
+	// TODO: Unicode filenames.
+	HANDLE hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return -ENOENT;
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(hFile, &liSize) || liSize.QuadPart < (LONGLONG)sizeof(RomIndexHeader)) {
+		CloseHandle(hFile);
+		return -EIO;
+	}
+	HANDLE hMap = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(hFile);
+	if (!hMap)
+		return -EIO;
+	void *const pMap = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMap);
+	if (!pMap)
+		return -ENOMEM;
+	const size_t size = (size_t)liSize.QuadPart;
+#else /* !_WIN32 */
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	struct stat sb;
+	if (fstat(fd, &sb) != 0) {
+		int err = errno;
+		::close(fd);
+		return -err;
+	}
+	if (sb.st_size < (off_t)sizeof(RomIndexHeader)) {
+		::close(fd);
+		return -EIO;
+	}
+
+	const size_t size = (size_t)sb.st_size;
+	void *const pMap = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (pMap == MAP_FAILED)
+		return -errno;
+#endif /* _WIN32 */
+
+	m_data = static_cast<const uint8_t*>(pMap);
+	m_size = size;
+
+	// Validate the header.
+	const RomIndexHeader *const pHdr = reinterpret_cast<const RomIndexHeader*>(m_data);
+	const uint32_t entry_count = le32_to_cpu(pHdr->entry_count);
+	const uint32_t strtab_offset = le32_to_cpu(pHdr->strtab_offset);
+	const uint32_t strtab_size = le32_to_cpu(pHdr->strtab_size);
+	if (memcmp(pHdr->magic, ROMINDEX_MAGIC, sizeof(pHdr->magic)) != 0 ||
+	    le32_to_cpu(pHdr->version) != ROMINDEX_VERSION ||
+	    le32_to_cpu(pHdr->entry_size) != sizeof(RomIndexEntry) ||
+	    (uint64_t)sizeof(RomIndexHeader) + ((uint64_t)entry_count * sizeof(RomIndexEntry)) > strtab_offset ||
+	    (uint64_t)strtab_offset + strtab_size > size)
+	{
+		// Not a valid ROM index.
+		close();
+		return -EINVAL;
+	}
+
+	// The string table must be NULL-terminated so path()
+	// can't read past the end of the mapping.
+	if (strtab_size == 0 || m_data[strtab_offset + strtab_size - 1] != '\0') {
+		close();
+		return -EINVAL;
+	}
+
+	m_entries = reinterpret_cast<const RomIndexEntry*>(m_data + sizeof(RomIndexHeader));
+	m_count = entry_count;
+	m_strtab = reinterpret_cast<const char*>(m_data + strtab_offset);
+	m_strtab_size = strtab_size;
+	return 0;
+}
+
+/**
+ * Close the ROM index file.
+ */
+void RomIndex::close(void)
+{
+	if (m_data) {
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+#else /* !_WIN32 */
+		munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif /* _WIN32 */
+	}
+
+	m_data = nullptr;
+	m_size = 0;
+	m_entries = nullptr;
+	m_count = 0;
+	m_strtab = nullptr;
+	m_strtab_size = 0;
+}
+
+/**
+ * Get a ROM index entry.
+ * @param idx Entry index.
+ * @return Entry, or nullptr if out of range.
+ */
+const RomIndexEntry *RomIndex::entry(unsigned int idx) const
+{
+	if (idx >= m_count)
+		return nullptr;
+	return &m_entries[idx];
+}
+
+/**
+ * Get the filename of a ROM index entry.
+ * @param entry Entry.
+ * @return Filename. (Empty string if invalid.)
+ */
+const char *RomIndex::path(const RomIndexEntry *entry) const
+{
+	const uint32_t offset = le32_to_cpu(entry->path_offset);
+	if (offset >= m_strtab_size)
+		return "";
+	// String table is NULL-terminated. (checked by open())
+	return &m_strtab[offset];
+}
+
+/**
+ * Find a ROM by game code.
+ * @param gamecode Game code. (4 characters; not NULL-terminated)
+ * @param rom_version ROM version, or -1 for the highest version.
+ * @return Entry, or nullptr if not found.
+ */
+const RomIndexEntry *RomIndex::find(const char *gamecode, int rom_version) const
+{
+	// Entries are sorted by gamecode, then ROM version.
+	// Find the last entry with a matching gamecode.
+	const RomIndexEntry *const pEnd = m_entries + m_count;
+	const RomIndexEntry *const pUpper = std::upper_bound(m_entries, pEnd, gamecode,
+		[](const char *gc, const RomIndexEntry &e) {
+			return memcmp(gc, e.gamecode, sizeof(e.gamecode)) < 0;
+		});
+
+	for (const RomIndexEntry *p = pUpper; p != m_entries; ) {
+		--p;
+		if (memcmp(p->gamecode, gamecode, sizeof(p->gamecode)) != 0)
+			break;
+		if (rom_version < 0 || p->rom_version == rom_version)
+			return p;
+	}
+
+	// Not found.
+	return nullptr;
+}
+
+/** Index building **/
+
+struct RomIndexFile {
+	string path;
+	RomIndexEntry entry;
+};
+
+/**
+ * Check if a filename has a Nintendo DS ROM extension.
+ * @param filename Filename.
+ * @return True if it does; false if not.
+ */
+static bool isNdsFilename(const char *filename)
+{
+	const char *const ext = strrchr(filename, '.');
+	if (!ext)
+		return false;
+	return !strcasecmp(ext, ".nds") || !strcasecmp(ext, ".srl");
+}
+
+#ifndef _WIN32
+/**
+ * Recursively scan a directory for ROM images.
+ * @param dir		[in] Directory.
+ * @param files		[out] Filenames.
+ * @param depth		[in] Recursion depth.
+ */
+static void scanDirectory(const string &dir, vector<string> &files, int depth = 0)
+{
+	// Prevent runaway recursion due to symlink loops.
+	if (depth > 32)
+		return;
+
+	DIR *const pDir = opendir(dir.c_str());
+	if (!pDir)
+		return;
+
+	struct dirent *d;
+	while ((d = readdir(pDir)) != nullptr) {
+		if (d->d_name[0] == '.') {
+			// Skip ".", "..", and hidden files.
+			continue;
+		}
+
+		string path = dir;
+		path += '/';
+		path += d->d_name;
+
+		struct stat sb;
+		if (stat(path.c_str(), &sb) != 0)
+			continue;
+		if (S_ISDIR(sb.st_mode)) {
+			scanDirectory(path, files, depth + 1);
+		} else if (S_ISREG(sb.st_mode) && isNdsFilename(d->d_name)) {
+			files.push_back(std::move(path));
+		}
+	}
+	closedir(pDir);
+}
+#endif /* !_WIN32 */
+
+/**
+ * Parse and hash a ROM image.
+ * @param path		[in] Filename.
+ * @param entry		[out] Entry. (Everything except path_offset, file_size, and mtime.)
+ * @return 0 on success; negative POSIX error code on error.
+ */
+static int parseRomImage(const char *path, RomIndexEntry *entry)
+{
+	errno = 0;
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		int err = errno;
+		return (err != 0 ? -err : -EIO);
+	}
+
+	static const size_t BUF_SIZE = 1048576U;
+	unique_ptr<uint8_t[]> buf(new uint8_t[BUF_SIZE]);
+
+	XXH64_State xxh;
+	xxh64_init(&xxh, 0);
+
+	bool first = true;
+	size_t size;
+	while ((size = fread(buf.get(), 1, BUF_SIZE, f)) > 0) {
+		if (first) {
+			if (size < 0x200) {
+				// Too small to be a Nintendo DS ROM image.
+				fclose(f);
+				return -EINVAL;
+			}
+
+			const uint8_t *const p = buf.get();
+			memcpy(entry->title, &p[0x000], sizeof(entry->title));
+			memcpy(entry->gamecode, &p[0x00C], sizeof(entry->gamecode));
+			memcpy(entry->maker, &p[0x010], sizeof(entry->maker));
+			entry->unit_code = p[0x012];
+			entry->rom_version = p[0x01E];
+			memcpy(&entry->used_size, &p[0x080], sizeof(entry->used_size));
+			memcpy(&entry->secure_crc16, &p[0x06C], sizeof(entry->secure_crc16));
+			memcpy(&entry->logo_crc16, &p[0x15C], sizeof(entry->logo_crc16));
+			memcpy(&entry->header_crc16, &p[0x15E], sizeof(entry->header_crc16));
+
+			// Check the Secure Area.
+			// Same check as ndscrypt_encrypt_secure_area().
+			uint32_t arm9_rom_offset;
+			memcpy(&arm9_rom_offset, &p[0x020], sizeof(arm9_rom_offset));
+			arm9_rom_offset = le32_to_cpu(arm9_rom_offset);
+			if (size < 0x8000) {
+				entry->crypto = ROMINDEX_CRYPTO_UNKNOWN;
+			} else if (arm9_rom_offset < 0x4000) {
+				entry->crypto = ROMINDEX_CRYPTO_NONE;
+			} else {
+				uint32_t sa[2];
+				memcpy(sa, &p[0x4000], sizeof(sa));
+				if (le32_to_cpu(sa[0]) == 0xE7FFDEFF && le32_to_cpu(sa[1]) == 0xE7FFDEFF) {
+					entry->crypto = ROMINDEX_CRYPTO_DECRYPTED;
+				} else {
+					entry->crypto = ROMINDEX_CRYPTO_ENCRYPTED;
+				}
+			}
+			first = false;
+		}
+
+		xxh64_update(&xxh, buf.get(), size);
+	}
+
+	int err = ferror(f) ? EIO : 0;
+	fclose(f);
+	if (err != 0)
+		return -err;
+	if (first) {
+		// Empty file.
+		return -EINVAL;
+	}
+
+	entry->xxh64 = cpu_to_le64(xxh64_digest(&xxh));
+	return 0;
+}
+
+/**
+ * Create or update a ROM index file.
+ *
+ * Directories are scanned recursively for .nds and .srl files.
+ * Entries from an existing index are reused if the file's
+ * mtime and size haven't changed; everything else is parsed
+ * and hashed. The new index is written to a temporary file
+ * and renamed into place, so existing readers are unaffected.
+ *
+ * @param filename	[in] ROM index filename.
+ * @param dirs		[in] Directories to scan.
+ * @param dircount	[in] Number of directories.
+ * @param pStats	[out,opt] Update statistics.
+ * @return 0 on success; negative POSIX error code on error.
+ */
+int RomIndex::update(const char *filename, const char *const *dirs, int dircount, UpdateStats *pStats)
+{
+#ifdef _WIN32
+	// TODO: Directory scanning on Windows.
+	((void)filename);
+	((void)dirs);
+	((void)dircount);
+	((void)pStats);
+	return -ENOSYS;
+#else /* !_WIN32 */
+	UpdateStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	// Load the existing index, if present.
+	RomIndex oldIndex;
+	unordered_map<string, const RomIndexEntry*> oldEntries;
+	if (oldIndex.open(filename) == 0) {
+		oldEntries.reserve(oldIndex.count());
+		for (unsigned int i = 0; i < oldIndex.count(); i++) {
+			const RomIndexEntry *const e = oldIndex.entry(i);
+			oldEntries.emplace(oldIndex.path(e), e);
+		}
+	}
+
+	// Scan the directories.
+	vector<string> paths;
+	for (int i = 0; i < dircount; i++) {
+		char *const real = realpath(dirs[i], nullptr);
+		if (!real)
+			return -errno;
+		scanDirectory(real, paths);
+		free(real);
+	}
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	vector<RomIndexFile> files;
+	files.reserve(paths.size());
+	for (auto iter = paths.begin(); iter != paths.end(); ++iter) {
+		struct stat sb;
+		if (stat(iter->c_str(), &sb) != 0)
+			continue;
+		stats.scanned++;
+
+		RomIndexFile file;
+		file.path = std::move(*iter);
+
+		auto old = oldEntries.find(file.path);
+		if (old != oldEntries.end()) {
+			const RomIndexEntry *const e = old->second;
+			oldEntries.erase(old);
+			if (le64_to_cpu(e->file_size) == (uint64_t)sb.st_size &&
+			    (int64_t)le64_to_cpu(e->mtime) == (int64_t)sb.st_mtime)
+			{
+				// File is unchanged.
+				file.entry = *e;
+				files.push_back(std::move(file));
+				stats.reused++;
+				continue;
+			}
+		}
+
+		memset(&file.entry, 0, sizeof(file.entry));
+		if (parseRomImage(file.path.c_str(), &file.entry) != 0) {
+			// Not a valid ROM image.
+			continue;
+		}
+		file.entry.file_size = cpu_to_le64((uint64_t)sb.st_size);
+		file.entry.mtime = (int64_t)cpu_to_le64((uint64_t)sb.st_mtime);
+		files.push_back(std::move(file));
+		stats.hashed++;
+	}
+	// Anything left over from the old index no longer exists.
+	stats.removed = (unsigned int)oldEntries.size();
+	oldEntries.clear();
+	oldIndex.close();
+
+	// Sort by gamecode, then ROM version, then filename.
+	std::sort(files.begin(), files.end(), [](const RomIndexFile &a, const RomIndexFile &b) {
+		int cmp = memcmp(a.entry.gamecode, b.entry.gamecode, sizeof(a.entry.gamecode));
+		if (cmp != 0)
+			return (cmp < 0);
+		if (a.entry.rom_version != b.entry.rom_version)
+			return (a.entry.rom_version < b.entry.rom_version);
+		return (a.path < b.path);
+	});
+
+	// Build the string table.
+	string strtab;
+	for (auto iter = files.begin(); iter != files.end(); ++iter) {
+		iter->entry.path_offset = cpu_to_le32((uint32_t)strtab.size());
+		strtab.append(iter->path);
+		strtab += '\0';
+	}
+
+	RomIndexHeader hdr;
+	memcpy(hdr.magic, ROMINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(ROMINDEX_VERSION);
+	hdr.entry_count = cpu_to_le32((uint32_t)files.size());
+	hdr.entry_size = cpu_to_le32((uint32_t)sizeof(RomIndexEntry));
+	hdr.strtab_offset = cpu_to_le32((uint32_t)(sizeof(hdr) + (files.size() * sizeof(RomIndexEntry))));
+	hdr.strtab_size = cpu_to_le32((uint32_t)strtab.size());
+	hdr.reserved = 0;
+
+	// Write to a temporary file, then rename it.
+	const string tmpname = string(filename) + ".tmp";
+	errno = 0;
+	FILE *f = fopen(tmpname.c_str(), "wb");
+	if (!f) {
+		int err = errno;
+		return (err != 0 ? -err : -EIO);
+	}
+	bool ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+	for (auto iter = files.cbegin(); ok && iter != files.cend(); ++iter) {
+		ok = (fwrite(&iter->entry, sizeof(iter->entry), 1, f) == 1);
+	}
+	if (ok && !strtab.empty()) {
+		ok = (fwrite(strtab.data(), 1, strtab.size(), f) == strtab.size());
+	}
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok || rename(tmpname.c_str(), filename) != 0) {
+		int err = errno;
+		remove(tmpname.c_str());
+		return (err != 0 ? -err : -EIO);
+	}
+
+	if (pStats) {
+		*pStats = stats;
+	}
+	return 0;
+#endif /* _WIN32 */
+}
@@ -0,0 +1,163 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * RomIndex.hpp: Memory-mapped ROM catalog.                                *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_ROMINDEX_HPP__
+#define __ORTIN_LIBORTIN_ROMINDEX_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * ROM index file header.
+ * All fields are little-endian.
+ */
+typedef struct _RomIndexHeader {
+	char magic[8];		// "ORTINIDX"
+	uint32_t version;	// ROMINDEX_VERSION
+	uint32_t entry_count;	// Number of entries
+	uint32_t entry_size;	// sizeof(RomIndexEntry)
+	uint32_t strtab_offset;	// String table offset (from start of file)
+	uint32_t strtab_size;	// String table size
+	uint32_t reserved;
+} RomIndexHeader;
+static_assert(sizeof(RomIndexHeader) == 32, "RomIndexHeader is the wrong size");
+
+#define ROMINDEX_MAGIC "ORTINIDX"
+#define ROMINDEX_VERSION 1
+
+/**
+ * Secure Area encryption state.
+ */
+typedef enum {
+	ROMINDEX_CRYPTO_UNKNOWN		= 0,	// Too small to tell
+	ROMINDEX_CRYPTO_ENCRYPTED	= 1,	// Secure Area is encrypted
+	ROMINDEX_CRYPTO_DECRYPTED	= 2,	// Secure Area is decrypted
+	ROMINDEX_CRYPTO_NONE		= 3,	// No Secure Area (homebrew)
+} RomIndexCrypto_e;
+
+/**
+ * ROM index entry.
+ * Entries are sorted by gamecode, then ROM version.
+ * All fields are little-endian.
+ */
+typedef struct _RomIndexEntry {
+	char gamecode[4];	// [0x00C] Game code
+	uint8_t rom_version;	// [0x01E] ROM version
+	uint8_t unit_code;	// [0x012] Unit code
+	uint8_t crypto;		// Secure Area state (see RomIndexCrypto_e)
+	uint8_t reserved1;
+	uint32_t used_size;	// [0x080] Total used ROM size
+	uint32_t path_offset;	// Filename offset in the string table
+	uint64_t file_size;	// File size
+	int64_t mtime;		// File modification time
+	uint64_t xxh64;		// xxHash64 of the entire file
+	uint16_t header_crc16;	// [0x15E] Header CRC16
+	uint16_t secure_crc16;	// [0x06C] Secure Area CRC16
+	uint16_t logo_crc16;	// [0x15C] Logo CRC16
+	uint16_t reserved2;
+	char title[12];		// [0x000] Game title
+	char maker[2];		// [0x010] Maker code
+	uint8_t reserved3[2];
+} RomIndexEntry;
+static_assert(sizeof(RomIndexEntry) == 64, "RomIndexEntry is the wrong size");
+
+class RomIndex
+{
+	public:
+		RomIndex();
+		~RomIndex();
+
+	private:
+		RomIndex(const RomIndex &);
+		RomIndex &operator=(const RomIndex&);
+
+	public:
+		/**
+		 * Open a ROM index file.
+		 * The file is memory-mapped; entries can be used directly.
+		 * @param filename ROM index filename.
+		 * @return 0 on success; negative POSIX error code on error.
+		 */
+		int open(const char *filename);
+
+		/**
+		 * Close the ROM index file.
+		 */
+		void close(void);
+
+		inline bool isOpen(void) const
+		{
+			return (m_data != nullptr);
+		}
+
+		/**
+		 * Get the number of entries in the ROM index.
+		 * @return Number of entries.
+		 */
+		inline unsigned int count(void) const
+		{
+			return m_count;
+		}
+
+		/**
+		 * Get a ROM index entry.
+		 * @param idx Entry index.
+		 * @return Entry, or nullptr if out of range.
+		 */
+		const RomIndexEntry *entry(unsigned int idx) const;
+
+		/**
+		 * Get the filename of a ROM index entry.
+		 * @param entry Entry.
+		 * @return Filename. (Empty string if invalid.)
+		 */
+		const char *path(const RomIndexEntry *entry) const;
+
+		/**
+		 * Find a ROM by game code.
+		 * @param gamecode Game code. (4 characters; not NULL-terminated)
+		 * @param rom_version ROM version, or -1 for the highest version.
+		 * @return Entry, or nullptr if not found.
+		 */
+		const RomIndexEntry *find(const char *gamecode, int rom_version = -1) const;
+
+	public:
+		struct UpdateStats {
+			unsigned int scanned;	// Number of ROM images found
+			unsigned int reused;	// Number of entries reused (unchanged mtime/size)
+			unsigned int hashed;	// Number of ROM images parsed and hashed
+			unsigned int removed;	// Number of stale entries removed
+		};
+
+		/**
+		 * Create or update a ROM index file.
+		 *
+		 * Directories are scanned recursively for .nds and .srl files.
+		 * Entries from an existing index are reused if the file's
+		 * mtime and size haven't changed; everything else is parsed
+		 * and hashed. The new index is written to a temporary file
+		 * and renamed into place, so existing readers are unaffected.
+		 *
+		 * @param filename	[in] ROM index filename.
+		 * @param dirs		[in] Directories to scan.
+		 * @param dircount	[in] Number of directories.
+		 * @param pStats	[out,opt] Update statistics.
+		 * @return 0 on success; negative POSIX error code on error.
+		 */
+		static int update(const char *filename, const char *const *dirs, int dircount, UpdateStats *pStats = nullptr);
+
+	private:
+		const uint8_t *m_data;
+		size_t m_size;
+		const RomIndexEntry *m_entries;
+		unsigned int m_count;
+		const char *m_strtab;
+		uint32_t m_strtab_size;
+};
+
+#endif /* __ORTIN_LIBORTIN_ROMINDEX_HPP__ */
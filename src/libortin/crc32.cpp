@@ -0,0 +1,85 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * crc32.cpp: CRC32 implementation.                                        *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "crc32.hpp"
+#include "byteswap.h"
+
+// C includes. (C++ namespace)
+#include <cstring>
+
+namespace {
+
+/**
+ * Slicing-by-8 lookup tables.
+ * Initialized on first use.
+ */
+class Crc32Tables
+{
+	public:
+		Crc32Tables()
+		{
+			for (unsigned int i = 0; i < 256; i++) {
+				uint32_t crc = i;
+				for (unsigned int j = 0; j < 8; j++) {
+					crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320U : 0);
+				}
+				t[0][i] = crc;
+			}
+			for (unsigned int i = 0; i < 256; i++) {
+				for (unsigned int k = 1; k < 8; k++) {
+					t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+				}
+			}
+		}
+
+	public:
+		uint32_t t[8][256];
+};
+
+const Crc32Tables &tables(void)
+{
+	static const Crc32Tables crc32Tables;
+	return crc32Tables;
+}
+
+}
+
+/**
+ * Update a CRC32. (IEEE 802.3 polynomial, same as zlib)
+ *
+ * This uses slicing-by-8, which processes 8 bytes per
+ * iteration using eight lookup tables.
+ *
+ * @param crc Previous CRC32. (Use 0 for the first block.)
+ * @param data Data.
+ * @param len Length of data.
+ * @return Updated CRC32.
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint32_t (*const t)[256] = tables().t;
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint32_t one, two;
+		memcpy(&one, p, sizeof(one));
+		memcpy(&two, p+4, sizeof(two));
+		one = le32_to_cpu(one) ^ crc;
+		two = le32_to_cpu(two);
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^
+		      t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+		      t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^
+		      t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+	}
+	for (; len > 0; len--, p++) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+	}
+
+	return ~crc;
+}
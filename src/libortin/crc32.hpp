@@ -0,0 +1,36 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * crc32.hpp: CRC32 implementation.                                        *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_CRC32_HPP__
+#define __ORTIN_LIBORTIN_CRC32_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Update a CRC32. (IEEE 802.3 polynomial, same as zlib)
+ *
+ * This uses slicing-by-8, which processes 8 bytes per
+ * iteration using eight lookup tables.
+ *
+ * @param crc Previous CRC32. (Use 0 for the first block.)
+ * @param data Data.
+ * @param len Length of data.
+ * @return Updated CRC32.
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ORTIN_LIBORTIN_CRC32_HPP__ */
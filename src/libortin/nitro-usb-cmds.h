@@ -15,6 +15,19 @@
 extern "C" {
 #endif
 
+/**
+ * Compile-time structure size check.
+ * @param st Structure.
+ * @param sz Expected size.
+ */
+#ifndef ASSERT_STRUCT
+#  ifdef __cplusplus
+#    define ASSERT_STRUCT(st,sz) static_assert(sizeof(st)==(sz),#st " is the wrong size")
+#  else
+#    define ASSERT_STRUCT(st,sz) _Static_assert(sizeof(st)==(sz),#st " is the wrong size")
+#  endif
+#endif
+
 /**
  * USB commands.
  * All fields are little-endian.
@@ -27,7 +40,7 @@ typedef struct _NitroUSBCmd {
 	uint32_t length;	// Data length
 	uint32_t zero;		// Zero
 } NitroUSBCmd;
-//ASSERT_STRUCT(NitroUSBCmd, 16);
+ASSERT_STRUCT(NitroUSBCmd, 16);
 
 /**
  * Nitro USB commands: Opcodes.
@@ -44,10 +57,14 @@ typedef enum {
 	NITRO_CMD_EMULATOR_MEMORY	= 0x00,
 	NITRO_CMD_NEC_MEMORY		= 0x26,
 	NITRO_CMD_FULL_RESET		= 0x81,
+	NITRO_CMD_85			= 0x85,	// cmd133: Unknown; sent after continuing a CPU
+	NITRO_CMD_87			= 0x87,	// cmd135: Unknown; sent before continuing a CPU
 	NITRO_CMD_NDS_RESET		= 0x8A,
 	NITRO_CMD_SET_CPU		= 0x8B,	// Set current CPU for operations (0 == ARM9, 1 == ARM7)
+	NITRO_CMD_A0			= 0xA0,	// cmd160: Unknown; sent before breaking a CPU
 	NITRO_CMD_SET_FIQ_PIN		= 0xAA,	// Set FIQ pin state for the current CPU
 	NITRO_CMD_SLOT_POWER		= 0xAD,
+	NITRO_CMD_AE			= 0xAE,	// cmd174: Unknown; sent after initializing the debugger ROM
 	NITRO_CMD_SET_BREAKPOINTS	= 0xBD,	// Set breakpoints
 } NitroCommand_e;
 
@@ -110,6 +127,7 @@ typedef struct _NitroNECCommand {
 	uint16_t length;	// Data length
 	uint32_t address;	// Destination address
 } NitroNECCommand;
+ASSERT_STRUCT(NitroNECCommand, 8);
 
 /**
  * NEC registers.
@@ -161,7 +179,7 @@ typedef enum {
 } NitroNECNDSReg0_e;
 
 /**
- * NEC NDS register 0 bits.
+ * NEC NDS register 1 bits.
  */
 typedef enum {
 	NITRO_NEC_NDS_REG1_WRITE_PROTECTION	= (1U << 0),
@@ -176,6 +194,15 @@ typedef enum {
 	NITRO_CPU_ARM7	= 1,
 } NitroCPU_e;
 
+/**
+ * NITRO_CMD_SET_BREAKPOINTS: Actions.
+ * Payload: le32 command, le32 length of the following data, le32 action.
+ */
+typedef enum {
+	NITRO_BKPT_BREAK	= 8,	// Begin break
+	NITRO_BKPT_CONTINUE	= 9,	// Continue from break
+} NitroBreakpointAction_e;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,149 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * sha1.c: SHA-1 implementation.                                           *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "sha1.h"
+#include "byteswap.h"
+
+// C includes.
+#include <string.h>
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+/**
+ * Process 64-byte blocks.
+ * @param h Hash state.
+ * @param p Data.
+ * @param nblocks Number of blocks.
+ */
+static void sha1_blocks(uint32_t h[5], const uint8_t *p, size_t nblocks)
+{
+	for (; nblocks > 0; nblocks--, p += 64) {
+		uint32_t w[80];
+		unsigned int i;
+		for (i = 0; i < 16; i++) {
+			uint32_t v;
+			memcpy(&v, &p[i*4], sizeof(v));
+			w[i] = be32_to_cpu(v);
+		}
+		for (; i < 80; i++) {
+			w[i] = rotl32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			const uint32_t tmp = rotl32(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rotl32(b, 30);
+			b = a;
+			a = tmp;
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+}
+
+/**
+ * Initialize a SHA-1 state.
+ * @param state State.
+ */
+void sha1_init(SHA1_State *state)
+{
+	state->h[0] = 0x67452301;
+	state->h[1] = 0xEFCDAB89;
+	state->h[2] = 0x98BADCFE;
+	state->h[3] = 0x10325476;
+	state->h[4] = 0xC3D2E1F0;
+	state->total_len = 0;
+	state->blocksize = 0;
+}
+
+/**
+ * Add data to a SHA-1 state.
+ * @param state State.
+ * @param data Data.
+ * @param len Length of data.
+ */
+void sha1_update(SHA1_State *state, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	state->total_len += len;
+
+	if (state->blocksize > 0) {
+		// Fill the partial block first.
+		size_t fill = 64 - state->blocksize;
+		if (len < fill) {
+			memcpy(&state->block[state->blocksize], p, len);
+			state->blocksize += (uint32_t)len;
+			return;
+		}
+		memcpy(&state->block[state->blocksize], p, fill);
+		sha1_blocks(state->h, state->block, 1);
+		p += fill;
+		len -= fill;
+		state->blocksize = 0;
+	}
+
+	const size_t nblocks = len / 64;
+	sha1_blocks(state->h, p, nblocks);
+	p += nblocks * 64;
+	len -= nblocks * 64;
+	if (len > 0) {
+		memcpy(state->block, p, len);
+		state->blocksize = (uint32_t)len;
+	}
+}
+
+/**
+ * Finalize a SHA-1 state and get the digest.
+ * The state must be reinitialized before it can be used again.
+ * @param state State.
+ * @param digest Digest. (SHA1_DIGEST_SIZE bytes)
+ */
+void sha1_final(SHA1_State *state, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+	const uint64_t bitlen = state->total_len * 8;
+
+	// Padding: 0x80, zeroes, then the 64-bit big-endian bit length.
+	state->block[state->blocksize++] = 0x80;
+	if (state->blocksize > 56) {
+		memset(&state->block[state->blocksize], 0, 64 - state->blocksize);
+		sha1_blocks(state->h, state->block, 1);
+		state->blocksize = 0;
+	}
+	memset(&state->block[state->blocksize], 0, 56 - state->blocksize);
+	const uint64_t bitlen_be = cpu_to_be64(bitlen);
+	memcpy(&state->block[56], &bitlen_be, sizeof(bitlen_be));
+	sha1_blocks(state->h, state->block, 1);
+
+	for (unsigned int i = 0; i < 5; i++) {
+		const uint32_t v = cpu_to_be32(state->h[i]);
+		memcpy(&digest[i*4], &v, sizeof(v));
+	}
+}
@@ -0,0 +1,57 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * sha1.h: SHA-1 implementation.                                           *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_SHA1_H__
+#define __ORTIN_LIBORTIN_SHA1_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHA1_DIGEST_SIZE 20
+
+/**
+ * SHA-1 streaming state.
+ */
+typedef struct _SHA1_State {
+	uint32_t h[5];		// Hash state
+	uint64_t total_len;	// Total number of bytes hashed
+	uint8_t block[64];	// Buffered input (less than one block)
+	uint32_t blocksize;	// Number of bytes in block[]
+} SHA1_State;
+
+/**
+ * Initialize a SHA-1 state.
+ * @param state State.
+ */
+void sha1_init(SHA1_State *state);
+
+/**
+ * Add data to a SHA-1 state.
+ * @param state State.
+ * @param data Data.
+ * @param len Length of data.
+ */
+void sha1_update(SHA1_State *state, const void *data, size_t len);
+
+/**
+ * Finalize a SHA-1 state and get the digest.
+ * The state must be reinitialized before it can be used again.
+ * @param state State.
+ * @param digest Digest. (SHA1_DIGEST_SIZE bytes)
+ */
+void sha1_final(SHA1_State *state, uint8_t digest[SHA1_DIGEST_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ORTIN_LIBORTIN_SHA1_H__ */
@@ -0,0 +1,186 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * xxh64.c: xxHash64 implementation.                                       *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "xxh64.h"
+#include "byteswap.h"
+
+// C includes.
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64_to_cpu(v);
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32_to_cpu(v);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * Process as many full 32-byte stripes as possible.
+ * @param v Accumulators.
+ * @param p Data.
+ * @param len Length of data.
+ * @return Number of bytes processed.
+ */
+static size_t xxh64_stripes(uint64_t v[4], const uint8_t *p, size_t len)
+{
+	uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+	const uint8_t *const start = p;
+	for (; len >= 32; len -= 32, p += 32) {
+		v1 = xxh64_round(v1, read64(p));
+		v2 = xxh64_round(v2, read64(p+8));
+		v3 = xxh64_round(v3, read64(p+16));
+		v4 = xxh64_round(v4, read64(p+24));
+	}
+	v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+	return (size_t)(p - start);
+}
+
+/**
+ * Initialize an xxHash64 state.
+ * @param state State.
+ * @param seed Seed.
+ */
+void xxh64_init(XXH64_State *state, uint64_t seed)
+{
+	state->total_len = 0;
+	state->v[0] = seed + PRIME64_1 + PRIME64_2;
+	state->v[1] = seed + PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME64_1;
+	state->memsize = 0;
+}
+
+/**
+ * Add data to an xxHash64 state.
+ * @param state State.
+ * @param data Data.
+ * @param len Length of data.
+ */
+void xxh64_update(XXH64_State *state, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	state->total_len += len;
+
+	if (state->memsize > 0) {
+		// Fill the partial stripe first.
+		size_t fill = 32 - state->memsize;
+		if (len < fill) {
+			memcpy(&state->mem[state->memsize], p, len);
+			state->memsize += (uint32_t)len;
+			return;
+		}
+		memcpy(&state->mem[state->memsize], p, fill);
+		xxh64_stripes(state->v, state->mem, 32);
+		p += fill;
+		len -= fill;
+		state->memsize = 0;
+	}
+
+	size_t done = xxh64_stripes(state->v, p, len);
+	p += done;
+	len -= done;
+	if (len > 0) {
+		memcpy(state->mem, p, len);
+		state->memsize = (uint32_t)len;
+	}
+}
+
+/**
+ * Get the xxHash64 digest.
+ * The state is not modified, so more data can be added afterwards.
+ * @param state State.
+ * @return xxHash64 digest.
+ */
+uint64_t xxh64_digest(const XXH64_State *state)
+{
+	uint64_t h;
+	if (state->total_len >= 32) {
+		h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+		    rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+		h = xxh64_merge_round(h, state->v[0]);
+		h = xxh64_merge_round(h, state->v[1]);
+		h = xxh64_merge_round(h, state->v[2]);
+		h = xxh64_merge_round(h, state->v[3]);
+	} else {
+		// Only the seed is stored in v[2] at this point.
+		h = state->v[2] + PRIME64_5;
+	}
+	h += state->total_len;
+
+	// Remaining bytes.
+	const uint8_t *p = state->mem;
+	uint32_t len = state->memsize;
+	for (; len >= 8; len -= 8, p += 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; len--, p++) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	// Avalanche.
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * Calculate the xxHash64 of a single buffer.
+ * @param data Data.
+ * @param len Length of data.
+ * @param seed Seed.
+ * @return xxHash64 digest.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	XXH64_State state;
+	xxh64_init(&state, seed);
+	xxh64_update(&state, data, len);
+	return xxh64_digest(&state);
+}
@@ -0,0 +1,66 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (libortin)                                  *
+ * xxh64.h: xxHash64 implementation.                                       *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_LIBORTIN_XXH64_H__
+#define __ORTIN_LIBORTIN_XXH64_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * xxHash64 streaming state.
+ * Reference: https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ */
+typedef struct _XXH64_State {
+	uint64_t total_len;	// Total number of bytes hashed
+	uint64_t v[4];		// Accumulators
+	uint8_t mem[32];	// Buffered input (less than one stripe)
+	uint32_t memsize;	// Number of bytes in mem[]
+} XXH64_State;
+
+/**
+ * Initialize an xxHash64 state.
+ * @param state State.
+ * @param seed Seed.
+ */
+void xxh64_init(XXH64_State *state, uint64_t seed);
+
+/**
+ * Add data to an xxHash64 state.
+ * @param state State.
+ * @param data Data.
+ * @param len Length of data.
+ */
+void xxh64_update(XXH64_State *state, const void *data, size_t len);
+
+/**
+ * Get the xxHash64 digest.
+ * The state is not modified, so more data can be added afterwards.
+ * @param state State.
+ * @return xxHash64 digest.
+ */
+uint64_t xxh64_digest(const XXH64_State *state);
+
+/**
+ * Calculate the xxHash64 of a single buffer.
+ * @param data Data.
+ * @param len Length of data.
+ * @param seed Seed.
+ * @return xxHash64 digest.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ORTIN_LIBORTIN_XXH64_H__ */
@@ -0,0 +1,176 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * datfile.cpp: No-Intro DAT file parser.                                  *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "datfile.hpp"
+
+// C includes. (C++ namespace)
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// C++ includes.
+#include <string>
+using std::string;
+
+/**
+ * Decode XML character entities.
+ * @param str String.
+ * @return Decoded string.
+ */
+static string xmlUnescape(const string &str)
+{
+	static const struct {
+		const char *entity;
+		char ch;
+	} entities[] = {
+		{"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'},
+		{"&quot;", '"'}, {"&apos;", '\''},
+	};
+
+	string ret;
+	ret.reserve(str.size());
+	for (size_t i = 0; i < str.size(); ) {
+		if (str[i] == '&') {
+			bool found = false;
+			for (size_t j = 0; j < sizeof(entities)/sizeof(entities[0]); j++) {
+				const size_t len = strlen(entities[j].entity);
+				if (!str.compare(i, len, entities[j].entity)) {
+					ret += entities[j].ch;
+					i += len;
+					found = true;
+					break;
+				}
+			}
+			if (found)
+				continue;
+		}
+		ret += str[i++];
+	}
+	return ret;
+}
+
+/**
+ * Get an attribute from an XML tag.
+ * @param tag		[in] Tag contents, not including '<' and '>'.
+ * @param name		[in] Attribute name.
+ * @param value		[out] Attribute value.
+ * @return True if found; false if not.
+ */
+static bool getAttribute(const string &tag, const char *name, string &value)
+{
+	const size_t namelen = strlen(name);
+	size_t pos = 0;
+	while ((pos = tag.find(name, pos)) != string::npos) {
+		// Must be preceded by whitespace and followed by '='.
+		const size_t eq = pos + namelen;
+		if (pos > 0 && isspace((unsigned char)tag[pos-1]) &&
+		    eq + 1 < tag.size() && tag[eq] == '=' &&
+		    (tag[eq+1] == '"' || tag[eq+1] == '\''))
+		{
+			const char quote = tag[eq+1];
+			const size_t end = tag.find(quote, eq+2);
+			if (end == string::npos)
+				return false;
+			value = xmlUnescape(tag.substr(eq+2, end - (eq+2)));
+			return true;
+		}
+		pos = eq;
+	}
+	return false;
+}
+
+/**
+ * Load a Logiqx XML DAT file, e.g. from No-Intro.
+ * @param filename DAT filename.
+ * @return 0 on success; POSIX error code on error.
+ */
+int DatFile::load(const TCHAR *filename)
+{
+	m_entries.clear();
+
+	errno = 0;
+	FILE *f = _tfopen(filename, _T("rb"));
+	if (!f) {
+		int err = errno;
+		return (err != 0 ? err : EIO);
+	}
+
+	string xml;
+	char buf[65536];
+	size_t size;
+	while ((size = fread(buf, 1, sizeof(buf), f)) > 0) {
+		xml.append(buf, size);
+	}
+	fclose(f);
+
+	// Scan the tags. Only <game>/<machine> and <rom> are relevant.
+	string game;
+	size_t pos = 0;
+	while ((pos = xml.find('<', pos)) != string::npos) {
+		const size_t end = xml.find('>', pos);
+		if (end == string::npos)
+			break;
+		const string tag = xml.substr(pos + 1, end - (pos + 1));
+		pos = end + 1;
+
+		if (!tag.compare(0, 5, "game ") || !tag.compare(0, 8, "machine ")) {
+			game.clear();
+			getAttribute(tag, "name", game);
+		} else if (!tag.compare(0, 4, "rom ")) {
+			Entry entry;
+			string value;
+			entry.game = game;
+			getAttribute(tag, "name", entry.rom);
+			if (!getAttribute(tag, "size", value))
+				continue;
+			entry.size = strtoull(value.c_str(), nullptr, 10);
+			if (!getAttribute(tag, "crc", value))
+				continue;
+			entry.crc32 = (uint32_t)strtoul(value.c_str(), nullptr, 16);
+
+			entry.has_sha1 = false;
+			if (getAttribute(tag, "sha1", value) && value.size() == 40) {
+				entry.has_sha1 = true;
+				for (unsigned int i = 0; i < 20; i++) {
+					const char hex[3] = {value[i*2], value[i*2+1], '\0'};
+					char *endptr = nullptr;
+					entry.sha1[i] = (uint8_t)strtoul(hex, &endptr, 16);
+					if (*endptr != '\0') {
+						entry.has_sha1 = false;
+						break;
+					}
+				}
+			}
+			m_entries.push_back(std::move(entry));
+		}
+	}
+
+	return (m_entries.empty() ? EINVAL : 0);
+}
+
+/**
+ * Find a ROM entry.
+ * If the DAT entry has a SHA-1, it must match, too.
+ * @param size ROM size.
+ * @param crc32 CRC32.
+ * @param sha1 SHA-1. (20 bytes)
+ * @return Entry, or nullptr if not found.
+ */
+const DatFile::Entry *DatFile::find(uint64_t size, uint32_t crc32, const uint8_t *sha1) const
+{
+	for (auto iter = m_entries.cbegin(); iter != m_entries.cend(); ++iter) {
+		if (iter->size != size || iter->crc32 != crc32)
+			continue;
+		if (iter->has_sha1 && memcmp(iter->sha1, sha1, sizeof(iter->sha1)) != 0)
+			continue;
+		return &(*iter);
+	}
+	return nullptr;
+}
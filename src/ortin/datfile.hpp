@@ -0,0 +1,70 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * datfile.hpp: No-Intro DAT file parser.                                  *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_ORTIN_DATFILE_HPP__
+#define __ORTIN_ORTIN_DATFILE_HPP__
+
+#include "tcharx.h"
+
+// C includes.
+#include <stdint.h>
+
+// C++ includes.
+#include <string>
+#include <vector>
+
+class DatFile
+{
+	public:
+		DatFile() { }
+
+	private:
+		DatFile(const DatFile &);
+		DatFile &operator=(const DatFile&);
+
+	public:
+		struct Entry {
+			std::string game;	// Game name
+			std::string rom;	// ROM filename
+			uint64_t size;		// ROM size
+			uint32_t crc32;		// CRC32
+			bool has_sha1;		// True if sha1[] is valid
+			uint8_t sha1[20];	// SHA-1
+		};
+
+		/**
+		 * Load a Logiqx XML DAT file, e.g. from No-Intro.
+		 * @param filename DAT filename.
+		 * @return 0 on success; POSIX error code on error.
+		 */
+		int load(const TCHAR *filename);
+
+		/**
+		 * Get the number of ROM entries.
+		 * @return Number of ROM entries.
+		 */
+		inline size_t count(void) const
+		{
+			return m_entries.size();
+		}
+
+		/**
+		 * Find a ROM entry.
+		 * If the DAT entry has a SHA-1, it must match, too.
+		 * @param size ROM size.
+		 * @param crc32 CRC32.
+		 * @param sha1 SHA-1. (20 bytes)
+		 * @return Entry, or nullptr if not found.
+		 */
+		const Entry *find(uint64_t size, uint32_t crc32, const uint8_t *sha1) const;
+
+	private:
+		std::vector<Entry> m_entries;
+};
+
+#endif /* __ORTIN_ORTIN_DATFILE_HPP__ */
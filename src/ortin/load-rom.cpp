@@ -1,6 +1,6 @@
 /***************************************************************************
  * Ortin (IS-NITRO management) (ortin CLI)                                 *
- * load-rom.cpp: 'load' command.                                           *
+ * load-rom.cpp: 'load' and 'loadgba' commands.                            *
  *                                                                         *
  * Copyright (c) 2020 by David Korth.                                      *
  * SPDX-License-Identifier: GPL-2.0-or-later                               *
@@ -9,22 +9,279 @@
 #include "load-rom.hpp"
 #include "ISNitro.hpp"
 #include "ndscrypt.hpp"
+#include "datfile.hpp"
+#include "NitroTrace.hpp"
+#include "NitroMetrics.hpp"
+
+// Hashing
+#include "crc32.hpp"
+#include "sha1.h"
+#include "xxh64.h"
 
 // C includes. (C++ namespace)
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+// C includes.
+#include <unistd.h>
+
 // C++ includes.
 #include <algorithm>
+#include <string>
+using std::string;
 
 /**
- * Load a Nintendo DS ROM image.
+ * Load phase timer.
+ * Adds the elapsed time to a LoadRomTimes field and
+ * records a trace span if tracing is enabled.
+ */
+class LoadPhase
+{
+	public:
+		LoadPhase(NitroTrace *trace, const char *name, uint64_t &accum)
+			: m_span(trace, name)
+			, m_accum(accum)
+			, m_ts(NitroTrace::now())
+		{ }
+
+		~LoadPhase()
+		{
+			m_accum += NitroTrace::now() - m_ts;
+		}
+
+	private:
+		LoadPhase(const LoadPhase &);
+		LoadPhase &operator=(const LoadPhase&);
+
+	private:
+		NitroTraceSpan m_span;
+		uint64_t &m_accum;
+		const uint64_t m_ts;
+};
+
+/**
+ * Report an IS-NITRO error during loading.
+ * The NDS is removed from reset so the unit isn't left stuck.
  * @param nitro IS-NITRO object.
- * @param filename ROM image filename.
- * @return 0 on success; non-zero on error.
+ * @param what Operation that failed.
+ * @param ret libusb error code.
+ * @return ret
+ */
+static int load_error(ISNitro *nitro, const char *what, int ret)
+{
+	fprintf(stderr, "\n*** ERROR: %s failed: %s\n", what, libusb_error_name(ret));
+	// Remove IS-NITRO from reset anyway.
+	nitro->ndsReset(false);
+	return ret;
+}
+
+/**
+ * Print the upload progress.
+ * @param done Bytes uploaded.
+ * @param total Total bytes.
+ * @param elapsed Elapsed time, in microseconds.
+ */
+static void print_progress(uint64_t done, uint64_t total, uint64_t elapsed)
+{
+	const double mbps = (elapsed > 0 ? ((double)done / (double)elapsed) : 0);	// bytes/us == MB/s
+	unsigned int eta = 0;
+	if (done > 0 && done < total) {
+		eta = (unsigned int)((double)elapsed * (double)(total - done) / (double)done / 1000000.0);
+	}
+	fprintf(stderr, "\r%7.1f / %.1f MB  %6.2f MB/s  ETA %u:%02u ",
+		(double)done / 1048576.0, (double)total / 1048576.0,
+		mbps * 1000000.0 / 1048576.0, eta / 60, eta % 60);
+	fflush(stderr);
+}
+
+/**
+ * Upload checkpoint.
+ * Describes the last chunk the IS-NITRO acknowledged.
+ */
+struct UploadCheckpoint {
+	uint8_t slot;		// Emulated slot number
+	uint32_t address;	// Chunk address
+	uint32_t len;		// Chunk length (0 if no chunk was acknowledged yet)
+	uint64_t xxh64;		// xxHash64 of the chunk as written
+};
+
+/**
+ * Is a libusb error likely to be caused by a flaky USB connection?
+ * @param ret libusb error code.
+ * @return True if the transfer should be retried.
+ */
+static bool is_transient_error(int ret)
+{
+	switch (ret) {
+		case LIBUSB_ERROR_IO:
+		case LIBUSB_ERROR_NO_DEVICE:
+		case LIBUSB_ERROR_TIMEOUT:
+		case LIBUSB_ERROR_PIPE:
+		case LIBUSB_ERROR_OVERFLOW:
+		case LIBUSB_ERROR_INTERRUPTED:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Re-open the IS-NITRO after a USB error and verify the checkpoint.
+ * The last acknowledged chunk is read back and hashed to confirm
+ * that EMULATOR memory survived the re-open.
+ *
+ * NOTE: Only the last acknowledged chunk is verified. Earlier chunks
+ * are assumed to be intact if it is.
+ *
+ * If the readback fails, the checkpoint can't be verified, so the
+ * upload resumes without verification and a warning is printed.
+ * A readback that doesn't match the checkpoint is fatal.
+ *
+ * @param nitro		[in] IS-NITRO object.
+ * @param checkpoint	[in] Upload checkpoint.
+ * @return 0 on success; LIBUSB_ERROR_OTHER on checkpoint mismatch; libusb error code on error.
  */
-int load_nds_rom(ISNitro *nitro, const TCHAR *filename)
+static int reopen_and_verify(ISNitro *nitro, const UploadCheckpoint &checkpoint)
+{
+	int ret = nitro->reopen();
+	if (ret == 0)
+		ret = nitro->ndsReset(true);
+	if (ret == 0)
+		ret = nitro->setSlotPower(1, false);
+	if (ret == 0)
+		ret = nitro->setSlotPower(2, false);
+	if (ret < 0 || checkpoint.len == 0)
+		return ret;
+
+	uint8_t *const buf = static_cast<uint8_t*>(malloc(checkpoint.len));
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
+	ret = nitro->readEmulationMemory(checkpoint.slot, checkpoint.address, buf, checkpoint.len);
+	if (ret < 0) {
+		fprintf(stderr, "\n*** WARNING: Reading back EMULATOR memory at 0x%08X failed: %s;\n"
+			"             resuming without verifying the checkpoint.\n",
+			checkpoint.address, libusb_error_name(ret));
+		ret = 0;
+	} else if (xxh64(buf, checkpoint.len, 0) != checkpoint.xxh64) {
+		fprintf(stderr, "\n*** ERROR: EMULATOR memory at 0x%08X does not match the checkpoint;\n"
+			"           the ROM image must be reloaded from the start.\n",
+			checkpoint.address);
+		ret = LIBUSB_ERROR_OTHER;
+	}
+	free(buf);
+	return ret;
+}
+
+/**
+ * Write a chunk to EMULATOR memory, retrying on transient USB errors.
+ * Retries use exponential backoff. The IS-NITRO is re-opened before
+ * each retry, and the upload resumes from the checkpoint.
+ * @param nitro		[in] IS-NITRO object.
+ * @param slot		[in] Emulated slot number. (1 for DS, 2 for GBA)
+ * @param address	[in] Chunk address.
+ * @param data		[in] Chunk data.
+ * @param len		[in] Chunk length.
+ * @param retries	[in] Maximum number of retries.
+ * @param checkpoint	[in,out] Upload checkpoint.
+ * @param record	[in,out] Load record.
+ * @return 0 on success; libusb error code on error.
+ */
+static int write_chunk(ISNitro *nitro, uint8_t slot, uint32_t address, const uint8_t *data, uint32_t len,
+	unsigned int retries, UploadCheckpoint &checkpoint, LoadRomRecord *record)
+{
+	int ret = nitro->writeEmulationMemory(slot, address, data, len);
+	for (unsigned int attempt = 0; ret < 0 && attempt < retries && is_transient_error(ret); attempt++) {
+		// Back off: 100 ms, 200 ms, 400 ms, ... up to 3.2 s.
+		const unsigned int delay_ms = 100U << std::min(attempt, 5U);
+		fprintf(stderr, "\n*** WARNING: Writing EMULATOR memory at 0x%08X failed: %s; "
+			"retrying in %u ms (%u/%u)\n",
+			address, libusb_error_name(ret), delay_ms, attempt + 1, retries);
+		record->retries++;
+		usleep(delay_ms * 1000);
+
+		ret = reopen_and_verify(nitro, checkpoint);
+		if (ret == 0) {
+			record->reopens++;
+		} else if (ret == LIBUSB_ERROR_OTHER) {
+			// Checkpoint mismatch. Resuming won't work.
+			return ret;
+		} else {
+			continue;
+		}
+
+		ret = nitro->writeEmulationMemory(slot, address, data, len);
+	}
+	if (ret < 0)
+		return ret;
+
+	checkpoint.slot = slot;
+	checkpoint.address = address;
+	checkpoint.len = len;
+	checkpoint.xxh64 = xxh64(data, len, 0);
+	return 0;
+}
+
+/**
+ * Write the blocks of a chunk that changed since the last upload.
+ * Runs of changed blocks are written with a single transfer.
+ * @param nitro		[in] IS-NITRO object.
+ * @param slot		[in] Emulated slot number. (1 for DS, 2 for GBA)
+ * @param address	[in] Chunk address. (Must be a multiple of BLOCK_SIZE.)
+ * @param data		[in] Chunk data.
+ * @param len		[in] Chunk length.
+ * @param retries	[in] Maximum number of retries per transfer.
+ * @param oldBlocks	[in] Block hashes from the last upload.
+ * @param newBlocks	[in,out] Block hashes for this upload.
+ * @param checkpoint	[in,out] Upload checkpoint.
+ * @param record	[in,out] Load record.
+ * @return 0 on success; libusb error code on error.
+ */
+static int write_changed_blocks(ISNitro *nitro, uint8_t slot, uint32_t address, const uint8_t *data, uint32_t len,
+	unsigned int retries, const std::vector<uint64_t> &oldBlocks, std::vector<uint64_t> &newBlocks,
+	UploadCheckpoint &checkpoint, LoadRomRecord *record)
+{
+	static const uint32_t BLOCK_SIZE = LoadRomSession::BLOCK_SIZE;
+	uint32_t runStart = 0, runLen = 0;
+	for (uint32_t pos = 0; pos < len || runLen > 0; pos += BLOCK_SIZE) {
+		if (pos < len) {
+			const uint32_t blockLen = std::min(BLOCK_SIZE, len - pos);
+			const uint64_t hash = xxh64(&data[pos], blockLen, 0);
+			const size_t idx = (address + pos) / BLOCK_SIZE;
+			newBlocks.push_back(hash);
+			if (idx >= oldBlocks.size() || oldBlocks[idx] != hash) {
+				// Block changed. Add it to the current run.
+				if (runLen == 0)
+					runStart = pos;
+				runLen += blockLen;
+				continue;
+			}
+		}
+
+		// Block is unchanged, or this is the end of the chunk.
+		// Write the current run.
+		if (runLen > 0) {
+			int ret = write_chunk(nitro, slot, address + runStart, &data[runStart], runLen,
+				retries, checkpoint, record);
+			if (ret < 0)
+				return ret;
+			record->bytes_sent += runLen;
+			runLen = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Open a ROM image.
+ * @param filename	[in] ROM image filename.
+ * @param maxSize	[in] Maximum ROM image size.
+ * @param pFileSize	[out] ROM image size.
+ * @param pErr		[out] POSIX error code on error.
+ * @return ROM image file, or nullptr on error.
+ */
+static FILE *open_rom_image(const TCHAR *filename, off64_t maxSize, off64_t *pFileSize, int *pErr)
 {
 	errno = 0;
 	FILE *f = _tfopen(filename, "rb");
@@ -33,48 +290,190 @@ int load_nds_rom(ISNitro *nitro, const TCHAR *filename)
 		if (err == 0)
 			err = EIO;
 		fprintf(stderr, "*** ERROR opening '%s': %s\n", filename, strerror(err));
-		return err;
+		*pErr = err;
+		return nullptr;
 	}
 
 	fseeko(f, 0, SEEK_END);
-	off64_t fileSize = ftello(f);
+	const off64_t fileSize = ftello(f);
 	rewind(f);
-	if (fileSize > 256*1024*1024) {
-		fprintf(stderr, "*** ERROR: ROM image '%s' is larger than 256 MB.\n", filename);
+	if (fileSize > maxSize) {
+		fprintf(stderr, "*** ERROR: ROM image '%s' is larger than %u MB.\n",
+			filename, (unsigned int)(maxSize / (1024*1024)));
 		fclose(f);
+		*pErr = ENOMEM;
+		return nullptr;
+	}
+
+	*pFileSize = fileSize;
+	return f;
+}
+
+/**
+ * Make sure a ROM image fits in Slot-1 EMULATOR memory.
+ * The IS-NITRO must be in reset, since the size probe
+ * overwrites parts of EMULATOR memory.
+ *
+ * If the size can't be probed, the usual 256 MB is assumed.
+ * USB errors during the probe aren't fatal; the upload has
+ * its own retry handling.
+ *
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param fileSize	[in] ROM image size.
+ * @return 0 if the ROM image fits; ENOMEM if it doesn't.
+ */
+static int check_rom_fits(ISNitro *nitro, const TCHAR *filename, off64_t fileSize)
+{
+	uint32_t memSize = 0;
+	int ret = nitro->getEmulationMemorySize(&memSize);
+	bool assumed = false;
+	if (ret < 0) {
+		if (ret != LIBUSB_ERROR_NOT_SUPPORTED) {
+			fprintf(stderr, "*** WARNING: Probing EMULATOR memory failed: %s; assuming 256 MB.\n",
+				libusb_error_name(ret));
+		}
+		// Size is unknown. Assume the usual 256 MB.
+		memSize = 256U*1024*1024;
+		assumed = true;
+	}
+
+	if ((uint64_t)fileSize > memSize) {
+		fprintf(stderr, "*** ERROR: ROM image '%s' is larger than the %u MB of EMULATOR memory%s.\n",
+			filename, memSize / (1024*1024), (assumed ? " (assumed; unable to detect)" : ""));
 		return ENOMEM;
 	}
+	return 0;
+}
+
+/**
+ * Initialize a load record.
+ * @param record	[out] Load record.
+ * @param filename	[in] ROM image filename.
+ * @param fileSize	[in] ROM image size.
+ */
+static void init_load_record(LoadRomRecord *record, const TCHAR *filename, off64_t fileSize)
+{
+	record->filename = filename;
+	record->rom_size = fileSize;
+	record->bytes_sent = 0;
+	record->dat_name.clear();
+	record->retries = 0;
+	record->reopens = 0;
+	memset(&record->times, 0, sizeof(record->times));
+}
+
+/**
+ * Verify a ROM image against the DAT file.
+ * @param dat		[in] DAT file.
+ * @param record	[in,out] Load record.
+ * @param info		[in] Output file for the result.
+ * @return 0 on success; EILSEQ if the ROM image doesn't match.
+ */
+static int verify_dat(const DatFile &dat, LoadRomRecord *record, FILE *info)
+{
+	const DatFile::Entry *const entry = dat.find(record->rom_size, record->crc32, record->sha1);
+	if (!entry) {
+		fprintf(stderr, "*** ERROR: ROM image does not match any entry in the DAT file.\n");
+		return EILSEQ;
+	}
+	record->dat_name = entry->game;
+	fprintf(info, "DAT:   %s (verified)\n", entry->game.c_str());
+	return 0;
+}
+
+/**
+ * ROM image fixup function.
+ * Called for the first chunk after it's hashed.
+ * The image is uploaded as-is if the fixup fails.
+ * @param buf Chunk data.
+ * @param len Chunk length.
+ * @return 0 on success; non-zero on error.
+ */
+typedef int (*RomFixupFn)(uint8_t *buf, size_t len);
+
+/**
+ * Upload a ROM image to EMULATOR memory, starting at address 0.
+ * The IS-NITRO must already be in reset.
+ * ROM image digests are calculated on the fly and stored in the record.
+ * @param nitro		[in] IS-NITRO object.
+ * @param slot		[in] Emulated slot number. (1 for DS, 2 for GBA)
+ * @param f		[in] ROM image file.
+ * @param fileSize	[in] ROM image size.
+ * @param fixup		[in] Fixup function for the first chunk.
+ * @param fixupName	[in] Trace span name for the fixup function.
+ * @param options	[in] Load options.
+ * @param record	[in,out] Load record.
+ * @return 0 on success; positive POSIX error code or negative libusb error code on error.
+ */
+static int upload_rom_image(ISNitro *nitro, uint8_t slot, FILE *f, off64_t fileSize,
+	RomFixupFn fixup, const char *fixupName,
+	const LoadRomOptions *options, LoadRomRecord *record)
+{
+	NitroTrace *const trace = nitro->trace();
+	LoadRomTimes &times = record->times;
+
+	// Hashes are calculated on the fly while uploading.
+	uint32_t crc32 = 0;
+	SHA1_State sha1;
+	sha1_init(&sha1);
+	XXH64_State xxh;
+	xxh64_init(&xxh, 0);
 
 	static const size_t BUF_SIZE = 1048576U;
 	uint8_t *const buf1mb = static_cast<uint8_t*>(malloc(BUF_SIZE));
+	if (!buf1mb)
+		return ENOMEM;
 
-	// Reset the IS-NITRO while loading a ROM image.
-	nitro->fullReset();
-	nitro->ndsReset(true);
-	nitro->setSlotPower(1, false);
+	// Incremental upload: Only blocks that changed since the last
+	// upload in this session are written. The session is invalid
+	// until this upload finishes, since EMULATOR memory may not
+	// match either ROM image if it fails partway.
+	LoadRomSession *const session = options->session;
+	std::vector<uint64_t> oldBlocks, newBlocks;
+	if (session) {
+		oldBlocks.swap(session->blocks);
+		newBlocks.reserve((fileSize + LoadRomSession::BLOCK_SIZE - 1) / LoadRomSession::BLOCK_SIZE);
+	}
 
 	// Load 1 MB at a time.
+	const uint64_t totalSize = (uint64_t)fileSize;
+	const uint64_t uploadTs = NitroTrace::now();
+	uint64_t lastProgress = 0;
 	uint32_t address = 0;
 	bool firstMB = true;
+	UploadCheckpoint checkpoint;
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	int ret = 0;
 	while (fileSize > 0) {
 		uint32_t curlen = std::min(fileSize, (off64_t)BUF_SIZE);
 		errno = 0;
-		size_t size = fread(buf1mb, 1, curlen, f);
+		size_t size;
+		{
+			LoadPhase phase(trace, "load: file read", times.file_read);
+			size = fread(buf1mb, 1, curlen, f);
+		}
 		if ((off64_t)size != curlen) {
 			// Short read...
-			int err = errno;
-			if (err == 0)
-				err = EIO;
+			ret = errno;
+			if (ret == 0)
+				ret = EIO;
 			fprintf(stderr, "*** ERROR: Short read.\n");
-			// Remove IS-NITRO from reset anyway.
-			nitro->ndsReset(false);
-			return err;
+			break;
 		}
 		fileSize -= curlen;
 
+		// Hash the data before the fixup function modifies it.
+		{
+			LoadPhase phase(trace, "load: hash", times.hash);
+			crc32 = crc32_update(crc32, buf1mb, curlen);
+			sha1_update(&sha1, buf1mb, curlen);
+			xxh64_update(&xxh, buf1mb, curlen);
+		}
+
 		if (firstMB) {
-			// We may need to encrypt the secure area.
-			ndscrypt_encrypt_secure_area(buf1mb, curlen);
+			LoadPhase phase(trace, fixupName, times.encrypt);
+			fixup(buf1mb, curlen);
 			firstMB = false;
 		}
 
@@ -84,34 +483,497 @@ int load_nds_rom(ISNitro *nitro, const TCHAR *filename)
 			curlen++;
 		}
 		// Write to the emulation memory.
-		nitro->writeEmulationMemory(1, address, buf1mb, curlen);
+		{
+			LoadPhase phase(trace, "load: USB transfer", times.usb_transfer);
+			if (session) {
+				ret = write_changed_blocks(nitro, slot, address, buf1mb, curlen,
+					options->retries, oldBlocks, newBlocks, checkpoint, record);
+			} else {
+				ret = write_chunk(nitro, slot, address, buf1mb, curlen,
+					options->retries, checkpoint, record);
+				if (ret == 0)
+					record->bytes_sent += curlen;
+			}
+		}
+		if (ret < 0) {
+			fprintf(stderr, "\n*** ERROR: Writing EMULATOR memory failed: %s\n", libusb_error_name(ret));
+			break;
+		}
 		address += curlen;
+
+		if (options->progress) {
+			// Update the progress display at most 4 times per second.
+			const uint64_t now = NitroTrace::now();
+			if (now - lastProgress >= 250000 || fileSize == 0) {
+				print_progress(std::min((uint64_t)address, totalSize), totalSize, now - uploadTs);
+				lastProgress = now;
+			}
+		}
+	}
+	if (trace) {
+		trace->recordSpan("load: upload", uploadTs);
+	}
+	if (options->progress) {
+		fputc('\n', stderr);
+	}
+	free(buf1mb);
+	if (ret != 0)
+		return ret;
+
+	if (session) {
+		session->blocks.swap(newBlocks);
+	}
+	record->crc32 = crc32;
+	sha1_final(&sha1, record->sha1);
+	record->xxh64 = xxh64_digest(&xxh);
+	return 0;
+}
+
+/**
+ * Prepare the first chunk of an NDS ROM image.
+ * The secure area is encrypted if necessary, and the debugging
+ * pointers are patched into the header so installDebuggerROM()
+ * doesn't have to write them separately.
+ * @param buf First chunk of the ROM image.
+ * @param len Length of buf.
+ * @return 0 on success; non-zero on error.
+ */
+static int nds_fix_header(uint8_t *buf, size_t len)
+{
+	// NOTE: The secure area is left as-is if encryption fails.
+	ndscrypt_encrypt_secure_area(buf, len);
+	return ISNitro::patchDebugPointers(buf, len);
+}
+
+/**
+ * Load a Nintendo DS ROM image. (internal function)
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in,opt] Load options.
+ * @param record	[out] Load record.
+ * @return 0 on success; non-zero on error.
+ */
+static int load_nds_rom_int(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, LoadRomRecord *record)
+{
+	const LoadRomOptions defaultOptions;
+	if (!options) {
+		options = &defaultOptions;
+	}
+
+	// Load the DAT file first so errors are reported before
+	// the IS-NITRO is reset.
+	DatFile dat;
+	if (options->dat_filename) {
+		int err = dat.load(options->dat_filename);
+		if (err != 0) {
+			_ftprintf(stderr, _T("*** ERROR loading DAT file '%s': %s\n"), options->dat_filename, strerror(err));
+			return err;
+		}
+	}
+
+	int err = 0;
+	off64_t fileSize = 0;
+	// NOTE: The actual limit is checked after the IS-NITRO is reset.
+	FILE *f = open_rom_image(filename, 1024*1024*1024, &fileSize, &err);
+	if (!f) {
+		return err;
+	}
+
+	init_load_record(record, filename, fileSize);
+	LoadRomTimes &times = record->times;
+
+	NitroTrace *const trace = nitro->trace();
+	LoadPhase loadPhase(trace, "load_nds_rom", times.total);
+
+	// Reset the IS-NITRO while loading a ROM image.
+	// NOTE: fullReset() is skipped for incremental uploads.
+	const bool incremental = (options->session && !options->session->blocks.empty());
+	int ret;
+	{
+		LoadPhase phase(trace, "load: reset", times.reset);
+		ret = (incremental ? 0 : nitro->fullReset());
+		if (ret == 0)
+			ret = nitro->ndsReset(true);
+		if (ret == 0)
+			ret = nitro->setSlotPower(1, false);
+	}
+	if (ret < 0) {
+		fclose(f);
+		return load_error(nitro, "Reset", ret);
+	}
+
+	// Make sure the ROM image fits before spending time on the upload.
+	ret = check_rom_fits(nitro, filename, fileSize);
+	if (ret != 0) {
+		fclose(f);
+		// Remove IS-NITRO from reset anyway.
+		nitro->ndsReset(false);
+		return ret;
+	}
+
+	// We may need to encrypt the secure area.
+	// The debugging pointers are patched into the first chunk.
+	ret = upload_rom_image(nitro, 1, f, fileSize,
+		nds_fix_header, "load: encrypt secure area",
+		options, record);
+	fclose(f);
+	if (ret != 0) {
+		// Remove IS-NITRO from reset anyway.
+		nitro->ndsReset(false);
+		return ret;
+	}
+	print_load_record(record, options->info);
+
+	if (options->dat_filename) {
+		// Verify the ROM image against the DAT file.
+		ret = verify_dat(dat, record, options->info);
+		if (ret != 0) {
+			// Remove IS-NITRO from reset anyway.
+			nitro->ndsReset(false);
+			return ret;
+		}
 	}
 
 	// Install the debugger ROM.
-	nitro->installDebuggerROM();
+	{
+		LoadPhase phase(trace, "load: debugger install", times.debugger_install);
+		// nds_fix_header() patched the debugging pointers
+		// unless the ROM image is too small to have them.
+		const bool headerPatched = (fileSize >= 0x170);
+		ret = nitro->installDebuggerROM(false, headerPatched);
+	}
+	if (ret < 0)
+		return load_error(nitro, "Installing the debugger ROM", ret);
 
 	// ROM image loaded!
 	// Slot power must be turned on in order to access save memory.
-	nitro->setSlotPower(1, true);
-	nitro->ndsReset(false);
+	{
+		LoadPhase phase(trace, "load: release reset", times.reset_release);
+		ret = nitro->setSlotPower(1, true);
+		if (ret == 0)
+			ret = nitro->ndsReset(false);
+	}
+	if (ret < 0)
+		return load_error(nitro, "Releasing reset", ret);
 
 	// Wait for the debugger ROM to initialize.
-	int ret = nitro->waitForDebuggerROM();
-	if (ret < 0)
+	{
+		LoadPhase phase(trace, "load: debugger wait", times.debugger_wait);
+		ret = nitro->waitForDebuggerROM();
+	}
+	if (ret < 0) {
+		fprintf(stderr, "*** ERROR: Debugger ROM did not initialize: %s\n", libusb_error_name(ret));
 		return ret;
+	}
 
 	// LibISNitroEmulator sends cmd174 to both CPUs here.
+	LoadPhase startPhase(trace, "load: start CPUs", times.cpu_start);
 	ret = nitro->sendCpuCMD174(NITRO_CPU_ARM9);
-	if (ret < 0)
+	if (ret == 0)
+		ret = nitro->sendCpuCMD174(NITRO_CPU_ARM7);
+
+	// Start the ARM9 and ARM7 CPUs together.
+	// (Official debugger ROM requires this; NitroDriver's ROM does not.)
+	if (ret == 0)
+		ret = nitro->continueProcessors();
+	if (ret < 0) {
+		fprintf(stderr, "*** ERROR: Starting the CPUs failed: %s\n", libusb_error_name(ret));
 		return ret;
-	ret = nitro->sendCpuCMD174(NITRO_CPU_ARM7);
-	if (ret < 0)
+	}
+	return 0;
+}
+
+/**
+ * Load a Nintendo DS ROM image.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in,opt] Load options.
+ * @param record	[out,opt] Load record.
+ * @return 0 on success; non-zero on error.
+ */
+int load_nds_rom(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, LoadRomRecord *record)
+{
+	LoadRomRecord localRecord;
+	if (!record) {
+		record = &localRecord;
+	}
+
+	const uint64_t ts = NitroTrace::now();
+	int ret = load_nds_rom_int(nitro, filename, options, record);
+	NitroMetrics *const metrics = nitro->metrics();
+	if (metrics) {
+		metrics->recordOperation(NitroMetrics::OP_LOAD, NitroTrace::now() - ts, ret);
+	}
+	return ret;
+}
+
+/**
+ * Fix the GBA ROM header's complement check.
+ * @param buf First chunk of the ROM image.
+ * @param len Length of buf.
+ * @return 0 on success; non-zero on error.
+ */
+static int gba_fix_header(uint8_t *buf, size_t len)
+{
+	if (len < 0xC0) {
+		// Too small to have a valid header.
+		return -1;
+	}
+
+	// Complement check: Sum of 0xA0-0xBC, negated, minus 0x19.
+	uint8_t chk = 0;
+	for (unsigned int i = 0xA0; i <= 0xBC; i++) {
+		chk -= buf[i];
+	}
+	chk -= 0x19;
+	if (buf[0xBD] != chk) {
+		// NOTE: Printed to stderr, since stdout may be machine-readable.
+		fprintf(stderr, "GBA header complement check fixed: 0x%02X -> 0x%02X\n", buf[0xBD], chk);
+		buf[0xBD] = chk;
+	}
+	return 0;
+}
+
+/**
+ * Load a Game Boy Advance ROM image into Slot-2 EMULATOR memory. (internal function)
+ * The header complement check is fixed if necessary, and the
+ * NDS is started in the firmware, which boots the GBA game.
+ * options->session is ignored.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in,opt] Load options.
+ * @param record	[out] Load record.
+ * @return 0 on success; non-zero on error.
+ */
+static int load_gba_rom_int(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, LoadRomRecord *record)
+{
+	LoadRomOptions gbaOptions;
+	if (options) {
+		gbaOptions = *options;
+	}
+	gbaOptions.session = nullptr;
+
+	// Load the DAT file first so errors are reported before
+	// the IS-NITRO is reset.
+	DatFile dat;
+	if (gbaOptions.dat_filename) {
+		int err = dat.load(gbaOptions.dat_filename);
+		if (err != 0) {
+			_ftprintf(stderr, _T("*** ERROR loading DAT file '%s': %s\n"), gbaOptions.dat_filename, strerror(err));
+			return err;
+		}
+	}
+
+	// GBA ROM images are up to 32 MB.
+	int err = 0;
+	off64_t fileSize = 0;
+	FILE *f = open_rom_image(filename, 32*1024*1024, &fileSize, &err);
+	if (!f) {
+		return err;
+	}
+	if (fileSize < 0xC0) {
+		fprintf(stderr, "*** ERROR: ROM image '%s' is too small to be a GBA ROM image.\n", filename);
+		fclose(f);
+		return EINVAL;
+	}
+
+	init_load_record(record, filename, fileSize);
+	LoadRomTimes &times = record->times;
+
+	NitroTrace *const trace = nitro->trace();
+	LoadPhase loadPhase(trace, "load_gba_rom", times.total);
+
+	// Reset the IS-NITRO while loading a ROM image.
+	// NOTE: fullReset() turns off Slot 2.
+	int ret;
+	{
+		LoadPhase phase(trace, "load: reset", times.reset);
+		ret = nitro->fullReset();
+		if (ret == 0)
+			ret = nitro->ndsReset(true);
+		if (ret == 0)
+			ret = nitro->setSlotPower(1, false);
+	}
+	if (ret < 0) {
+		fclose(f);
+		return load_error(nitro, "Reset", ret);
+	}
+
+	ret = upload_rom_image(nitro, 2, f, fileSize,
+		gba_fix_header, "load: fix GBA header",
+		&gbaOptions, record);
+	fclose(f);
+	if (ret != 0) {
+		// Remove IS-NITRO from reset anyway.
+		nitro->ndsReset(false);
 		return ret;
+	}
+	print_load_record(record, gbaOptions.info);
 
-	// Start the ARM9 and ARM7 CPUs.
-	// (Official debugger ROM requires this; NitroDriver's ROM does not.)
-	nitro->continueProcessor(0);
-	nitro->continueProcessor(1);
+	if (gbaOptions.dat_filename) {
+		// Verify the ROM image against the DAT file.
+		ret = verify_dat(dat, record, gbaOptions.info);
+		if (ret != 0) {
+			// Remove IS-NITRO from reset anyway.
+			nitro->ndsReset(false);
+			return ret;
+		}
+	}
+
+	// NOTE: The debugger ROM isn't installed, since it writes
+	// the ISID to Slot-2 EMULATOR memory, which would overwrite
+	// the GBA ROM header. Without it, the NDS boots into the
+	// firmware, which starts the GBA game. (Automatically if
+	// the firmware is set to Auto mode; otherwise, select it
+	// from the menu.)
+	// Physical Slot 2 stays powered off so the emulated
+	// cartridge is used.
+	{
+		LoadPhase phase(trace, "load: release reset", times.reset_release);
+		ret = nitro->ndsReset(false);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "*** ERROR: Releasing reset failed: %s\n", libusb_error_name(ret));
+		return ret;
+	}
 	return 0;
 }
+
+/**
+ * Load a Game Boy Advance ROM image into Slot-2 EMULATOR memory.
+ * The header complement check is fixed if necessary, and the
+ * NDS is started in the firmware, which boots the GBA game.
+ * options->session is ignored.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in,opt] Load options.
+ * @param record	[out,opt] Load record.
+ * @return 0 on success; non-zero on error.
+ */
+int load_gba_rom(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, LoadRomRecord *record)
+{
+	LoadRomRecord localRecord;
+	if (!record) {
+		record = &localRecord;
+	}
+
+	const uint64_t ts = NitroTrace::now();
+	int ret = load_gba_rom_int(nitro, filename, options, record);
+	NitroMetrics *const metrics = nitro->metrics();
+	if (metrics) {
+		metrics->recordOperation(NitroMetrics::OP_LOAD, NitroTrace::now() - ts, ret);
+	}
+	return ret;
+}
+
+/**
+ * Print a load record.
+ * @param record Load record.
+ * @param f Output file.
+ */
+void print_load_record(const LoadRomRecord *record, FILE *f)
+{
+	fprintf(f, "CRC32: %08X\n", record->crc32);
+	fputs("SHA-1: ", f);
+	for (unsigned int i = 0; i < sizeof(record->sha1); i++) {
+		fprintf(f, "%02x", record->sha1[i]);
+	}
+	fputc('\n', f);
+	fprintf(f, "XXH64: %016llx\n", (unsigned long long)record->xxh64);
+}
+
+/**
+ * Escape a string for JSON.
+ * @param str String.
+ * @return Escaped string, including quotes.
+ */
+static string json_escape(const char *str)
+{
+	string ret = "\"";
+	for (; *str != '\0'; str++) {
+		const unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\') {
+			ret += '\\';
+			ret += (char)c;
+		} else if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			ret += buf;
+		} else {
+			ret += (char)c;
+		}
+	}
+	ret += '"';
+	return ret;
+}
+
+/**
+ * Print load statistics.
+ * @param record Load record.
+ * @param json If true, print as JSON.
+ */
+void print_load_stats(const LoadRomRecord *record, bool json)
+{
+	const LoadRomTimes &t = record->times;
+	const double mbps = (t.usb_transfer > 0)
+		? ((double)record->bytes_sent / 1048576.0) / ((double)t.usb_transfer / 1000000.0)
+		: 0;
+
+	static const struct {
+		const char *name;	// JSON name
+		const char *desc;	// Description
+		uint64_t LoadRomTimes::*field;
+	} phases[] = {
+		{"reset",		"Reset",		&LoadRomTimes::reset},
+		{"file_read",		"File read",		&LoadRomTimes::file_read},
+		{"hash",		"Hashing",		&LoadRomTimes::hash},
+		{"encrypt",		"Secure Area / GBA header", &LoadRomTimes::encrypt},
+		{"usb_transfer",	"USB transfer",		&LoadRomTimes::usb_transfer},
+		{"debugger_install",	"Debugger install",	&LoadRomTimes::debugger_install},
+		{"debugger_wait",	"Debugger wait",	&LoadRomTimes::debugger_wait},
+		{"reset_release",	"Reset release",	&LoadRomTimes::reset_release},
+		{"cpu_start",		"CPU start",		&LoadRomTimes::cpu_start},
+		{"total",		"Total",		&LoadRomTimes::total},
+	};
+
+	if (!json) {
+		fputs("\nLoad statistics:\n", stdout);
+		for (size_t i = 0; i < sizeof(phases)/sizeof(phases[0]); i++) {
+			printf("- %-24s %10.3f ms\n", phases[i].desc, (double)(t.*phases[i].field) / 1000.0);
+		}
+		printf("- %-24s %10.2f MB/s\n", "USB throughput", mbps);
+		if (record->bytes_sent < record->rom_size) {
+			printf("- %-24s %10.1f of %.1f MB\n", "Uploaded",
+				(double)record->bytes_sent / 1048576.0, (double)record->rom_size / 1048576.0);
+		}
+		if (record->retries > 0) {
+			printf("- %-24s %7u (%u re-opens)\n", "Chunk retries",
+				record->retries, record->reopens);
+		}
+		return;
+	}
+
+	printf("{\"filename\":%s,\"rom_size\":%llu,\"bytes_sent\":%llu,",
+		json_escape(record->filename.c_str()).c_str(),
+		(unsigned long long)record->rom_size,
+		(unsigned long long)record->bytes_sent);
+	printf("\"crc32\":\"%08x\",\"sha1\":\"", record->crc32);
+	for (unsigned int i = 0; i < sizeof(record->sha1); i++) {
+		printf("%02x", record->sha1[i]);
+	}
+	printf("\",\"xxh64\":\"%016llx\",", (unsigned long long)record->xxh64);
+	if (!record->dat_name.empty()) {
+		printf("\"dat_name\":%s,", json_escape(record->dat_name.c_str()).c_str());
+	}
+	fputs("\"times_us\":{", stdout);
+	for (size_t i = 0; i < sizeof(phases)/sizeof(phases[0]); i++) {
+		printf("%s\"%s\":%llu", (i > 0 ? "," : ""), phases[i].name,
+			(unsigned long long)(t.*phases[i].field));
+	}
+	printf("},\"usb_mbps\":%.2f,\"retries\":%u,\"reopens\":%u}\n",
+		mbps, record->retries, record->reopens);
+}
@@ -1,6 +1,6 @@
 /***************************************************************************
  * Ortin (IS-NITRO management) (ortin CLI)                                 *
- * load-rom.hpp: 'load' command.                                           *
+ * load-rom.hpp: 'load' and 'loadgba' commands.                            *
  *                                                                         *
  * Copyright (c) 2020 by David Korth.                                      *
  * SPDX-License-Identifier: GPL-2.0-or-later                               *
@@ -11,14 +11,116 @@
 
 #include "tcharx.h"
 
+// C includes.
+#include <stdint.h>
+#include <stdio.h>
+
+// C++ includes.
+#include <string>
+#include <vector>
+
 class ISNitro;
 
+/**
+ * Upload session.
+ * Tracks what was written to EMULATOR memory so later loads in
+ * the same session only upload the blocks that changed.
+ */
+struct LoadRomSession {
+	static const uint32_t BLOCK_SIZE = 65536;
+	std::vector<uint64_t> blocks;	// xxHash64 of each block as written
+};
+
+/**
+ * Load options.
+ */
+struct LoadRomOptions {
+	const TCHAR *dat_filename;	// DAT file for verification (optional)
+	bool progress;			// Show live upload throughput and ETA
+	unsigned int retries;		// Retries per chunk on transient USB errors
+	LoadRomSession *session;	// Upload session for incremental loads (optional)
+	FILE *info;			// Human-readable output (stderr if stdout is machine-readable)
+
+	LoadRomOptions()
+		: dat_filename(nullptr)
+		, progress(false)
+		, retries(3)
+		, session(nullptr)
+		, info(stdout)
+	{ }
+};
+
+/**
+ * Load phase timings, in microseconds.
+ */
+struct LoadRomTimes {
+	uint64_t reset;			// fullReset() (or ndsReset() if incremental) and ndsReset(true)
+	uint64_t file_read;		// Reading the ROM image
+	uint64_t hash;			// CRC32, SHA-1, xxHash64
+	uint64_t encrypt;		// Secure Area encryption (GBA: header fixup)
+	uint64_t usb_transfer;		// writeEmulationMemory()
+	uint64_t debugger_install;	// installDebuggerROM()
+	uint64_t debugger_wait;		// waitForDebuggerROM()
+	uint64_t reset_release;		// Slot power and ndsReset(false)
+	uint64_t cpu_start;		// cmd174, continueProcessors()
+	uint64_t total;			// Entire load
+};
+
+/**
+ * Load record.
+ * Digests are calculated over the ROM image as stored on disk,
+ * before the Secure Area is re-encrypted.
+ */
+struct LoadRomRecord {
+	std::tstring filename;	// ROM image filename
+	uint64_t rom_size;	// ROM image size
+	uint64_t bytes_sent;	// Bytes written to EMULATOR memory
+	uint32_t crc32;		// CRC32
+	uint8_t sha1[20];	// SHA-1
+	uint64_t xxh64;		// xxHash64
+	std::string dat_name;	// Matching DAT entry, if verified
+	LoadRomTimes times;	// Phase timings
+	unsigned int retries;	// Chunk writes that were retried
+	unsigned int reopens;	// Device re-opens during the upload
+};
+
 /**
  * Load a Nintendo DS ROM image.
- * @param nitro IS-NITRO object.
- * @param filename ROM image filename.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in,opt] Load options.
+ * @param record	[out,opt] Load record.
+ * @return 0 on success; non-zero on error.
+ */
+int load_nds_rom(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options = nullptr, LoadRomRecord *record = nullptr);
+
+/**
+ * Load a Game Boy Advance ROM image into Slot-2 EMULATOR memory.
+ * The header complement check is fixed if necessary, and the
+ * NDS is started in the firmware, which boots the GBA game.
+ * options->session is ignored.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in,opt] Load options.
+ * @param record	[out,opt] Load record.
  * @return 0 on success; non-zero on error.
  */
-int load_nds_rom(ISNitro *nitro, const TCHAR *filename);
+int load_gba_rom(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options = nullptr, LoadRomRecord *record = nullptr);
+
+/**
+ * Print a load record.
+ * @param record Load record.
+ * @param f Output file.
+ */
+void print_load_record(const LoadRomRecord *record, FILE *f = stdout);
+
+/**
+ * Print load statistics.
+ * @param record Load record.
+ * @param json If true, print as JSON.
+ */
+void print_load_stats(const LoadRomRecord *record, bool json);
 
 #endif /* __ORTIN_ORTIN_LOAD_ROM_HPP__ */
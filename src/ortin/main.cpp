@@ -13,7 +13,6 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <unistd.h>	// FIXME: usleep() for Windows
 
 // C++ includes. (C namespace)
 #include <cerrno>
@@ -24,16 +23,24 @@
 // C++ includes.
 #include <algorithm>
 #include <locale>
+#include <string>
 
 // libusb
 #include <libusb.h>
 
 // IS-NITRO
 #include "ISNitro.hpp"
+#include "NitroTrace.hpp"
+#include "NitroLog.hpp"
+#include "NitroMetrics.hpp"
 
 // Commands
 #include "load-rom.hpp"
+#include "watch-rom.hpp"
+#include "metrics.hpp"
 #include "avmode.hpp"
+#include "rom-index.hpp"
+#include "status.hpp"
 
 #include "tcharx.h"
 #ifdef _MSC_VER
@@ -91,11 +98,30 @@ static void print_help(const TCHAR *argv0)
 		"  both slots, and resets the system.\n"
 		"\n"
 		"reset\n"
-		"- Do a soft reset. This resets the DS CPU only.\n"
+		"- Do a soft reset. This resets the DS CPU only. The system is released\n"
+		"  from reset once the status registers show that it's in reset, after\n"
+		"  at least 100 ms.\n"
+		"\n"
+		"status\n"
+		"- Show the NDS power, reset, boot, cover, debug button, and write\n"
+		"  protection status bits.\n"
 		"\n"
 		"load filename.nds\n"
+		"load --gamecode=CODE[:REV]\n"
 		"- Load a Nintendo DS ROM image. If the image has a decrypted secure area,\n"
-		"  it will be re-encrypted on load.\n"
+		"  it will be re-encrypted on load. With --gamecode, the ROM image is looked\n"
+		"  up in the ROM index; the highest revision is used if REV isn't specified.\n"
+		"  CRC32, SHA-1, and xxHash64 digests of the image are printed after upload.\n"
+		"\n"
+		"loadgba filename.gba\n"
+		"- Load a Game Boy Advance ROM image into Slot-2 EMULATOR memory. The header\n"
+		"  complement check is fixed if necessary. The NDS boots into the firmware,\n"
+		"  which starts the GBA game (automatically in Auto mode).\n"
+		"\n"
+		"index dir [dir...]\n"
+		"- Create or update the ROM index by scanning the specified directories for\n"
+		"  Nintendo DS ROM images. Unchanged files (same mtime and size) are not\n"
+		"  rescanned.\n"
 		"\n"
 		"avmode av1 av2 [--bgcolor=COLOR] [--deflicker=DEFLICKER]\n"
 		"- Set the AV mode settings. av1/av2 can be one of the following\n"
@@ -123,25 +149,59 @@ static void print_help(const TCHAR *argv0)
 		"                            Example: FF8000 - default is black (000000)\n"
 		"  -d, --deflicker=DEFLICKER Deflicker mode: none, normal, alternate.\n"
 		"                            Default is none.\n"
+		"  -D, --dat=FILE            Verify loaded ROM images against a No-Intro\n"
+		"                            (Logiqx XML) DAT file.\n"
+		"  -g, --gamecode=CODE[:REV] Load the ROM image with the specified game code\n"
+		"                            from the ROM index.\n"
+		"  -i, --index=FILE          ROM index filename.\n"
+		"                            Default is ~/.cache/ortin/rom-index.bin\n"
+		"  -t, --trace=FILE          Record all USB commands and export them as\n"
+		"                            Chrome trace JSON. (chrome://tracing, Perfetto)\n"
+		"  -r, --record=FILE         Record the USB command stream to a log file.\n"
+		"  -R, --replay=FILE         Replay a recorded USB command stream instead of\n"
+		"                            using an IS-NITRO unit. Fails if the commands\n"
+		"                            sent differ from the recording.\n"
+		"  -S, --replay-speed=X      Replay speed factor. 1 uses the recorded device\n"
+		"                            latency; 0 replays without delays. Default is 1.\n"
+		"  -s, --stats[=json]        Show live upload throughput and ETA while loading,\n"
+		"                            followed by a per-phase timing breakdown.\n"
+		"                            --stats=json prints the breakdown as JSON.\n"
+		"  -n, --retries=N           Retry each upload chunk up to N times on USB\n"
+		"                            errors, re-opening the unit and resuming from\n"
+		"                            the last acknowledged chunk. Default is 3.\n"
+		"  -w, --watch               After loading, keep watching the ROM image and\n"
+		"                            reload it when it changes. Only the parts that\n"
+		"                            changed are uploaded.\n"
+		"  -M, --metrics-file=FILE   Write per-unit metrics in Prometheus text format\n"
+		"                            for node_exporter's textfile collector. Updated\n"
+		"                            every 15 seconds and on exit.\n"
+		"  -P, --metrics-port=PORT   Serve per-unit metrics in Prometheus text format\n"
+		"                            at http://127.0.0.1:PORT/metrics.\n"
 		, stdout);
 }
 
-int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
+/**
+ * Print the program banner.
+ * @param f Output file.
+ */
+static void print_banner(FILE *f)
 {
-	// Set the C and C++ locales.
-	std::locale::global(std::locale(""));
-
-	puts("Ortin Tool v" VERSION_STRING "\n"
+	fputs("Ortin Tool v" VERSION_STRING "\n"
 		"Copyright (c) 2020 by David Korth.\n"
-		"This program is NOT licensed or endorsed by Nintendo Co, Ltd."
-	);
+		"This program is NOT licensed or endorsed by Nintendo Co, Ltd.\n", f);
 #ifdef RP_GIT_VERSION
-	puts(RP_GIT_VERSION);
+	fputs(RP_GIT_VERSION "\n", f);
 # ifdef RP_GIT_DESCRIBE
-	puts(RP_GIT_DESCRIBE);
+	fputs(RP_GIT_DESCRIBE "\n", f);
 # endif
 #endif
-	putchar('\n');
+	fputc('\n', f);
+}
+
+int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
+{
+	// Set the C and C++ locales.
+	std::locale::global(std::locale(""));
 
 	// avmode options.
 	uint32_t bg_color = 0;
@@ -151,16 +211,50 @@ int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
 	// rotation set up properly.
 	NitroAVRotation_e rotation = NITRO_AV_ROTATION_NONE;
 
+	// ROM index options.
+	const TCHAR *index_filename = nullptr;
+	const TCHAR *gamecode = nullptr;
+
+	// load options.
+	LoadRomOptions load_options;
+	bool stats = false;
+	bool stats_json = false;
+	bool watch = false;
+
+	// Trace output filename.
+	const TCHAR *trace_filename = nullptr;
+
+	// Command stream recording and replay.
+	const TCHAR *record_filename = nullptr;
+	const TCHAR *replay_filename = nullptr;
+	double replay_speed = 1.0;
+
+	// Metrics export.
+	const TCHAR *metrics_filename = nullptr;
+	uint16_t metrics_port = 0;
+
 	while (true) {
 		static const struct option long_options[] = {
 			{_T("bgcolor"),		required_argument,	0, _T('b')},
 			{_T("deflicker"),	required_argument,	0, _T('d')},
+			{_T("dat"),		required_argument,	0, _T('D')},
+			{_T("gamecode"),	required_argument,	0, _T('g')},
+			{_T("index"),		required_argument,	0, _T('i')},
+			{_T("trace"),		required_argument,	0, _T('t')},
+			{_T("record"),		required_argument,	0, _T('r')},
+			{_T("replay"),		required_argument,	0, _T('R')},
+			{_T("replay-speed"),	required_argument,	0, _T('S')},
+			{_T("stats"),		optional_argument,	0, _T('s')},
+			{_T("retries"),		required_argument,	0, _T('n')},
+			{_T("watch"),		no_argument,		0, _T('w')},
+			{_T("metrics-file"),	required_argument,	0, _T('M')},
+			{_T("metrics-port"),	required_argument,	0, _T('P')},
 			{_T("help"),		no_argument,		0, _T('h')},
 
 			{NULL, 0, 0, 0}
 		};
 
-		int c = getopt_long(argc, argv, _T("b:d:h"), long_options, NULL);
+		int c = getopt_long(argc, argv, _T("b:d:D:g:i:t:r:R:S:s::n:wM:P:h"), long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -204,7 +298,152 @@ int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
 				}
 				break;
 
+			case _T('D'):
+				// DAT file.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no DAT filename specified"));
+					return EXIT_FAILURE;
+				}
+				load_options.dat_filename = optarg;
+				break;
+
+			case _T('g'):
+				// Game code.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no game code specified"));
+					return EXIT_FAILURE;
+				}
+				gamecode = optarg;
+				break;
+
+			case _T('i'):
+				// ROM index filename.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no ROM index filename specified"));
+					return EXIT_FAILURE;
+				}
+				index_filename = optarg;
+				break;
+
+			case _T('t'):
+				// Trace output filename.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no trace filename specified"));
+					return EXIT_FAILURE;
+				}
+				trace_filename = optarg;
+				break;
+
+			case _T('r'):
+				// Command stream recording filename.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no recording filename specified"));
+					return EXIT_FAILURE;
+				}
+				record_filename = optarg;
+				break;
+
+			case _T('R'):
+				// Command stream replay filename.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no replay filename specified"));
+					return EXIT_FAILURE;
+				}
+				replay_filename = optarg;
+				break;
+
+			case _T('S'): {
+				// Replay speed.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no replay speed specified"));
+					return EXIT_FAILURE;
+				}
+
+				TCHAR *endptr = nullptr;
+				replay_speed = _tcstod(optarg, &endptr);
+				if (*endptr != '\0' || replay_speed < 0) {
+					print_error(argv[0], _T("replay speed is invalid"));
+					return EXIT_FAILURE;
+				}
+				break;
+			}
+
+			case _T('s'):
+				// Load statistics.
+				if (!optarg || optarg[0] == '\0') {
+					stats_json = false;
+				} else if (!_tcsicmp(optarg, _T("json"))) {
+					stats_json = true;
+				} else {
+					print_error(argv[0], _T("statistics format '%s' is invalid"), optarg);
+					return EXIT_FAILURE;
+				}
+				stats = true;
+				load_options.progress = true;
+				// Keep stdout machine-readable for JSON.
+				load_options.info = (stats_json ? stderr : stdout);
+				break;
+
+			case _T('n'): {
+				// Upload chunk retries.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no retry count specified"));
+					return EXIT_FAILURE;
+				}
+
+				TCHAR *endptr = nullptr;
+				const unsigned long retries = _tcstoul(optarg, &endptr, 10);
+				if (*endptr != '\0' || retries > 100) {
+					print_error(argv[0], _T("retry count is invalid"));
+					return EXIT_FAILURE;
+				}
+				load_options.retries = (unsigned int)retries;
+				break;
+			}
+
+			case _T('w'):
+				// Watch the ROM image for changes.
+				watch = true;
+				break;
+
+			case _T('M'):
+				// Metrics textfile.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no metrics filename specified"));
+					return EXIT_FAILURE;
+				}
+				metrics_filename = optarg;
+				break;
+
+			case _T('P'): {
+				// Metrics HTTP port.
+				if (!optarg || optarg[0] == '\0') {
+					// NULL?
+					print_error(argv[0], _T("no metrics port specified"));
+					return EXIT_FAILURE;
+				}
+
+				TCHAR *endptr = nullptr;
+				const unsigned long port = _tcstoul(optarg, &endptr, 10);
+				if (*endptr != '\0' || port == 0 || port > 65535) {
+					print_error(argv[0], _T("metrics port is invalid"));
+					return EXIT_FAILURE;
+				}
+				metrics_port = (uint16_t)port;
+				break;
+			}
+
 			case _T('h'):
+				print_banner(stdout);
 				print_help(argv[0]);
 				return EXIT_SUCCESS;
 
@@ -215,23 +454,93 @@ int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
 		}
 	}
 
+	// NOTE: The banner is printed after parsing the options,
+	// since stdout is reserved for JSON with --stats=json.
+	print_banner(load_options.info);
+
 	// First argument after getopt-parsed arguments is set in optind.
 	if (optind >= argc) {
 		print_error(argv[0], _T("no parameters specified"));
 		return EXIT_FAILURE;
 	}
 
+	// Commands that don't need the IS-NITRO unit.
+	if (!_tcscmp(argv[optind], _T("index"))) {
+		// Create or update the ROM index.
+		if (argc < optind+2) {
+			print_error(argv[0], _T("no directories specified"));
+			return EXIT_FAILURE;
+		}
+		return update_rom_index(index_filename, argc - (optind+1), &argv[optind+1]);
+	}
+
 	int status = libusb_init(nullptr);
 	if (status < 0) {
 		fprintf(stderr, "*** ERROR: libusb_init() failed: %s\n", libusb_error_name(status));
 		return EXIT_FAILURE;
 	}
 
-	ISNitro *nitro = new ISNitro();
-	if (!nitro->isOpen()) {
-		fprintf(stderr, "*** ERROR: Unable to open the IS-NITRO unit.\n");
-		libusb_exit(nullptr);
-		return EXIT_FAILURE;
+	ISNitro *nitro;
+	NitroReplay *replay = nullptr;
+	if (replay_filename) {
+		// Replay a command stream log instead of using the hardware.
+		replay = new NitroReplay();
+		int err = replay->open(replay_filename);
+		if (err != 0) {
+			_ftprintf(stderr, _T("*** ERROR opening replay file '%s': %s\n"), replay_filename, strerror(-err));
+			delete replay;
+			libusb_exit(nullptr);
+			return EXIT_FAILURE;
+		}
+		replay->setSpeed(replay_speed);
+		nitro = new ISNitro(replay);
+	} else {
+		nitro = new ISNitro();
+		if (!nitro->isOpen()) {
+			fprintf(stderr, "*** ERROR: Unable to open the IS-NITRO unit.\n");
+			libusb_exit(nullptr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	NitroRecorder *recorder = nullptr;
+	if (record_filename) {
+		recorder = new NitroRecorder();
+		int err = recorder->open(record_filename);
+		if (err != 0) {
+			_ftprintf(stderr, _T("*** ERROR opening recording file '%s': %s\n"), record_filename, strerror(-err));
+			delete recorder;
+			delete nitro;
+			delete replay;
+			libusb_exit(nullptr);
+			return EXIT_FAILURE;
+		}
+		nitro->setRecorder(recorder);
+	}
+
+	NitroMetrics *metrics = nullptr;
+	MetricsExporter *exporter = nullptr;
+	if (metrics_filename || metrics_port != 0) {
+		metrics = new NitroMetrics();
+		nitro->setMetrics(metrics);
+		exporter = new MetricsExporter(metrics, nitro->location());
+		int err = exporter->start(metrics_filename, metrics_port);
+		if (err != 0) {
+			fprintf(stderr, "*** ERROR starting the metrics exporter: %s\n", strerror(err));
+			delete exporter;
+			delete metrics;
+			delete recorder;
+			delete nitro;
+			delete replay;
+			libusb_exit(nullptr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	NitroTrace *trace = nullptr;
+	if (trace_filename) {
+		trace = new NitroTrace();
+		nitro->setTrace(trace);
 	}
 
 	// Check the specified command.
@@ -249,16 +558,45 @@ int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
 		ret = nitro->fullReset();
 	} else if (!_tcscmp(argv[optind], _T("reset"))) {
 		// Reset: Reset the DS CPU only.
-		nitro->ndsReset(true);
-		usleep(500000);
-		ret = nitro->ndsReset(false);
+		ret = nitro->softReset();
+	} else if (!_tcscmp(argv[optind], _T("status"))) {
+		// Show the NDS status bits.
+		ret = print_status(nitro);
 	} else if (!_tcscmp(argv[optind], _T("load"))) {
 		// Load a ROM image.
-		if (argc < optind+2) {
+		LoadRomRecord record;
+		std::tstring filename;
+		if (gamecode) {
+			// Look up the ROM image in the ROM index.
+			ret = find_rom_in_index(index_filename, gamecode, filename, load_options.info);
+		} else if (argc < optind+2) {
 			print_error(argv[0], _T("Nintendo DS ROM image not specified"));
 			ret = EXIT_FAILURE;
 		} else {
-			ret = load_nds_rom(nitro, argv[optind+1]);
+			filename = argv[optind+1];
+		}
+
+		if (ret != 0) {
+			// Error finding the ROM image.
+		} else if (watch) {
+			ret = watch_nds_rom(nitro, filename.c_str(), &load_options, stats, stats_json);
+		} else {
+			ret = load_nds_rom(nitro, filename.c_str(), &load_options, &record);
+		}
+		if (ret == 0 && stats && !watch) {
+			print_load_stats(&record, stats_json);
+		}
+	} else if (!_tcscmp(argv[optind], _T("loadgba"))) {
+		// Load a GBA ROM image.
+		LoadRomRecord record;
+		if (argc < optind+2) {
+			print_error(argv[0], _T("Game Boy Advance ROM image not specified"));
+			ret = EXIT_FAILURE;
+		} else {
+			ret = load_gba_rom(nitro, argv[optind+1], &load_options, &record);
+		}
+		if (ret == 0 && stats) {
+			print_load_stats(&record, stats_json);
 		}
 	} else if (!_tcscmp(argv[optind], _T("avmode"))) {
 		// Set the AV mode.
@@ -303,7 +641,43 @@ int ORTIN_CDECL _tmain(int argc, TCHAR *argv[])
 		ret = EXIT_FAILURE;
 	}
 
+	if (trace) {
+		int err = trace->exportChromeTrace(trace_filename);
+		if (err != 0) {
+			_ftprintf(stderr, _T("*** ERROR writing trace file '%s': %s\n"), trace_filename, strerror(-err));
+		}
+		nitro->setTrace(nullptr);
+		delete trace;
+	}
+
+	if (recorder) {
+		nitro->setRecorder(nullptr);
+		if (recorder->close() != 0) {
+			_ftprintf(stderr, _T("*** ERROR writing recording file '%s'\n"), record_filename);
+		}
+		delete recorder;
+	}
+
+	if (replay) {
+		// Make sure the entire log was replayed.
+		const unsigned int remaining = replay->remaining();
+		fprintf(load_options.info, "Replay: %u transfer(s) replayed, %u not replayed%s.\n",
+			replay->replayed(), remaining, (replay->diverged() ? ", DIVERGED" : ""));
+		if ((replay->diverged() || remaining > 0) && ret == 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	if (exporter) {
+		// Write the final metrics.
+		exporter->stop();
+		delete exporter;
+		nitro->setMetrics(nullptr);
+		delete metrics;
+	}
+
 	delete nitro;
+	delete replay;
 	libusb_exit(nullptr);
 	return ret;
 }
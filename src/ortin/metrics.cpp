@@ -0,0 +1,262 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * metrics.cpp: Prometheus metrics export.                                 *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "metrics.hpp"
+#include "NitroMetrics.hpp"
+
+#ifndef _WIN32
+// Sockets
+# include <arpa/inet.h>
+# include <fcntl.h>
+# include <netinet/in.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <unistd.h>
+#endif /* !_WIN32 */
+
+// C includes. (C++ namespace)
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+// C++ includes.
+#include <chrono>
+#include <string>
+using std::string;
+
+#ifndef _WIN32
+# ifndef MSG_NOSIGNAL
+// macOS doesn't have MSG_NOSIGNAL. SO_NOSIGPIPE is used instead.
+#  define MSG_NOSIGNAL 0
+# endif
+
+/**
+ * Set FD_CLOEXEC on a file descriptor.
+ * NOTE: SOCK_CLOEXEC and accept4() aren't available on macOS.
+ * @param fd File descriptor.
+ */
+static void set_cloexec(int fd)
+{
+	const int flags = fcntl(fd, F_GETFD);
+	if (flags >= 0) {
+		fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+	}
+}
+#endif /* !_WIN32 */
+
+/**
+ * Create a metrics exporter.
+ * @param metrics Metrics to export.
+ * @param unit Unit name for the "unit" label.
+ */
+MetricsExporter::MetricsExporter(const NitroMetrics *metrics, const string &unit)
+	: m_metrics(metrics)
+	, m_unit(unit)
+	, m_listenFd(-1)
+	, m_stop(false)
+{ }
+
+/**
+ * Stop the exporter and write the textfile one last time.
+ */
+MetricsExporter::~MetricsExporter()
+{
+	stop();
+}
+
+/**
+ * Start the exporter.
+ * @param textfile Textfile filename. (nullptr for none)
+ * @param port HTTP port on 127.0.0.1. (0 for none)
+ * @return 0 on success; POSIX error code on error.
+ */
+int MetricsExporter::start(const TCHAR *textfile, uint16_t port)
+{
+	if (m_thread.joinable())
+		return EBUSY;
+	if (textfile) {
+		m_textfile = textfile;
+	}
+
+	if (port != 0) {
+#ifndef _WIN32
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return errno;
+		set_cloexec(fd);
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		// Only listen on localhost. Use a reverse proxy
+		// or node_exporter to expose metrics remotely.
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+			int err = errno;
+			close(fd);
+			return err;
+		}
+		m_listenFd = fd;
+#else /* _WIN32 */
+		// TODO: Winsock.
+		return ENOTSUP;
+#endif /* !_WIN32 */
+	}
+
+	if (m_textfile.empty() && m_listenFd < 0) {
+		// Nothing to do.
+		return 0;
+	}
+
+	m_stop.store(false);
+	m_thread = std::thread(&MetricsExporter::threadFunc, this);
+	return 0;
+}
+
+/**
+ * Stop the exporter and write the textfile one last time.
+ */
+void MetricsExporter::stop(void)
+{
+	if (m_thread.joinable()) {
+		m_stop.store(true);
+		m_thread.join();
+	}
+#ifndef _WIN32
+	if (m_listenFd >= 0) {
+		close(m_listenFd);
+		m_listenFd = -1;
+	}
+#endif /* !_WIN32 */
+	if (!m_textfile.empty()) {
+		writeTextfile();
+		m_textfile.clear();
+	}
+}
+
+/**
+ * Write the textfile.
+ * The file is replaced atomically so the collector
+ * never sees a partial file.
+ * @return 0 on success; POSIX error code on error.
+ */
+int MetricsExporter::writeTextfile(void)
+{
+	string text;
+	m_metrics->exportPrometheus(text, m_unit.c_str());
+
+	const std::tstring tmpfile = m_textfile + _T(".tmp");
+	errno = 0;
+	FILE *f = _tfopen(tmpfile.c_str(), _T("w"));
+	if (!f) {
+		int err = (errno != 0 ? errno : EIO);
+		_ftprintf(stderr, _T("*** ERROR writing metrics file '%s': %s\n"), tmpfile.c_str(), strerror(err));
+		return err;
+	}
+	size_t size = fwrite(text.data(), 1, text.size(), f);
+	int err = (size != text.size() || fclose(f) != 0 ? EIO : 0);
+	if (err == 0 && rename(tmpfile.c_str(), m_textfile.c_str()) != 0) {
+		err = errno;
+	}
+	if (err != 0) {
+		_ftprintf(stderr, _T("*** ERROR writing metrics file '%s': %s\n"), m_textfile.c_str(), strerror(err));
+	}
+	return err;
+}
+
+#ifndef _WIN32
+/**
+ * Handle an HTTP connection.
+ * @param fd Socket.
+ */
+void MetricsExporter::handleHttp(int fd)
+{
+	// Only the request line is needed.
+	char req[1024];
+	ssize_t len = 0;
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (len < (ssize_t)sizeof(req) - 1 && poll(&pfd, 1, 1000) > 0) {
+		ssize_t ret = recv(fd, &req[len], sizeof(req) - 1 - len, 0);
+		if (ret <= 0)
+			break;
+		len += ret;
+		req[len] = '\0';
+		if (strstr(req, "\r\n"))
+			break;
+	}
+	req[len] = '\0';
+
+	string body;
+	const char *status;
+	const char *type = "text/plain; version=0.0.4; charset=utf-8";
+	if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6)) {
+		status = "200 OK";
+		m_metrics->exportPrometheus(body, m_unit.c_str());
+	} else {
+		status = "404 Not Found";
+		type = "text/plain";
+		body = "Not found. Metrics are at /metrics.\n";
+	}
+
+	char hdr[256];
+	int hdrlen = snprintf(hdr, sizeof(hdr),
+		"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+		status, type, (unsigned int)body.size());
+	string resp(hdr, hdrlen);
+	resp += body;
+	for (size_t pos = 0; pos < resp.size(); ) {
+		ssize_t ret = send(fd, resp.data() + pos, resp.size() - pos, MSG_NOSIGNAL);
+		if (ret <= 0)
+			break;
+		pos += ret;
+	}
+}
+#endif /* !_WIN32 */
+
+/**
+ * Exporter thread function.
+ */
+void MetricsExporter::threadFunc(void)
+{
+	auto lastWrite = std::chrono::steady_clock::now();
+	while (!m_stop.load()) {
+#ifndef _WIN32
+		if (m_listenFd >= 0) {
+			struct pollfd pfd;
+			pfd.fd = m_listenFd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 250) > 0) {
+				int fd = accept(m_listenFd, nullptr, nullptr);
+				if (fd >= 0) {
+					set_cloexec(fd);
+#ifdef SO_NOSIGPIPE
+					int one = 1;
+					setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif /* SO_NOSIGPIPE */
+					handleHttp(fd);
+					close(fd);
+				}
+			}
+		} else
+#endif /* !_WIN32 */
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		if (!m_textfile.empty() && now - lastWrite >= std::chrono::seconds(TEXTFILE_INTERVAL)) {
+			writeTextfile();
+			lastWrite = now;
+		}
+	}
+}
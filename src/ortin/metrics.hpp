@@ -0,0 +1,99 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * metrics.hpp: Prometheus metrics export.                                 *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_ORTIN_METRICS_HPP__
+#define __ORTIN_ORTIN_METRICS_HPP__
+
+#include "tcharx.h"
+
+// C includes.
+#include <stdint.h>
+
+// C++ includes.
+#include <atomic>
+#include <string>
+#include <thread>
+
+class NitroMetrics;
+
+/**
+ * Prometheus metrics exporter.
+ *
+ * Metrics can be written to a file for node_exporter's textfile
+ * collector, served over HTTP on localhost, or both. A background
+ * thread rewrites the textfile periodically, so long-running
+ * commands such as 'load --watch' stay up to date.
+ */
+class MetricsExporter
+{
+	public:
+		/**
+		 * Create a metrics exporter.
+		 * @param metrics Metrics to export.
+		 * @param unit Unit name for the "unit" label.
+		 */
+		MetricsExporter(const NitroMetrics *metrics, const std::string &unit);
+
+		/**
+		 * Stop the exporter and write the textfile one last time.
+		 */
+		~MetricsExporter();
+
+	private:
+		MetricsExporter(const MetricsExporter &);
+		MetricsExporter &operator=(const MetricsExporter&);
+
+	public:
+		// Textfile update interval, in seconds.
+		static const unsigned int TEXTFILE_INTERVAL = 15;
+
+		/**
+		 * Start the exporter.
+		 * @param textfile Textfile filename. (nullptr for none)
+		 * @param port HTTP port on 127.0.0.1. (0 for none)
+		 * @return 0 on success; POSIX error code on error.
+		 */
+		int start(const TCHAR *textfile, uint16_t port);
+
+		/**
+		 * Stop the exporter and write the textfile one last time.
+		 */
+		void stop(void);
+
+	private:
+		/**
+		 * Write the textfile.
+		 * The file is replaced atomically so the collector
+		 * never sees a partial file.
+		 * @return 0 on success; POSIX error code on error.
+		 */
+		int writeTextfile(void);
+
+		/**
+		 * Handle an HTTP connection.
+		 * @param fd Socket.
+		 */
+		void handleHttp(int fd);
+
+		/**
+		 * Exporter thread function.
+		 */
+		void threadFunc(void);
+
+	private:
+		const NitroMetrics *const m_metrics;
+		const std::string m_unit;
+
+		std::tstring m_textfile;
+		int m_listenFd;
+
+		std::thread m_thread;
+		std::atomic<bool> m_stop;
+};
+
+#endif /* __ORTIN_ORTIN_METRICS_HPP__ */
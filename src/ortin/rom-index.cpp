@@ -0,0 +1,148 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * rom-index.cpp: 'index' command.                                         *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "rom-index.hpp"
+#include "RomIndex.hpp"
+
+// C includes.
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// C includes. (C++ namespace)
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// C++ includes.
+#include <string>
+using std::string;
+using std::tstring;
+
+/**
+ * Get the default ROM index filename.
+ * The containing directory is created if it doesn't exist.
+ * @return Default ROM index filename, or empty string on error.
+ */
+string default_rom_index_filename(void)
+{
+	string path;
+#ifdef _WIN32
+	const char *const localappdata = getenv("LOCALAPPDATA");
+	if (!localappdata || localappdata[0] == '\0')
+		return string();
+	path = localappdata;
+	path += "\\ortin";
+	_mkdir(path.c_str());
+	path += "\\rom-index.bin";
+#else /* !_WIN32 */
+	const char *const xdg_cache_home = getenv("XDG_CACHE_HOME");
+	if (xdg_cache_home && xdg_cache_home[0] == '/') {
+		path = xdg_cache_home;
+	} else {
+		const char *const home = getenv("HOME");
+		if (!home || home[0] == '\0')
+			return string();
+		path = home;
+		path += "/.cache";
+		mkdir(path.c_str(), 0700);
+	}
+	path += "/ortin";
+	mkdir(path.c_str(), 0700);
+	path += "/rom-index.bin";
+#endif /* _WIN32 */
+	return path;
+}
+
+/**
+ * Create or update the ROM index.
+ * @param index_filename ROM index filename. (nullptr for default)
+ * @param dircount Number of directories.
+ * @param dirs Directories to scan.
+ * @return 0 on success; non-zero on error.
+ */
+int update_rom_index(const TCHAR *index_filename, int dircount, TCHAR *const *dirs)
+{
+	string filename;
+	if (index_filename) {
+		filename = index_filename;
+	} else {
+		filename = default_rom_index_filename();
+		if (filename.empty()) {
+			fprintf(stderr, "*** ERROR: Unable to determine the ROM index filename.\n");
+			return ENOENT;
+		}
+	}
+
+	RomIndex::UpdateStats stats;
+	int ret = RomIndex::update(filename.c_str(), dirs, dircount, &stats);
+	if (ret != 0) {
+		fprintf(stderr, "*** ERROR updating ROM index '%s': %s\n", filename.c_str(), strerror(-ret));
+		return -ret;
+	}
+
+	printf("ROM index '%s' updated: %u ROM image(s), %u unchanged, %u hashed, %u removed.\n",
+		filename.c_str(), stats.scanned, stats.reused, stats.hashed, stats.removed);
+	return 0;
+}
+
+/**
+ * Look up a ROM image in the ROM index.
+ * @param index_filename	[in] ROM index filename. (nullptr for default)
+ * @param gamecode		[in] Game code, optionally followed by ":REV" for a specific revision.
+ * @param filename		[out] ROM image filename.
+ * @param info			[in] Output file for the result.
+ * @return 0 on success; non-zero on error.
+ */
+int find_rom_in_index(const TCHAR *index_filename, const TCHAR *gamecode, tstring &filename, FILE *info)
+{
+	// Parse the game code.
+	int rom_version = -1;
+	if (_tcslen(gamecode) < 4 || (gamecode[4] != '\0' && gamecode[4] != ':')) {
+		_ftprintf(stderr, _T("*** ERROR: Invalid game code '%s'.\n"), gamecode);
+		return EINVAL;
+	}
+	if (gamecode[4] == ':') {
+		TCHAR *endptr = nullptr;
+		long rev = _tcstoul(&gamecode[5], &endptr, 10);
+		if (gamecode[5] == '\0' || *endptr != '\0' || rev > 255) {
+			_ftprintf(stderr, _T("*** ERROR: Invalid ROM version in '%s'.\n"), gamecode);
+			return EINVAL;
+		}
+		rom_version = (int)rev;
+	}
+	char gc[4];
+	for (int i = 0; i < 4; i++) {
+		gc[i] = (char)_totupper(gamecode[i]);
+	}
+
+	string idxname;
+	if (index_filename) {
+		idxname = index_filename;
+	} else {
+		idxname = default_rom_index_filename();
+	}
+
+	RomIndex romIndex;
+	int ret = romIndex.open(idxname.c_str());
+	if (ret != 0) {
+		fprintf(stderr, "*** ERROR opening ROM index '%s': %s\n", idxname.c_str(), strerror(-ret));
+		fputs("Run `ortin index DIRECTORY` to create the ROM index.\n", stderr);
+		return -ret;
+	}
+
+	const RomIndexEntry *const entry = romIndex.find(gc, rom_version);
+	if (!entry) {
+		_ftprintf(stderr, _T("*** ERROR: Game code '%s' was not found in the ROM index.\n"), gamecode);
+		return ENOENT;
+	}
+
+	filename = romIndex.path(entry);
+	fprintf(info, "Found %.4s rev %u: %s\n", entry->gamecode, entry->rom_version, filename.c_str());
+	return 0;
+}
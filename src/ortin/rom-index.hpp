@@ -0,0 +1,46 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * rom-index.hpp: 'index' command.                                         *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_ORTIN_ROM_INDEX_HPP__
+#define __ORTIN_ORTIN_ROM_INDEX_HPP__
+
+#include "tcharx.h"
+
+// C includes.
+#include <stdio.h>
+
+// C++ includes.
+#include <string>
+
+/**
+ * Get the default ROM index filename.
+ * The containing directory is created if it doesn't exist.
+ * @return Default ROM index filename, or empty string on error.
+ */
+std::string default_rom_index_filename(void);
+
+/**
+ * Create or update the ROM index.
+ * @param index_filename ROM index filename. (nullptr for default)
+ * @param dircount Number of directories.
+ * @param dirs Directories to scan.
+ * @return 0 on success; non-zero on error.
+ */
+int update_rom_index(const TCHAR *index_filename, int dircount, TCHAR *const *dirs);
+
+/**
+ * Look up a ROM image in the ROM index.
+ * @param index_filename	[in] ROM index filename. (nullptr for default)
+ * @param gamecode		[in] Game code, optionally followed by ":REV" for a specific revision.
+ * @param filename		[out] ROM image filename.
+ * @param info			[in] Output file for the result.
+ * @return 0 on success; non-zero on error.
+ */
+int find_rom_in_index(const TCHAR *index_filename, const TCHAR *gamecode, std::tstring &filename, FILE *info = stdout);
+
+#endif /* __ORTIN_ORTIN_ROM_INDEX_HPP__ */
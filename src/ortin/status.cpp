@@ -0,0 +1,54 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * status.cpp: 'status' command.                                           *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "status.hpp"
+#include "ISNitro.hpp"
+
+// C includes. (C++ namespace)
+#include <cstdio>
+
+/**
+ * Status bit.
+ */
+struct StatusBit {
+	const char *name;	// Display name
+	uint8_t reg;		// Register: 0 == REG0, 1 == REG1
+	uint16_t bit;		// Bit
+};
+
+static const StatusBit status_bits[] = {
+	{"Power",		1, NITRO_NEC_NDS_REG1_POWER},
+	{"Reset",		0, NITRO_NEC_NDS_REG0_RESET},
+	{"Boot complete",	1, NITRO_NEC_NDS_REG1_BOOT_COMPLETE},
+	{"Cover",		0, NITRO_NEC_NDS_REG0_COVER},
+	{"Debug button",	0, NITRO_NEC_NDS_REG0_DEBUG_BUTTON},
+	{"Write protection",	1, NITRO_NEC_NDS_REG1_WRITE_PROTECTION},
+};
+
+/**
+ * Print the NDS status bits from the NEC status registers.
+ * This is a single USB command, so it's safe to call while
+ * a game is running.
+ * @param nitro	[in] IS-NITRO object.
+ * @return 0 on success; libusb error code on error.
+ */
+int print_status(ISNitro *nitro)
+{
+	uint16_t regs[2];
+	int ret = nitro->readNDSStatus(&regs[0], &regs[1]);
+	if (ret < 0) {
+		fprintf(stderr, "*** ERROR reading the NDS status: %s\n", libusb_error_name(ret));
+		return ret;
+	}
+
+	printf("REG0: 0x%04X, REG1: 0x%04X\n", regs[0], regs[1]);
+	for (const StatusBit &sb : status_bits) {
+		printf("%-18s%s\n", sb.name, (regs[sb.reg] & sb.bit) ? "yes" : "no");
+	}
+	return 0;
+}
@@ -0,0 +1,23 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * status.hpp: 'status' command.                                           *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_ORTIN_STATUS_HPP__
+#define __ORTIN_ORTIN_STATUS_HPP__
+
+class ISNitro;
+
+/**
+ * Print the NDS status bits from the NEC status registers.
+ * This is a single USB command, so it's safe to call while
+ * a game is running.
+ * @param nitro	[in] IS-NITRO object.
+ * @return 0 on success; libusb error code on error.
+ */
+int print_status(ISNitro *nitro);
+
+#endif /* __ORTIN_ORTIN_STATUS_HPP__ */
@@ -0,0 +1,241 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * watch-rom.cpp: 'load --watch' command.                                  *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#include "watch-rom.hpp"
+#include "load-rom.hpp"
+
+#ifdef __linux__
+// inotify
+# include <fcntl.h>
+# include <poll.h>
+# include <signal.h>
+# include <sys/inotify.h>
+# include <unistd.h>
+#endif /* __linux__ */
+
+// C includes. (C++ namespace)
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+// C++ includes.
+#include <string>
+using std::string;
+
+#ifdef __linux__
+// Time without changes before a modified ROM image is reloaded, in milliseconds.
+// Linkers and packers may write the file in several passes.
+static const int DEBOUNCE_MS = 300;
+
+// Self-pipe for SIGINT and SIGTERM.
+// The signal may be delivered to any thread, so the handler
+// wakes up the watch loop through the pipe.
+static int stop_pipe[2] = {-1, -1};
+
+/**
+ * SIGINT/SIGTERM handler.
+ * @param sig Signal number.
+ */
+static void stop_handler(int sig)
+{
+	(void)sig;
+	const char c = 0;
+	ssize_t ret = write(stop_pipe[1], &c, 1);
+	(void)ret;
+}
+
+/**
+ * Read pending inotify events.
+ * @param fd inotify file descriptor.
+ * @param name Filename to match. (no directory)
+ * @return 1 if the file was changed; 0 if not; negative POSIX error code on error.
+ */
+static int read_events(int fd, const string &name)
+{
+	// NOTE: Must be aligned for struct inotify_event.
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len = read(fd, buf, sizeof(buf));
+	if (len < 0) {
+		return (errno == EAGAIN || errno == EINTR ? 0 : -errno);
+	}
+
+	int changed = 0;
+	for (char *p = buf; p < buf + len; ) {
+		const struct inotify_event *const event = reinterpret_cast<const struct inotify_event*>(p);
+		if (event->len > 0 && name == event->name) {
+			changed = 1;
+		}
+		p += sizeof(struct inotify_event) + event->len;
+	}
+	return changed;
+}
+
+/**
+ * Load the ROM image and print the result.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in] Load options.
+ * @param stats		[in] If true, print load statistics.
+ * @param stats_json	[in] If true, print load statistics as JSON.
+ */
+static void load_and_report(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, bool stats, bool stats_json)
+{
+	LoadRomRecord record;
+	int ret = load_nds_rom(nitro, filename, options, &record);
+	if (ret != 0) {
+		fputs("*** Load failed; waiting for the next change.\n", stderr);
+		return;
+	}
+
+	fprintf(options->info, "Loaded in %.1f ms (%.1f of %.1f MB sent)\n",
+		(double)record.times.total / 1000.0,
+		(double)record.bytes_sent / 1048576.0,
+		(double)record.rom_size / 1048576.0);
+	if (stats) {
+		print_load_stats(&record, stats_json);
+	}
+	fflush(stdout);
+	fflush(options->info);
+}
+#endif /* __linux__ */
+
+/**
+ * Load a Nintendo DS ROM image and reload it whenever it changes.
+ * Changes are debounced so partially-written files aren't loaded.
+ * Reloads only upload the blocks that changed.
+ * Watching stops on SIGINT or SIGTERM, e.g. Ctrl-C.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in] Load options.
+ * @param stats		[in] If true, print load statistics after each load.
+ * @param stats_json	[in] If true, print load statistics as JSON.
+ * @return 0 if stopped by a signal; non-zero on error.
+ */
+int watch_nds_rom(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, bool stats, bool stats_json)
+{
+#ifdef __linux__
+	// Watch the directory instead of the file, since many tools
+	// replace the file by renaming a temporary file over it.
+	const string path(filename);
+	const size_t slash = path.rfind('/');
+	const string dir = (slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash)));
+	const string name = (slash == string::npos ? path : path.substr(slash + 1));
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		int err = errno;
+		fprintf(stderr, "*** ERROR: inotify_init1() failed: %s\n", strerror(err));
+		return err;
+	}
+	if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0) {
+		int err = errno;
+		fprintf(stderr, "*** ERROR: Unable to watch '%s': %s\n", dir.c_str(), strerror(err));
+		close(fd);
+		return err;
+	}
+
+	// Stop watching on SIGINT and SIGTERM so the caller can shut down
+	// normally. SA_RESETHAND: A second Ctrl-C terminates immediately.
+	if (pipe2(stop_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+		int err = errno;
+		fprintf(stderr, "*** ERROR: pipe2() failed: %s\n", strerror(err));
+		close(fd);
+		return err;
+	}
+	struct sigaction sa, old_sigint, old_sigterm;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_sigint);
+	sigaction(SIGTERM, &sa, &old_sigterm);
+
+	// The session remembers what's in EMULATOR memory.
+	LoadRomSession session;
+	LoadRomOptions watchOptions = *options;
+	watchOptions.session = &session;
+
+	load_and_report(nitro, filename, &watchOptions, stats, stats_json);
+	int ret = 0;
+	bool stop = false;
+	while (!stop) {
+		fprintf(watchOptions.info, "Watching '%s' for changes. Press Ctrl-C to exit.\n", filename);
+		fflush(watchOptions.info);
+
+		// Wait for the ROM image to change, then wait until
+		// it stops changing.
+		int timeout = -1;
+		while (true) {
+			struct pollfd pfd[2];
+			pfd[0].fd = fd;
+			pfd[0].events = POLLIN;
+			pfd[0].revents = 0;
+			pfd[1].fd = stop_pipe[0];
+			pfd[1].events = POLLIN;
+			pfd[1].revents = 0;
+			int pret = poll(pfd, 2, timeout);
+			if (pret < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -errno;
+				break;
+			} else if (pret == 0) {
+				// No changes during the debounce period.
+				break;
+			}
+
+			if (pfd[1].revents) {
+				// SIGINT or SIGTERM.
+				stop = true;
+				break;
+			}
+
+			ret = read_events(fd, name);
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				timeout = DEBOUNCE_MS;
+			}
+		}
+		if (ret < 0) {
+			fprintf(stderr, "*** ERROR: Reading inotify events failed: %s\n", strerror(-ret));
+			break;
+		}
+		if (stop) {
+			fputs("\nStopped watching.\n", watchOptions.info);
+			break;
+		}
+		if (access(filename, R_OK) != 0) {
+			// File was deleted. Wait for it to be recreated.
+			continue;
+		}
+
+		fprintf(watchOptions.info, "\n'%s' changed; reloading.\n", filename);
+		load_and_report(nitro, filename, &watchOptions, stats, stats_json);
+	}
+
+	sigaction(SIGINT, &old_sigint, nullptr);
+	sigaction(SIGTERM, &old_sigterm, nullptr);
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	stop_pipe[0] = -1;
+	stop_pipe[1] = -1;
+	close(fd);
+	return (ret < 0 ? -ret : 0);
+#else /* !__linux__ */
+	// TODO: ReadDirectoryChangesW() on Windows.
+	(void)nitro;
+	(void)options;
+	(void)stats;
+	(void)stats_json;
+	_ftprintf(stderr, _T("*** ERROR: Watching '%s' is not supported on this platform.\n"), filename);
+	return ENOTSUP;
+#endif /* __linux__ */
+}
@@ -0,0 +1,32 @@
+/***************************************************************************
+ * Ortin (IS-NITRO management) (ortin CLI)                                 *
+ * watch-rom.hpp: 'load --watch' command.                                  *
+ *                                                                         *
+ * Copyright (c) 2020 by David Korth.                                      *
+ * SPDX-License-Identifier: GPL-2.0-or-later                               *
+ ***************************************************************************/
+
+#ifndef __ORTIN_ORTIN_WATCH_ROM_HPP__
+#define __ORTIN_ORTIN_WATCH_ROM_HPP__
+
+#include "tcharx.h"
+
+class ISNitro;
+struct LoadRomOptions;
+
+/**
+ * Load a Nintendo DS ROM image and reload it whenever it changes.
+ * Changes are debounced so partially-written files aren't loaded.
+ * Reloads only upload the blocks that changed.
+ * This function doesn't return unless an error occurs.
+ * @param nitro		[in] IS-NITRO object.
+ * @param filename	[in] ROM image filename.
+ * @param options	[in] Load options.
+ * @param stats		[in] If true, print load statistics after each load.
+ * @param stats_json	[in] If true, print load statistics as JSON.
+ * @return Non-zero on error.
+ */
+int watch_nds_rom(ISNitro *nitro, const TCHAR *filename,
+	const LoadRomOptions *options, bool stats, bool stats_json);
+
+#endif /* __ORTIN_ORTIN_WATCH_ROM_HPP__ */
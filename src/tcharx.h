@@ -51,6 +51,7 @@ typedef char TCHAR;
 #define _tcscmp(s1, s2)			strcmp((s1), (s2))
 #define _tcsicmp(s1, s2)		strcasecmp((s1), (s2))
 #define _tcsnicmp(s1, s2)		strncasecmp((s1), (s2), (n))
+#define _tcstod(nptr, endptr)		strtod((nptr), (endptr))
 #define _tcstoul(nptr, endptr, base)	strtoul((nptr), (endptr), (base))
 
 // string.h